@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 
 #include <nlohmann/json.hpp>
 
@@ -14,12 +15,20 @@
 #include <mutex>
 #include <vector>
 #include <map>
+#include <deque>
 #include <atomic>
 #include <algorithm>
 #include <cstring>
+#include <chrono>
+#include <fstream>
 
 using json = nlohmann::json;
 
+const int RECONNECT_ATTEMPTS = 30;          // Tries before giving up on a dropped connection
+const int RECONNECT_MAX_MS = 5000;          // Longest wait between tries
+const size_t DELTA_CHUNK_LINES = 16;        // Lines per hashed chunk in a delta request
+const uint64_t HASH_BASE = 1099511628211ULL; // FNV prime, as on the server
+
 // Struct to represent a collaborator
 struct Collaborator {
     std::string name;
@@ -31,6 +40,22 @@ struct Collaborator {
 // Global variables
 std::vector<std::string> shared_buffer = {""};
 std::mutex buffer_mutex;
+uint64_t buffer_revision = 0;               // Last server revision reflected in shared_buffer
+bool synced = false;                        // A snapshot has been loaded
+uint64_t snapshot_revision = 0;             // Revision of the snapshot being streamed in
+std::deque<json> pending_messages;          // Operations/acks waiting for an earlier revision or snapshot
+std::map<uint64_t, json> unacked_ops;       // Our operations not yet acked, by sequence number
+uint64_t next_cseq = 0;                     // Sequence number of our last operation
+bool connected = false;                     // Operations go out as they are made; otherwise they wait in unacked_ops
+bool read_only = false;                     // Connected to a follower; edits are refused there
+bool observing = false;                     // Joined as an observer: watching, never a user
+size_t max_packet_bytes = 0;                // Server's quota on one packet; larger pastes are refused (0: none given)
+std::vector<std::string> stale_copy;        // Old copy of the document to resync against by delta
+std::string cache_path;                     // Where the document is kept between runs
+bool repairing = false;                     // Descending the server's tree at snapshot_revision
+std::map<size_t, json> repair_pieces;       // Server line start -> {"keep": count} or {"lines": [...]}
+size_t repair_lines = 0;                    // Server line count at snapshot_revision
+std::map<uint64_t, std::string> fragments;  // Partially received bulk packets, by id
 
 std::map<std::string, Collaborator> collaborators; // name -> Collaborator
 std::mutex collaborators_mutex;
@@ -41,7 +66,24 @@ sf::Color user_color = sf::Color::Black;
 std::atomic<bool> running(true);
 
 // Networking variables
-int sockfd;
+std::atomic<int> sockfd(-1);                // -1 while reconnecting
+struct sockaddr_in server_addr;             // Server address, reused for the UDP side channel
+std::string server_ip = "127.0.0.1";        // Server IP, or the path of its AF_UNIX socket
+unsigned short server_port = 8555;
+bool use_unix = false;                      // server_ip is an AF_UNIX socket path
+std::string session_token;                  // Session to resume after the connection drops
+std::string home_address;                   // Server first chosen, "host:port" or a socket path
+std::string document_name = "default";      // Document to open; routing servers send us to its node
+std::vector<std::string> failover_servers;  // Standbys of the server, in the order they take over
+std::string redirect_address;               // Server we were sent to, tried first on reconnect
+uint64_t leader_epoch = 0;                  // Newest leadership epoch seen; older servers are passed over
+
+// UDP side channel for cursor/presence traffic
+std::atomic<int> udp_sockfd(-1);            // Set once the channel is open
+std::string udp_token;                      // Changes when a session is resumed (guarded by udp_mutex)
+std::mutex udp_mutex;
+std::atomic<bool> udp_ready(false);         // Server has received our datagrams
+std::atomic<uint64_t> udp_send_seq(0);
 
 // Function to convert hex color string to SFML Color
 sf::Color hex_to_color(const std::string& hex) {
@@ -68,6 +110,7 @@ bool send_all(int sockfd, const std::string& message) {
 
 // Function to send JSON messages over the socket
 bool send_json(const json& message) {
+    if (sockfd < 0) return false;  // Reconnecting
     std::string msg_str = message.dump() + "\n";
     if (!send_all(sockfd, msg_str)) {
         std::cerr << "Failed to send message to server." << std::endl;
@@ -76,165 +119,98 @@ bool send_json(const json& message) {
     return true;
 }
 
-// Function to handle incoming messages from the server
-void receive_messages() {
-    char buffer[4096];
-    std::string recv_buffer = "";
-    while (running) {
-        ssize_t n = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-        if (n > 0) {
-            buffer[n] = '\0';
-            recv_buffer += buffer;
-            size_t pos = 0;
-            while ((pos = recv_buffer.find('\n')) != std::string::npos) {
-                std::string line = recv_buffer.substr(0, pos);
-                recv_buffer.erase(0, pos + 1);
-                if (line.empty()) continue;
-                try {
-                    json message = json::parse(line);
-                    if (message["packet_type"] == "message") {
-                        std::string msg_type = message["data"]["message_type"];
-                        if (msg_type == "connect_success") {
-                            // Receive initial buffer and collaborators
-                            {
-                                std::lock_guard<std::mutex> lock(buffer_mutex);
-                                shared_buffer = message["data"]["buffer"].get<std::vector<std::string>>();
-                            }
-                            // Receive collaborators
-                            json collabs = message["data"]["collaborators"];
-                            std::lock_guard<std::mutex> lock(collaborators_mutex);
-                            for (const auto& collab : collabs) {
-                                Collaborator c;
-                                c.name = collab["name"];
-                                c.color = hex_to_color(collab["color"].get<std::string>());
-                                c.cursor_x = collab["cursor"]["x"];
-                                c.cursor_y = collab["cursor"]["y"];
-                                collaborators[c.name] = c;
-                            }
-                            // Update user's color if provided
-                            if (message["data"].contains("color")) {
-                                user_color = hex_to_color(message["data"]["color"].get<std::string>());
-                            }
-                            std::cout << "Connected to server successfully." << std::endl;
-                        }
-                        else if (msg_type == "error_newname_invalid" || msg_type == "error_newname_taken") {
-                            std::cout << "Error: " << message["data"]["message"] << std::endl;
-                            running = false;
-                            break;
-                        }
-                        else {
-                            // Handle other message types if needed
-                        }
-                    }
-                    else if (message["packet_type"] == "user_event") {
-                        std::string event = message["data"]["event"];
-                        if (event == "user_connected") {
-                            json user = message["data"]["user"];
-                            Collaborator c;
-                            c.name = user["name"];
-                            c.color = hex_to_color(user["color"].get<std::string>());
-                            c.cursor_x = user["cursor"]["x"];
-                            c.cursor_y = user["cursor"]["y"];
-                            std::lock_guard<std::mutex> lock(collaborators_mutex);
-                            collaborators[c.name] = c;
-                            std::cout << "User '" << c.name << "' connected." << std::endl;
-                        }
-                        else if (event == "user_disconnected") {
-                            std::string name = message["data"]["user"]["name"];
-                            std::lock_guard<std::mutex> lock(collaborators_mutex);
-                            collaborators.erase(name);
-                            std::cout << "User '" << name << "' disconnected." << std::endl;
-                        }
-                    }
-                    else if (message["packet_type"] == "operation") {
-                        // Handle incoming operation
-                        json data = message["data"];
-                        std::string op_type = data["type"];
-                        int x = data["position"]["x"];
-                        int y = data["position"]["y"];
-                        std::string character = data["character"];
-
-                        std::lock_guard<std::mutex> lock(buffer_mutex);
-                        if (op_type == "insert") {
-                            if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
-                                shared_buffer[y].insert(shared_buffer[y].begin() + x, character[0]);
-                            }
-                        }
-                        else if (op_type == "delete") {
-                            if (y < shared_buffer.size() && x < shared_buffer[y].size()) {
-                                shared_buffer[y].erase(shared_buffer[y].begin() + x);
-                            }
-                        }
-                        else if (op_type == "insert_newline") {
-                            if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
-                                std::string new_line = shared_buffer[y].substr(x);
-                                shared_buffer[y] = shared_buffer[y].substr(0, x);
-                                shared_buffer.insert(shared_buffer.begin() + y + 1, new_line);
-                            }
-                        }
-                        else if (op_type == "delete_newline") {
-                            if (y < shared_buffer.size() && y > 0) {
-                                int prev_y = y - 1;
-                                shared_buffer[prev_y] += shared_buffer[y];
-                                shared_buffer.erase(shared_buffer.begin() + y);
-                            }
-                        }
+// Function to send our cursor position, over UDP once the side channel is up
+void send_cursor(int cursor_x, int cursor_y) {
+    if (udp_sockfd >= 0) {
+        std::lock_guard<std::mutex> lock(udp_mutex);
+        json datagram = {
+            {"token", udp_token},
+            {"seq", ++udp_send_seq},
+            {"cursor", { {"x", cursor_x}, {"y", cursor_y} }}
+        };
+        std::string msg_str = datagram.dump();
+        send(udp_sockfd, msg_str.data(), msg_str.size(), 0);
+        if (udp_ready) return;
+    }
+    // Fall back to TCP until the server confirms datagrams get through
+    json cursor_msg = {
+        {"packet_type", "update"},
+        {"data", {
+            {"cursor", { {"x", cursor_x}, {"y", cursor_y} }}
+        }}
+    };
+    send_json(cursor_msg);
+}
 
-                        std::cout << "Applied operation '" << op_type << "' from server." << std::endl;
-                    }
-                    else if (message["packet_type"] == "update") {
-                        // Handle cursor position updates from other users
-                        std::string user_name = message["data"]["name"];
-                        int cursor_x = message["data"]["cursor"]["x"];
-                        int cursor_y = message["data"]["cursor"]["y"];
-
-                        std::lock_guard<std::mutex> lock(collaborators_mutex);
-                        if (collaborators.find(user_name) != collaborators.end()) {
-                            collaborators[user_name].cursor_x = cursor_x;
-                            collaborators[user_name].cursor_y = cursor_y;
-                        }
-                        else {
-                            // Optionally handle cases where the user is not in the collaborators map
-                            // For example, add the user to the map
-                            Collaborator new_collab;
-                            new_collab.name = user_name;
-                            new_collab.color = sf::Color::White; // Default color or handle appropriately
-                            new_collab.cursor_x = cursor_x;
-                            new_collab.cursor_y = cursor_y;
-                            collaborators[user_name] = new_collab;
-                        }
-                    }
-                }
-                catch (json::parse_error& e) {
-                    std::cerr << "JSON parse error: " << e.what() << std::endl;
-                }
-            }
-        }
-        else if (n == 0) {
-            std::cout << "Server closed the connection." << std::endl;
-            running = false;
+// Function to handle presence datagrams from the server
+void receive_udp_messages() {
+    char buffer[65536];
+    uint64_t last_seq = 0;
+    while (running) {
+        ssize_t n = recv(udp_sockfd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
             return;
         }
-        else {
-            if (errno == EINTR)
-                continue;
-            perror("Recv error");
-            running = false;
-            return;
+        json message = json::parse(std::string(buffer, n), nullptr, false);
+        if (!message.is_object() || message["packet_type"] != "presence") continue;
+
+        // Datagrams may arrive out of order; an older presence frame is stale
+        uint64_t seq = message["data"]["seq"];
+        if (seq <= last_seq) continue;
+        last_seq = seq;
+
+        std::lock_guard<std::mutex> lock(collaborators_mutex);
+        for (const auto& entry : message["data"]["cursors"]) {
+            auto it = collaborators.find(entry["name"].get<std::string>());
+            if (it == collaborators.end()) continue;
+            it->second.cursor_x = entry["cursor"]["x"];
+            it->second.cursor_y = entry["cursor"]["y"];
         }
     }
 }
 
-// Function to apply an operation to the local buffer
+// Function to open the UDP side channel offered in connect_success.
+// A resumed session gets a new token; the open channel switches to it.
+void start_udp_channel(const json& udp_info) {
+    std::lock_guard<std::mutex> lock(udp_mutex);
+    udp_token = udp_info["token"];
+    udp_ready = false;
+    if (udp_sockfd >= 0) {
+        json hello = { {"token", udp_token}, {"seq", ++udp_send_seq} };
+        std::string msg_str = hello.dump();
+        send(udp_sockfd, msg_str.data(), msg_str.size(), 0);
+        return;
+    }
+    struct sockaddr_in udp_addr = server_addr;
+    udp_addr.sin_port = htons(udp_info["port"].get<unsigned short>());
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&udp_addr, sizeof(udp_addr)) < 0) {
+        perror("UDP side channel unavailable");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    udp_sockfd = fd;
+    std::thread udp_thread(receive_udp_messages);
+    udp_thread.detach();
+
+    // Bind our address to the session before the cursor first moves
+    json hello = { {"token", udp_token}, {"seq", ++udp_send_seq} };
+    std::string msg_str = hello.dump();
+    send(udp_sockfd, msg_str.data(), msg_str.size(), 0);
+}
+
+// Function to apply an operation to the local buffer.
+// Caller must hold buffer_mutex.
 void apply_operation(const json& operation) {
     std::string op_type = operation["type"];
     int x = operation["position"]["x"];
     int y = operation["position"]["y"];
-    std::string character = operation["character"];
+    std::string character = operation.value("character", std::string());
 
-    std::lock_guard<std::mutex> lock(buffer_mutex);
     if (op_type == "insert") {
-        if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
+        if (y < shared_buffer.size() && x <= shared_buffer[y].size() && !character.empty()) {
             shared_buffer[y].insert(shared_buffer[y].begin() + x, character[0]);
         }
     }
@@ -257,6 +233,650 @@ void apply_operation(const json& operation) {
             shared_buffer.erase(shared_buffer.begin() + y);
         }
     }
+    else if (op_type == "insert_text") {
+        // Pasted text, or text brought back by undo; may span lines
+        if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
+            std::string text = operation["text"];
+            std::string tail = shared_buffer[y].substr(x);
+            shared_buffer[y].resize(x);
+            size_t start = 0, next;
+            while ((next = text.find('\n', start)) != std::string::npos) {
+                shared_buffer[y++] += text.substr(start, next - start);
+                shared_buffer.insert(shared_buffer.begin() + y, std::string());
+                start = next + 1;
+            }
+            shared_buffer[y] += text.substr(start) + tail;
+        }
+    }
+    else if (op_type == "delete_range") {
+        int end_x = operation["end"]["x"];
+        int end_y = operation["end"]["y"];
+        if (y <= end_y && end_y < shared_buffer.size() && x <= shared_buffer[y].size() &&
+            end_x <= shared_buffer[end_y].size() && (y < end_y || x <= end_x)) {
+            shared_buffer[y] = shared_buffer[y].substr(0, x) + shared_buffer[end_y].substr(end_x);
+            shared_buffer.erase(shared_buffer.begin() + y + 1, shared_buffer.begin() + end_y + 1);
+        }
+    }
+}
+
+// Function to send a locally applied operation, remembering it until the server acks it.
+// Caller must hold buffer_mutex.
+bool send_operation(json operation) {
+    uint64_t cseq = ++next_cseq;
+    operation["data"]["cseq"] = cseq;
+    unacked_ops[cseq] = operation["data"];
+    return connected && send_json(operation);
+}
+
+// Function to apply an operation or ack that continues buffer_revision.
+// Caller must hold buffer_mutex.
+void apply_revisioned(const json& message) {
+    const json& data = message["data"];
+    if (message["packet_type"] == "operation") {
+        apply_operation(data);
+        std::cout << "Applied operation '" << data["type"].get<std::string>() << "' from server." << std::endl;
+    }
+    else {
+        // Our own operation; it is already in the local buffer
+        unacked_ops.erase(data.value("cseq", 0));
+    }
+    buffer_revision = data["revision"];
+}
+
+// Function to apply queued operations/acks that now continue buffer_revision.
+// Caller must hold buffer_mutex.
+void drain_pending() {
+    while (!pending_messages.empty()) {
+        uint64_t revision = pending_messages.front()["data"]["revision"];
+        if (revision > buffer_revision + 1) break;  // Still missing something; wait for a snapshot
+        if (revision == buffer_revision + 1) apply_revisioned(pending_messages.front());
+        pending_messages.pop_front();
+    }
+}
+
+// Function to replace the collaborator list with the one in a full-state message
+void set_collaborators(const json& data) {
+    std::lock_guard<std::mutex> lock(collaborators_mutex);
+    collaborators.clear();
+    for (const auto& collab : data["collaborators"]) {
+        Collaborator c;
+        c.name = collab["name"];
+        c.color = hex_to_color(collab["color"].get<std::string>());
+        c.cursor_x = collab["cursor"]["x"];
+        c.cursor_y = collab["cursor"]["y"];
+        collaborators[c.name] = c;
+    }
+}
+
+// Function to start loading a full-state message (connect_success or resync):
+// its revision and the complete collaborator list. The buffer follows in
+// snapshot_chunk packets; edits stay queued and input is ignored until then.
+void begin_snapshot(const json& data) {
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        snapshot_revision = data.value("revision", 0);
+        synced = false;
+        repairing = false;
+    }
+    set_collaborators(data);
+}
+
+// Function to hash one line (64-bit FNV-1a), the same way the server does
+uint64_t line_hash(const std::string& line) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : line) {
+        hash ^= c;
+        hash *= HASH_BASE;
+    }
+    return hash;
+}
+
+// Function to ask for a delta against stale_copy instead of the whole document:
+// one hash per DELTA_CHUNK_LINES whole lines, folded from the line hashes
+void send_delta_request() {
+    json hashes = json::array();
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        for (size_t first = 0; first + DELTA_CHUNK_LINES <= stale_copy.size(); first += DELTA_CHUNK_LINES) {
+            uint64_t hash = 0;
+            for (size_t i = first; i < first + DELTA_CHUNK_LINES; ++i) hash = hash * HASH_BASE + line_hash(stale_copy[i]);
+            hashes.push_back(hash);
+        }
+    }
+    json request = {
+        {"packet_type", "delta_request"},
+        {"data", { {"chunk_lines", DELTA_CHUNK_LINES}, {"hashes", hashes} }}
+    };
+    send_json(request);
+}
+
+// Function to settle our unacked operations once the server has taken us back.
+// It reports the last sequence number it processed for our session; anything
+// after that never arrived and is sent again, in order. A new session means
+// the old one expired, and with it any record of what was applied.
+void resume_operations(const json& data) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    std::string token = data.value("session", "");
+    if (token != session_token) {
+        unacked_ops.clear();
+    }
+    else {
+        uint64_t acked_cseq = data.value("acked_cseq", 0);
+        unacked_ops.erase(unacked_ops.begin(), unacked_ops.upper_bound(acked_cseq));
+    }
+    session_token = token;
+    connected = true;
+    for (const auto& [cseq, operation] : unacked_ops) {
+        send_json({ {"packet_type", "operation"}, {"data", operation} });
+    }
+}
+
+// Function to remember the leadership epoch, and where to go should the server fail
+void note_servers(const json& data) {
+    leader_epoch = std::max(leader_epoch, data.value("epoch", leader_epoch));
+    if (data.contains("servers")) failover_servers = data["servers"].get<std::vector<std::string>>();
+}
+
+// Function to complete a snapshot: the buffer now matches snapshot_revision.
+// Caller must hold buffer_mutex.
+void finish_snapshot() {
+    buffer_revision = snapshot_revision;
+    synced = true;
+
+    // Our operations acked at or before the snapshot are part of it ...
+    for (const auto& pending : pending_messages) {
+        if (pending["packet_type"] == "ack" && pending["data"]["revision"] <= buffer_revision) {
+            unacked_ops.erase(pending["data"].value("cseq", 0));
+        }
+    }
+    // ... the rest are still only ours, so put them back on top
+    for (const auto& [cseq, operation] : unacked_ops) {
+        apply_operation(operation);
+    }
+    drain_pending();
+}
+
+// Function to add one slice of the streamed buffer, shown as it arrives.
+// The final slice completes the snapshot.
+void apply_snapshot_chunk(const json& data) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (synced || data["revision"] != snapshot_revision) return;  // Superseded by a newer snapshot
+    if (data["start"] == 0) shared_buffer.clear();
+    for (const auto& line : data["lines"]) shared_buffer.push_back(line);
+    if (shared_buffer.empty()) shared_buffer.push_back("");
+    if (data["final"]) finish_snapshot();
+}
+
+// Function to rebuild the buffer from stale_copy and a delta: each element is
+// either [first, count], that many of our chunks, or one literal line
+void apply_delta(const json& data) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (synced || data["revision"] != snapshot_revision) return;  // Superseded by a newer snapshot
+    std::vector<std::string> rebuilt;
+    for (const auto& element : data["ops"]) {
+        if (element.is_string()) {
+            rebuilt.push_back(element);
+            continue;
+        }
+        size_t first = element[0].get<size_t>() * DELTA_CHUNK_LINES;
+        size_t count = element[1].get<size_t>() * DELTA_CHUNK_LINES;
+        if (first + count > stale_copy.size()) {
+            // Not a delta of our copy; reconnect for the whole document
+            stale_copy.clear();
+            shutdown(sockfd, SHUT_RDWR);
+            return;
+        }
+        rebuilt.insert(rebuilt.end(), stale_copy.begin() + first, stale_copy.begin() + first + count);
+    }
+    if (rebuilt.empty()) rebuilt.push_back("");
+    shared_buffer.swap(rebuilt);
+    stale_copy.clear();
+    finish_snapshot();
+}
+
+// Function to hash `count` lines of our buffer from `start`, folded as the
+// server folds its Merkle tree nodes. Caller must hold buffer_mutex.
+uint64_t range_hash(size_t start, size_t count) {
+    uint64_t hash = 0;
+    for (size_t y = start; y < start + count; ++y) hash = hash * HASH_BASE + line_hash(shared_buffer[y]);
+    return hash;
+}
+
+// Function to compare our buffer with a broadcast Merkle root. Only a buffer
+// at exactly that revision, with nothing of ours in flight, is comparable. On
+// a mismatch the buffer is frozen (edits queue as for a snapshot) while we
+// descend the server's tree to the blocks that differ.
+void check_tree_root(const json& data) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (!synced || data["revision"] != buffer_revision || !unacked_ops.empty() || !pending_messages.empty()) return;
+    size_t lines = data["lines"];
+    if (shared_buffer.size() == lines && range_hash(0, lines) == data["hash"].get<uint64_t>()) return;
+
+    std::cout << "Document diverged from the server at revision " << buffer_revision << "; repairing." << std::endl;
+    synced = false;
+    snapshot_revision = buffer_revision;
+    repairing = true;
+    repair_pieces.clear();
+    repair_lines = lines;
+    json request = {
+        {"packet_type", "tree_request"},
+        {"data", { {"revision", snapshot_revision}, {"nodes", json::array({ json::array({0, data["blocks"]}) })} }}
+    };
+    send_json(request);
+}
+
+// Function to take one level of the server's tree: halves that match our
+// buffer are kept, blocks arrive with their lines, and the rest are asked
+// for again. With nothing left to ask, the buffer is rebuilt from the pieces.
+void apply_tree_nodes(const json& data) {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (!repairing || data["revision"] != snapshot_revision) return;
+    json next = json::array();
+    for (const auto& node : data["nodes"]) {
+        size_t start = node["start"], count = node["count"];
+        if (node.contains("lines")) {
+            repair_pieces[start] = { {"lines", node["lines"]} };
+        }
+        else if (start + count <= shared_buffer.size() && range_hash(start, count) == node["hash"].get<uint64_t>()) {
+            repair_pieces[start] = { {"keep", count} };
+        }
+        else {
+            next.push_back(json::array({node["lo"], node["hi"]}));
+        }
+    }
+    if (!next.empty()) {
+        json request = {
+            {"packet_type", "tree_request"},
+            {"data", { {"revision", snapshot_revision}, {"nodes", next} }}
+        };
+        send_json(request);
+        return;
+    }
+
+    // Matching ranges sit at the same lines in both copies
+    std::vector<std::string> rebuilt;
+    rebuilt.reserve(repair_lines);
+    size_t fetched = 0;
+    for (const auto& [start, piece] : repair_pieces) {
+        if (start != rebuilt.size()) break;
+        if (piece.contains("keep")) {
+            size_t count = piece["keep"];
+            rebuilt.insert(rebuilt.end(), shared_buffer.begin() + start, shared_buffer.begin() + start + count);
+        }
+        else {
+            for (const auto& line : piece["lines"]) rebuilt.push_back(line);
+            fetched += piece["lines"].size();
+        }
+    }
+    repairing = false;
+    repair_pieces.clear();
+    if (rebuilt.size() != repair_lines) {
+        // The pieces do not fit together; reconnect for the whole document
+        shutdown(sockfd, SHUT_RDWR);
+        return;
+    }
+    if (rebuilt.empty()) rebuilt.push_back("");
+    shared_buffer.swap(rebuilt);
+    std::cout << "Repaired " << fetched << " lines from the server." << std::endl;
+    finish_snapshot();
+}
+
+// Function to handle one packet from the server
+void handle_message(const json& message) {
+    if (message["packet_type"] == "message") {
+        std::string msg_type = message["data"]["message_type"];
+        if (msg_type == "connect_success") {
+            // Receive collaborators; the initial buffer streams in after this
+            begin_snapshot(message["data"]);
+            resume_operations(message["data"]);
+            // Offered a delta: describe our stale copy; otherwise the buffer streams in
+            if (message["data"].value("delta", false)) {
+                send_delta_request();
+            }
+            // Update user's color if provided
+            if (message["data"].contains("color")) {
+                user_color = hex_to_color(message["data"]["color"].get<std::string>());
+            }
+            // Open the cursor side channel if the server offered one
+            if (message["data"].contains("udp")) {
+                start_udp_channel(message["data"]["udp"]);
+            }
+            // A follower serves the document for viewing only
+            read_only = message["data"].value("read_only", false);
+            if (message["data"].contains("quotas")) {
+                max_packet_bytes = message["data"]["quotas"].value("packet_bytes", size_t(0));
+            }
+            note_servers(message["data"]);
+            if (message["data"].value("observer", false)) {
+                std::cout << "Observing; edits are disabled." << std::endl;
+            }
+            else if (read_only) {
+                std::cout << "Connected to a read-only replica." << std::endl;
+            }
+            std::cout << "Connected to server successfully." << std::endl;
+        }
+        else if (msg_type == "resumed") {
+            // Our session survived the drop; only the operations we missed follow
+            set_collaborators(message["data"]);
+            resume_operations(message["data"]);
+            note_servers(message["data"]);
+            {
+                std::lock_guard<std::mutex> lock(buffer_mutex);
+                stale_copy.clear();
+            }
+            if (message["data"].contains("udp")) {
+                start_udp_channel(message["data"]["udp"]);
+            }
+            std::cout << "Resumed session at revision " << message["data"]["revision"] << "." << std::endl;
+        }
+        else if (msg_type == "resync") {
+            // We fell behind; the server dropped our backlog and is sending its current state
+            begin_snapshot(message["data"]);
+            std::cout << "Resynchronized at revision " << message["data"]["revision"] << "." << std::endl;
+        }
+        else if (msg_type == "servers") {
+            note_servers(message["data"]);
+        }
+        else if (msg_type == "promoted") {
+            // The replica we view took over from its leader
+            note_servers(message["data"]);
+            read_only = false;
+            std::cout << "Server took over as leader in epoch " << leader_epoch << "." << std::endl;
+        }
+        else if (msg_type == "redirect") {
+            // Not (or no longer) the leader: reconnect where it says, or try the others
+            note_servers(message["data"]);
+            redirect_address = message["data"].value("address", "");
+            std::cout << "Redirected to " << (redirect_address.empty() ? "another server" : redirect_address) << "." << std::endl;
+            shutdown(sockfd, SHUT_RDWR);
+        }
+        else if (msg_type == "udp_ready") {
+            udp_ready = true;
+            std::cout << "Cursor updates switched to UDP." << std::endl;
+        }
+        else if (msg_type == "error_quota") {
+            // The request was refused, but the connection stays up
+            std::cout << "Error: " << message["data"]["message"] << std::endl;
+        }
+        else if (msg_type == "error_newname_invalid" || msg_type == "error_newname_taken" ||
+                 msg_type == "error_document_invalid" || msg_type == "error_document_unavailable" ||
+                 msg_type == "error_server_full" || msg_type == "error_observers_full" ||
+                 msg_type == "error_observer_transport") {
+            std::cout << "Error: " << message["data"]["message"] << std::endl;
+            running = false;
+        }
+        else {
+            // Handle other message types if needed
+        }
+    }
+    else if (message["packet_type"] == "snapshot_chunk") {
+        apply_snapshot_chunk(message["data"]);
+    }
+    else if (message["packet_type"] == "delta") {
+        apply_delta(message["data"]);
+    }
+    else if (message["packet_type"] == "tree_root") {
+        check_tree_root(message["data"]);
+    }
+    else if (message["packet_type"] == "tree_nodes") {
+        apply_tree_nodes(message["data"]);
+    }
+    else if (message["packet_type"] == "fragment") {
+        // Slice of a large packet sent on the server's bulk lane
+        const json& data = message["data"];
+        std::string& assembled = fragments[data["id"].get<uint64_t>()];
+        assembled += data["payload"].get<std::string>();
+        if (data["final"]) {
+            json whole = json::parse(assembled);
+            fragments.erase(data["id"].get<uint64_t>());
+            handle_message(whole);
+        }
+    }
+    else if (message["packet_type"] == "user_event") {
+        std::string event = message["data"]["event"];
+        if (event == "user_connected") {
+            json user = message["data"]["user"];
+            Collaborator c;
+            c.name = user["name"];
+            c.color = hex_to_color(user["color"].get<std::string>());
+            c.cursor_x = user["cursor"]["x"];
+            c.cursor_y = user["cursor"]["y"];
+            std::lock_guard<std::mutex> lock(collaborators_mutex);
+            collaborators[c.name] = c;
+            std::cout << "User '" << c.name << "' connected." << std::endl;
+        }
+        else if (event == "user_disconnected") {
+            std::string name = message["data"]["user"]["name"];
+            std::lock_guard<std::mutex> lock(collaborators_mutex);
+            collaborators.erase(name);
+            std::cout << "User '" << name << "' disconnected." << std::endl;
+        }
+    }
+    else if (message["packet_type"] == "operation" || message["packet_type"] == "ack") {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        if (!message["data"].contains("revision")) {
+            // One of our operations was rejected by the server
+            unacked_ops.erase(message["data"].value("cseq", 0));
+        }
+        else if (synced && message["data"]["revision"] == buffer_revision + 1) {
+            apply_revisioned(message);
+        }
+        else {
+            // Arrived ahead of the snapshot it builds on (edits overtake bulk data)
+            pending_messages.push_back(message);
+        }
+    }
+    else if (message["packet_type"] == "update") {
+        // Handle cursor position updates from other users
+        std::string user_name = message["data"]["name"];
+        int cursor_x = message["data"]["cursor"]["x"];
+        int cursor_y = message["data"]["cursor"]["y"];
+
+        std::lock_guard<std::mutex> lock(collaborators_mutex);
+        if (collaborators.find(user_name) != collaborators.end()) {
+            collaborators[user_name].cursor_x = cursor_x;
+            collaborators[user_name].cursor_y = cursor_y;
+        }
+        else {
+            // Optionally handle cases where the user is not in the collaborators map
+            // For example, add the user to the map
+            Collaborator new_collab;
+            new_collab.name = user_name;
+            new_collab.color = sf::Color::White; // Default color or handle appropriately
+            new_collab.cursor_x = cursor_x;
+            new_collab.cursor_y = cursor_y;
+            collaborators[user_name] = new_collab;
+        }
+    }
+    else if (message["packet_type"] == "presence") {
+        // Handle coalesced cursor positions of all users that moved since the last tick
+        std::lock_guard<std::mutex> lock(collaborators_mutex);
+        for (const auto& entry : message["data"]["cursors"]) {
+            std::string name = entry["name"];
+            auto it = collaborators.find(name);
+            if (name == user_name || it == collaborators.end()) continue;
+            it->second.cursor_x = entry["cursor"]["x"];
+            it->second.cursor_y = entry["cursor"]["y"];
+        }
+    }
+}
+
+// Function to open a stream connection to the server, returning the socket or -1
+int connect_to_server() {
+    int fd = socket(use_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    if (use_unix) {
+        struct sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, server_ip.c_str(), sizeof(unix_addr.sun_path) - 1);
+
+        // Connect to server
+        if (connect(fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
+            perror("Connection Failed");
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        // Server address
+        struct sockaddr_in& servaddr = server_addr;
+        memset(&servaddr, 0, sizeof(servaddr));
+
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(server_port);
+
+        if (inet_pton(AF_INET, server_ip.c_str(), &servaddr.sin_addr) <= 0) {
+            perror("Invalid address/ Address not supported");
+            close(fd);
+            return -1;
+        }
+
+        // Connect to server
+        if (connect(fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+            perror("Connection Failed");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Function to describe the server in use as "host:port", or its socket path
+std::string current_address() {
+    return use_unix ? server_ip : server_ip + ":" + std::to_string(server_port);
+}
+
+// Function to switch to the server at "host:port", or an AF_UNIX socket path
+void set_server(const std::string& address) {
+    use_unix = !address.empty() && address[0] == '/';
+    size_t colon = address.rfind(':');
+    if (use_unix || colon == std::string::npos) {
+        server_ip = address;
+        return;
+    }
+    server_ip = address.substr(0, colon);
+    server_port = static_cast<unsigned short>(std::stoi(address.substr(colon + 1)));
+}
+
+// Function to send the username, and our session if we are coming back to one.
+// The revision is only given for a complete buffer; mid-snapshot the server has
+// to send a new one. A stale copy to diff against asks for a delta.
+bool send_handshake(int fd) {
+    if (observing) {
+        json observe_msg = { {"observe", true}, {"document", document_name} };
+        if (leader_epoch > 0) observe_msg["epoch"] = leader_epoch;
+        return send_all(fd, observe_msg.dump() + "\n");
+    }
+    json username_msg = { {"name", user_name}, {"udp", !use_unix}, {"document", document_name} };
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (!session_token.empty()) {
+        username_msg["resume"] = { {"session", session_token} };
+        if (synced) username_msg["resume"]["revision"] = buffer_revision;
+        username_msg["writer"] = !read_only;
+    }
+    if (leader_epoch > 0) username_msg["epoch"] = leader_epoch;
+    if (!stale_copy.empty()) username_msg["delta"] = true;
+    return send_all(fd, username_msg.dump() + "\n");
+}
+
+// Function to load the copy of the document saved by the last run, if any
+void load_cache() {
+    std::ifstream in(cache_path);
+    std::string line;
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    while (std::getline(in, line)) stale_copy.push_back(line);
+}
+
+// Function to save the document for the next run to resync against
+void save_cache() {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    if (!synced) return;
+    std::ofstream out(cache_path, std::ios::trunc);
+    for (const std::string& line : shared_buffer) out << line << '\n';
+}
+
+// Function to reconnect after the connection drops and resume our session.
+// Edits made meanwhile wait in unacked_ops. Returns false if we never had a
+// session (and were not sent elsewhere or observing) or the server stays unreachable.
+bool reconnect() {
+    int old_fd = sockfd.exchange(-1);
+    close(old_fd);
+    if (session_token.empty() && redirect_address.empty() && !observing) return false;
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        connected = false;
+        repairing = false;
+        pending_messages.clear();  // The resumed stream restarts from buffer_revision
+        if (synced) stale_copy = shared_buffer;  // Diffed against if the session cannot be resumed
+    }
+    fragments.clear();
+
+    // Where to try, in turn: a server we were sent to, the one we used, the
+    // one first chosen, then the standbys that take over if it fails
+    std::vector<std::string> candidates;
+    for (const std::string& address : { redirect_address, current_address(), home_address }) {
+        if (!address.empty()) candidates.push_back(address);
+    }
+    candidates.insert(candidates.end(), failover_servers.begin(), failover_servers.end());
+    redirect_address.clear();
+
+    int delay_ms = 250;
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && running; ++attempt) {
+        std::cout << "Connection lost; reconnecting in " << delay_ms << " ms." << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        delay_ms = std::min(delay_ms * 2, RECONNECT_MAX_MS);
+
+        set_server(candidates[attempt % candidates.size()]);
+        int fd = connect_to_server();
+        if (fd < 0) continue;
+        if (send_handshake(fd)) {
+            sockfd = fd;
+            return true;
+        }
+        close(fd);
+    }
+    return false;
+}
+
+// Function to handle incoming messages from the server
+void receive_messages() {
+    char buffer[4096];
+    std::string recv_buffer = "";
+    while (running) {
+        ssize_t n = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
+        if (n > 0) {
+            buffer[n] = '\0';
+            recv_buffer += buffer;
+            size_t pos = 0;
+            while (running && (pos = recv_buffer.find('\n')) != std::string::npos) {
+                std::string line = recv_buffer.substr(0, pos);
+                recv_buffer.erase(0, pos + 1);
+                if (line.empty()) continue;
+                try {
+                    handle_message(json::parse(line));
+                }
+                catch (json::parse_error& e) {
+                    std::cerr << "JSON parse error: " << e.what() << std::endl;
+                }
+            }
+        }
+        else {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0) std::cout << "Server closed the connection." << std::endl;
+            else perror("Recv error");
+            if (!running || !reconnect()) {
+                running = false;
+                return;
+            }
+            recv_buffer.clear();
+        }
+    }
 }
 
 int main() {
@@ -279,10 +899,7 @@ int main() {
     cursor_rect.setFillColor(sf::Color::Black);
 
     // Prompt for server IP and port
-    std::string server_ip = "127.0.0.1"; // Default
-    unsigned short server_port = 8555;    // Default
-
-    std::cout << "Enter server IP [127.0.0.1]: ";
+    std::cout << "Enter server IP or unix socket path [127.0.0.1]: ";
     std::string input_ip;
     std::getline(std::cin, input_ip);
     if (!input_ip.empty()) server_ip = input_ip;
@@ -292,29 +909,21 @@ int main() {
     std::getline(std::cin, input_port);
     if (!input_port.empty()) server_port = static_cast<unsigned short>(std::stoi(input_port));
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation failed");
-        return -1;
-    }
+    // A path instead of an IP selects the server's local AF_UNIX socket
+    use_unix = !server_ip.empty() && server_ip[0] == '/';
+    home_address = current_address();
 
-    // Server address
-    struct sockaddr_in servaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
+    std::cout << "Enter document name [default]: ";
+    std::string input_document;
+    std::getline(std::cin, input_document);
+    if (!input_document.empty()) document_name = input_document;
 
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(server_port);
-
-    if (inet_pton(AF_INET, server_ip.c_str(), &servaddr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        close(sockfd);
-        return -1;
-    }
+    // A document saved by an earlier session with this server lets us ask for a delta
+    cache_path = "np_cache_" + std::to_string(server_port) + "_" + document_name + ".txt";
+    load_cache();
 
     // Connect to server
-    if (connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        perror("Connection Failed");
-        close(sockfd);
+    if ((sockfd = connect_to_server()) < 0) {
         return -1;
     }
 
@@ -322,14 +931,24 @@ int main() {
     std::thread recv_thread(receive_messages);
     recv_thread.detach();
 
+    // Observers only watch, so they need no username
+    std::cout << "Join as an observer? [y/N]: ";
+    std::string input_observe;
+    std::getline(std::cin, input_observe);
+    observing = input_observe == "y" || input_observe == "Y";
+
     // Prompt for username
-    std::cout << "Enter your username: ";
-    std::cin >> user_name;
-    std::cin.ignore(); // Ignore remaining newline
+    if (observing) {
+        user_name = "observer";
+    }
+    else {
+        std::cout << "Enter your username: ";
+        std::cin >> user_name;
+        std::cin.ignore(); // Ignore remaining newline
+    }
 
     // Send username as JSON
-    json username_msg = { {"name", user_name} };
-    if (!send_json(username_msg)) {
+    if (!send_handshake(sockfd)) {
         std::cerr << "Failed to send username to server." << std::endl;
         running = false;
     }
@@ -355,6 +974,11 @@ int main() {
             // Handle text input
             if (const auto* textEntered = event->getIf<sf::Event::TextEntered>()) {
                 char32_t unicode = textEntered->unicode;
+                {
+                    // The buffer is read-only until a snapshot has fully arrived
+                    std::lock_guard<std::mutex> lock(buffer_mutex);
+                    if (!synced || read_only) continue;
+                }
                 if (unicode == '\b') { // Backspace
                     std::lock_guard<std::mutex> lock(buffer_mutex);
                     if (!shared_buffer.empty()) {
@@ -372,7 +996,7 @@ int main() {
                                     {"character", std::string(1, deleted_char)}
                                 }}
                             };
-                            send_json(delete_op);
+                            send_operation(delete_op);
                         }
                         else if (cursor_y > 0) {
                             // Send delete_newline operation
@@ -384,7 +1008,7 @@ int main() {
                                     {"character", ""}
                                 }}
                             };
-                            send_json(delete_newline_op);
+                            send_operation(delete_newline_op);
 
                             // Merge lines locally
                             cursor_x = shared_buffer[cursor_y - 1].size();
@@ -405,7 +1029,7 @@ int main() {
                             {"character", "\n"}
                         }}
                     };
-                    send_json(insert_newline_op);
+                    send_operation(insert_newline_op);
 
                     // Insert newline locally
                     std::string new_line = shared_buffer[cursor_y].substr(cursor_x);
@@ -428,17 +1052,11 @@ int main() {
                                 {"character", std::string(1, inserted_char)}
                             }}
                         };
-                        send_json(insert_op);
+                        send_operation(insert_op);
                         cursor_x++;
                     }
                 }
-                json cursor_msg = {
-                    {"packet_type", "update"},
-                    {"data", {
-                        {"cursor", { {"x", cursor_x}, {"y", cursor_y} }}
-                    }}
-                };
-                send_json(cursor_msg);
+                send_cursor(cursor_x, cursor_y);
             }
 
             // Handle key presses for navigation
@@ -447,6 +1065,42 @@ int main() {
                 std::lock_guard<std::mutex> lock(buffer_mutex);
                 sf::Keyboard::Key key = keyEvent->code;
 
+                // Undo and redo are kept per session on the server; the result comes back as an operation
+                if (keyEvent->control && (key == sf::Keyboard::Key::Z || key == sf::Keyboard::Key::Y) && synced && !read_only) {
+                    json undo_msg = { {"packet_type", key == sf::Keyboard::Key::Z ? "undo" : "redo"} };
+                    if (connected) send_json(undo_msg);
+                }
+                if (keyEvent->control && key == sf::Keyboard::Key::V && synced && !read_only && cursor_y < shared_buffer.size()) {
+                    // Paste as one insert_text operation, so one undo takes all of it back
+                    std::string text;
+                    for (char32_t c : sf::Clipboard::getString().toUtf32()) {
+                        if (c == '\n' || (c >= 32 && c <= 126)) text += static_cast<char>(c);
+                    }
+                    json paste_op = {
+                        {"packet_type", "operation"},
+                        {"data", {
+                            {"type", "insert_text"},
+                            {"position", { {"x", cursor_x}, {"y", cursor_y} }},
+                            {"text", text}
+                        }}
+                    };
+                    // The server would discard a packet over its quota, leaving the paste unacked for good
+                    if (!text.empty() && max_packet_bytes > 0 && paste_op.dump().size() >= max_packet_bytes) {
+                        std::cout << "Paste is too large for the server (limit " << max_packet_bytes << " bytes)." << std::endl;
+                    }
+                    else if (!text.empty()) {
+                        apply_operation(paste_op["data"]);
+                        send_operation(paste_op);
+                        size_t last_newline = text.rfind('\n');
+                        if (last_newline == std::string::npos) cursor_x += text.size();
+                        else {
+                            cursor_y += std::count(text.begin(), text.end(), '\n');
+                            cursor_x = text.size() - last_newline - 1;
+                        }
+                        moved = true;
+                    }
+                }
+
                 if (key == sf::Keyboard::Key::Left) {
                     if (cursor_x > 0) {
                         cursor_x--;
@@ -488,17 +1142,18 @@ int main() {
 
                 if (moved) {
                     // Send cursor position to server
-                    json cursor_msg = {
-                        {"packet_type", "update"},
-                        {"data", {
-                            {"cursor", { {"x", cursor_x}, {"y", cursor_y} }}
-                        }}
-                    };
-                    send_json(cursor_msg);
+                    send_cursor(cursor_x, cursor_y);
                 }
             }
         }
 
+        // Keep our cursor inside the buffer after remote edits or a resync
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            cursor_y = std::min(cursor_y, static_cast<int>(shared_buffer.size()) - 1);
+            cursor_x = std::min(cursor_x, static_cast<int>(shared_buffer[cursor_y].size()));
+        }
+
         // Update text display
         {
             std::lock_guard<std::mutex> lock(buffer_mutex);
@@ -567,6 +1222,8 @@ int main() {
 
     // Cleanup before exit
     running = false;
+    save_cache();
     close(sockfd);
+    if (udp_sockfd >= 0) close(udp_sockfd);
     return 0;
 }
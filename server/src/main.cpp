@@ -1,144 +1,4845 @@
 // server/src/main.cpp
 
 #include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <climits>
 #include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <netinet/in.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 #include <signal.h>
+#include <algorithm>
 #include <atomic> // Added to define std::atomic
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
 
 // Include nlohmann/json library
 #include "json.hpp"
 
+// Heap allocations made while counting is on, for --bench-alloc. Only a build
+// with -DBENCH_ALLOC (make bench) replaces operator new to count them; every
+// allocation through it (the standard containers, strings, JSON values) is
+// seen there, and counting costs one relaxed load otherwise.
+std::atomic<bool> count_allocations(false);
+std::atomic<uint64_t> heap_allocations(0);
+
+#ifdef BENCH_ALLOC
+void* operator new(std::size_t size) {
+    if (count_allocations.load(std::memory_order_relaxed)) heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+#endif
+
+// Fixed-size blocks for connection objects and for the queues and frames on
+// the editing path. Each 16-byte size class up to MAX_BYTES keeps a free
+// list; blocks are cut from SLAB_BYTES slabs and go back on their list when
+// freed, never to the heap, so a queue that grows and shrinks by the same
+// amount stops allocating once it is warm. Larger requests go to operator new.
+class SlabPool {
+public:
+    static constexpr size_t MAX_BYTES = 1024;
+    static constexpr size_t SLAB_BYTES = 64 * 1024;
+
+    static void* take(size_t bytes) {
+        if (bytes > MAX_BYTES) return ::operator new(bytes);
+        size_t index = std::max<size_t>((bytes + 15) / 16, 1);
+        SizeClass& size_class = classes()[index];
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        if (!size_class.free) {
+            char* slab = static_cast<char*>(::operator new(SLAB_BYTES));
+            reserved_bytes += SLAB_BYTES;
+            for (size_t offset = 0; offset + index * 16 <= SLAB_BYTES; offset += index * 16) {
+                Block* block = reinterpret_cast<Block*>(slab + offset);
+                block->next = size_class.free;
+                size_class.free = block;
+            }
+        }
+        Block* block = size_class.free;
+        size_class.free = block->next;
+        return block;
+    }
+
+    static void give(void* memory, size_t bytes) {
+        if (bytes > MAX_BYTES) {
+            ::operator delete(memory);
+            return;
+        }
+        SizeClass& size_class = classes()[std::max<size_t>((bytes + 15) / 16, 1)];
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        Block* block = static_cast<Block*>(memory);
+        block->next = size_class.free;
+        size_class.free = block;
+    }
+
+    static inline std::atomic<size_t> reserved_bytes{0};   // Slab memory taken from the heap so far
+
+private:
+    struct Block {
+        Block* next;
+    };
+    struct SizeClass {
+        std::mutex mutex;
+        Block* free = nullptr;
+    };
+
+    // Never destroyed: detached threads may still free blocks while the process exits
+    static SizeClass* classes() {
+        static SizeClass* list = new SizeClass[MAX_BYTES / 16 + 1];
+        return list;
+    }
+};
+
+// Standard allocator over SlabPool, for the containers that churn on the editing path
+template <typename T>
+struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(SlabPool::take(count * sizeof(T))); }
+    void deallocate(T* memory, size_t count) { SlabPool::give(memory, count * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) { return false; }
+
 using json = nlohmann::json;
 
-// Constants
-const int PORT = 8555;          // Server port
-const int MAX_CLIENTS = 100;    // Maximum number of clients
-const int BUFFER_SIZE = 4096;   // Buffer size for receiving data
+// Constants
+const int PORT = 8555;          // Server port
+const int MAX_CLIENTS = 100;    // Maximum number of clients
+const size_t MAX_OBSERVERS = 10000; // Maximum number of read-only observers, counted apart from clients
+const int BUFFER_SIZE = 4096;   // Buffer size for receiving data
+const int PRESENCE_TICK_MS = 33; // Presence frame interval (~30 Hz)
+const int PRESENCE_REFRESH_MS = 1000; // Full presence resend interval for UDP clients
+const int UDP_BUFFER_SIZE = 1500; // Largest cursor datagram accepted
+const size_t SHM_RING_SIZE = 1 << 20; // Bytes per direction of a shared-memory ring
+const int SHM_POLL_MS = 100;    // How often a blocked ring end checks peer liveness
+const size_t SLOW_CONSUMER_BYTES = 1 << 20; // Outbound backlog that triggers a snapshot resync
+const size_t BULK_CHUNK_BYTES = 16 * 1024;  // Largest slice of a bulk frame sent between edits
+const double OPS_PER_SEC = 200;         // Default sustained operation rate per client
+const double BYTES_PER_SEC = 64 * 1024; // Default sustained inbound byte rate per client
+const double BURST_SECONDS = 2;         // Bucket depth, in seconds of sustained rate
+const int FLUSH_MS = 5;                 // Default group commit interval for the operation log
+const int FSYNC_MS = 1000;              // Default fsync interval under the "interval" policy
+const uint64_t CHECKPOINT_OPS = 100000; // Default operations between checkpoints
+const int CHECKPOINT_SECS = 300;        // Default seconds between checkpoints of a changed document
+const int CHECKPOINTS_KEPT = 2;         // Fewest checkpoints retained; the log is kept back to the oldest
+const size_t HISTORY_KEYFRAMES = 8;     // Default checkpoints kept as keyframes for history reads
+const size_t MAX_HISTORY_LINES = 4096;  // Most lines returned by one history read
+const int REPLICA_RETRY_MS = 1000;      // Delay before a follower reconnects to its leader
+const int HEARTBEAT_MS = 250;           // Interval of heartbeats to followers
+const int FAILOVER_MS = 2000;           // Default leader silence before a standby takes over
+const size_t RING_VNODES = 128;         // Default points per node on the consistent hash ring
+const int DOCUMENT_START_MS = 5000;     // Longest wait for a document process to start listening
+const int IDLE_SECS = 300;              // Default time a document process stays up with no clients
+const size_t MAX_PACKET_BYTES = 8 << 20;     // Default quota on one inbound packet
+const size_t MAX_OUTBOUND_BYTES = 64 << 20;  // Default quota on a client's bulk lane, past which requests are refused
+const size_t BLOCK_LINES = 256;         // Lines per document block, the unit of copy-on-write
+const size_t MAPPED_BLOCK_BYTES = 64 * 1024;  // Bytes per block of a mapped file
+const size_t HISTORY_OPS = 10000;       // Default recent operations kept for resuming clients
+const int SESSION_TTL_SECS = 300;       // Default time a dropped session can still be resumed
+const uint64_t HASH_BASE = 1099511628211ULL;  // FNV prime: line hash step and chunk hash multiplier
+const size_t MAX_DELTA_CHUNKS = 1 << 22;      // Most chunk hashes accepted in one delta request
+const int TREE_SECS = 10;               // Default interval between root hash broadcasts
+const size_t TREES_KEPT = 2;            // Recent trees clients can still descend
+const size_t MAX_TREE_NODES = 4096;     // Most nodes accepted in one tree_request
+const size_t UNDO_DEPTH = 1000;         // Undo (and redo) steps kept per session
+const int UNDO_COALESCE_MS = 1000;      // Keystrokes closer together than this share an undo step
+
+// Encoded outbound packet, shared between all recipients of a broadcast
+using Frame = std::shared_ptr<const std::string>;
+using FrameQueue = std::deque<Frame, SlabAllocator<Frame>>;
+// Latest unsent cursor per user, by client id: the user's presence entry, encoded as a frame
+using PresenceMap = std::map<int, Frame, std::less<int>, SlabAllocator<std::pair<const int, Frame>>>;
+
+// Outbound priority classes, drained in this order
+enum class Lane {
+    Edit,       // Operations, acks and control messages: always sent first
+    Bulk        // Snapshots: sent in slices when nothing else is waiting
+};
+
+// Per-connection outbound queue drained by the connection's writer thread.
+// Edits go out first, then presence, then one slice of bulk data. Cursor
+// positions are kept apart from the FIFO: a newer cursor for the same user
+// overwrites the unsent one, so a backed-up client never receives
+// superseded positions.
+struct SnapshotStream;
+
+struct Outbox {
+    std::mutex mutex;
+    std::condition_variable cv;
+    FrameQueue frames;                                      // Edit lane, in order
+    PresenceMap presence;                                   // Latest unsent cursor per user
+    FrameQueue bulk;                                        // Bulk lane, in order
+    size_t bulk_offset = 0;                                 // Bytes of bulk.front() already sent
+    size_t bulk_bytes = 0;                                  // Bytes waiting in the bulk lane
+    uint64_t next_fragment_id = 0;                          // Id of the next fragmented bulk frame
+    std::shared_ptr<SnapshotStream> stream;                 // Snapshot streamed once the bulk lane is empty
+    size_t stream_chunk = 0;                                // Next chunk of it to send
+    size_t queued_bytes = 0;                                // Bytes waiting in the edit lane
+    bool resync_pending = false;                            // Backlog dropped; snapshot owed
+    uint64_t resyncs = 0;                                   // Times this client fell behind
+    bool closing = false;                                   // Flush remaining frames, then stop
+    bool closed = false;                                    // Stop immediately
+};
+
+// Mutex granting the lock in arrival order (ticket lock). Each reader thread
+// takes buffer_mutex once per operation, so a client that floods operations
+// re-queues behind every other waiting client instead of re-acquiring it
+// ahead of them: waiting clients are serviced round-robin.
+class FairMutex {
+public:
+    void lock() {
+        std::unique_lock<std::mutex> guard(mutex);
+        uint64_t ticket = next_ticket++;
+        cv.wait(guard, [&] { return now_serving == ticket; });
+    }
+    void unlock() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            now_serving++;
+        }
+        cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t next_ticket = 0;
+    uint64_t now_serving = 0;
+};
+
+// Token bucket refilled continuously at rate tokens per second, up to burst.
+// Taking more tokens than are available leaves a debt the caller waits out.
+struct TokenBucket {
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+
+    TokenBucket(double rate, double burst)
+        : rate(rate), burst(burst), tokens(burst), last(std::chrono::steady_clock::now()) {}
+
+    // Take amount tokens; returns how long the caller must wait before proceeding
+    std::chrono::microseconds take(double amount) {
+        auto now = std::chrono::steady_clock::now();
+        tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+        last = now;
+        tokens -= amount;
+        if (tokens >= 0) return std::chrono::microseconds(0);
+        return std::chrono::microseconds(static_cast<int64_t>(-tokens / rate * 1e6));
+    }
+};
+
+// Per-connection inbound limits. A throttled client's reader sleeps instead
+// of reading, so the kernel receive buffer fills and TCP pushes back on the
+// sender; the connection is never dropped for going too fast.
+struct RateLimiter {
+    std::mutex mutex;
+    TokenBucket ops;
+    TokenBucket bytes;
+    bool throttled = false;         // Reader is currently sleeping off a debt
+    uint64_t throttle_events = 0;   // Times the client hit a limit
+    double throttled_ms = 0;        // Total time spent throttled
+    std::atomic<size_t> buffered_bytes{0}; // Memory held by an incomplete inbound packet
+
+    RateLimiter(double ops_per_sec, double bytes_per_sec)
+        : ops(ops_per_sec, ops_per_sec * BURST_SECONDS),
+          bytes(bytes_per_sec, bytes_per_sec * BURST_SECONDS) {}
+
+    // Charge one operation; blocks while the client is over its rate
+    void charge_op() { wait(ops, 1); }
+    // Charge received bytes; blocks while the client is over its rate
+    void charge_bytes(size_t n) { wait(bytes, static_cast<double>(n)); }
+
+    json stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {
+            {"ops_per_sec", ops.rate},
+            {"bytes_per_sec", bytes.rate},
+            {"ops_tokens", ops.tokens},
+            {"bytes_tokens", bytes.tokens},
+            {"throttled", throttled},
+            {"throttle_events", throttle_events},
+            {"throttled_ms", throttled_ms},
+            {"inbound_bytes", buffered_bytes.load()}
+        };
+    }
+
+private:
+    void wait(TokenBucket& bucket, double amount) {
+        std::chrono::microseconds delay;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            delay = bucket.take(amount);
+            if (delay.count() == 0) return;
+            throttled = true;
+            throttle_events++;
+        }
+        std::this_thread::sleep_for(delay);
+        std::lock_guard<std::mutex> lock(mutex);
+        throttled = false;
+        throttled_ms += delay.count() / 1000.0;
+    }
+};
+
+// Struct to represent a User
+struct User {
+    std::shared_ptr<class Connection> conn; // Transport to the client
+    std::string uname;          // Username
+    std::string ucolor;         // Assigned color in hex format (e.g., "#FF5733")
+    int cursor_x;               // Cursor X position
+    int cursor_y;               // Cursor Y position
+    bool cursor_dirty;          // Cursor changed since the last presence tick
+    std::shared_ptr<Outbox> outbox; // Outbound queue for this user
+    std::shared_ptr<RateLimiter> limiter; // Inbound rate limits for this user
+    std::string session;        // Token of the session this connection holds
+
+    // UDP side channel for cursor/presence traffic (optional)
+    std::string udp_token;      // Session token presented in every datagram
+    bool udp_bound;             // A valid datagram has been received from udp_addr
+    sockaddr_in udp_addr;       // Client's UDP address
+    uint64_t udp_recv_seq;      // Highest datagram sequence accepted from the client
+    uint64_t udp_send_seq;      // Sequence of the last presence datagram sent
+
+    // Parameterized constructor
+    User(std::shared_ptr<Connection> conn, const std::string& uname, const std::string& ucolor)
+        : conn(conn), uname(uname), ucolor(ucolor), cursor_x(0), cursor_y(0),
+          cursor_dirty(false), outbox(std::allocate_shared<Outbox>(SlabAllocator<Outbox>())),
+          udp_bound(false), udp_addr{}, udp_recv_seq(0), udp_send_seq(0) {}
+
+    // Default constructor
+    User() : conn(nullptr), uname(""), ucolor("#000000"), cursor_x(0), cursor_y(0),
+             cursor_dirty(false), outbox(std::allocate_shared<Outbox>(SlabAllocator<Outbox>())),
+             udp_bound(false), udp_addr{}, udp_recv_seq(0), udp_send_seq(0) {}
+};
+
+// Struct to remember a client's session across reconnects
+struct Session {
+    std::string uname;          // Username the session was opened with
+    std::string ucolor;         // Color kept across reconnects
+    int client_id;              // Connection holding the session, -1 while detached
+    uint64_t acked_cseq;        // Highest client sequence number processed
+    std::chrono::steady_clock::time_point detached_at; // When its connection dropped
+};
+
+// Struct to hold a follower process replicating the document from this server
+struct Follower {
+    std::shared_ptr<class Connection> conn; // Replication connection
+    std::shared_ptr<Outbox> outbox; // Operations in revision order, snapshots on the bulk lane
+    uint64_t acked_revision;    // Highest revision it has applied
+    int64_t lag_ms;             // Time from applying acked_revision here to its ack
+    std::string address;        // Where it accepts clients, "" if it cannot take over
+    bool relay;                 // Only fans operations out to viewers; no sessions, not counted for acks
+};
+
+// Define the enumeration for operation types
+enum class OperationType {
+    Insert,
+    Delete,
+    InsertNewline,
+    DeleteNewline,
+    InsertText,     // Any text, possibly with line breaks (pastes, undo)
+    DeleteRange,    // Everything from position up to end
+    Unknown
+};
+
+// Function to map string to OperationType enum
+OperationType getOperationType(const std::string& op_type_str) {
+    static const std::unordered_map<std::string, OperationType> op_map = {
+        {"insert", OperationType::Insert},
+        {"delete", OperationType::Delete},
+        {"insert_newline", OperationType::InsertNewline},
+        {"delete_newline", OperationType::DeleteNewline},
+        {"insert_text", OperationType::InsertText},
+        {"delete_range", OperationType::DeleteRange}
+    };
+    
+    auto it = op_map.find(op_type_str);
+    if (it != op_map.end()) {
+        return it->second;
+    }
+    return OperationType::Unknown;
+}
+
+// Function to extend a CRC-32 (IEEE) over a byte range; start with crc = 0
+uint32_t crc32(const char* data, size_t length, uint32_t crc = 0) {
+    static uint32_t table[256] = {0};
+    static std::once_flag table_ready;
+    std::call_once(table_ready, [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+    crc ^= 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Function to hash one line (64-bit FNV-1a). Clients compute the same value
+// over their own copy for delta resync.
+uint64_t line_hash(std::string_view line) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : line) {
+        hash ^= c;
+        hash *= HASH_BASE;
+    }
+    return hash;
+}
+
+// Function to raise HASH_BASE to a power (mod 2^64), for joining range hashes
+uint64_t hash_power(uint64_t exponent) {
+    uint64_t result = 1, base = HASH_BASE;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1) result *= base;
+        base *= base;
+    }
+    return result;
+}
+
+// Function to hash a key onto the ring: FNV-1a, then mixed (the MurmurHash3
+// finalizer) so that keys differing in one character land far apart
+uint64_t ring_hash(std::string_view key) {
+    uint64_t hash = line_hash(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Struct to map document names to nodes with a consistent hash ring. Each
+// node owns `vnodes` points on it, and a name belongs to the node of the first
+// point at or after the name's hash. Adding or removing a node only moves the
+// names whose next point changes, about 1/N of them.
+struct HashRing {
+    std::vector<std::pair<uint64_t, std::string>> points;  // Sorted by hash
+
+    HashRing(const std::vector<std::string>& nodes, size_t vnodes) {
+        for (const std::string& node : nodes) {
+            for (size_t i = 0; i < vnodes; ++i) points.emplace_back(ring_hash(node + "#" + std::to_string(i)), node);
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    const std::string& owner(std::string_view name) const {
+        auto it = std::lower_bound(points.begin(), points.end(), ring_hash(name),
+                                   [](const std::pair<uint64_t, std::string>& point, uint64_t hash) { return point.first < hash; });
+        return it == points.end() ? points.front().second : it->second;
+    }
+};
+
+// Function to append an unsigned LEB128 varint
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Function to read an unsigned LEB128 varint; returns false on truncated input
+bool get_varint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*cursor++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Function to append a little-endian 32-bit integer
+void put_u32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+// Function to read a little-endian 32-bit integer
+uint32_t get_u32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) value |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+    return value;
+}
+
+// Function to append a little-endian 64-bit integer
+void put_u64(std::string& out, uint64_t value) {
+    put_u32(out, static_cast<uint32_t>(value));
+    put_u32(out, static_cast<uint32_t>(value >> 32));
+}
+
+// Function to read a little-endian 64-bit integer
+uint64_t get_u64(const char* data) {
+    return get_u32(data) | static_cast<uint64_t>(get_u32(data + 4)) << 32;
+}
+
+// Function to read a whole file into memory
+bool read_file(const std::string& path, std::string& contents) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        contents.assign(st.st_size, '\0');
+        ok = st.st_size == 0 || pread(fd, &contents[0], st.st_size, 0) == st.st_size;
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Function to write a whole buffer to a file descriptor
+bool write_fully(int fd, const char* data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = ::write(fd, data + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// Function to make renames and unlinks in a directory durable
+void fsync_directory(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+// Function to name a data file "<prefix><revision>", zero-padded so names sort by revision
+std::string data_file_name(const std::string& prefix, uint64_t revision) {
+    std::ostringstream name;
+    name << prefix << std::setw(20) << std::setfill('0') << revision;
+    return name.str();
+}
+
+// Function to list the data files named "<prefix><revision>" in dir, oldest first
+std::vector<std::pair<uint64_t, std::string>> list_data_files(const std::string& dir, const std::string& prefix) {
+    std::vector<std::pair<uint64_t, std::string>> files;
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) return files;
+    while (struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) continue;
+        std::string digits = name.substr(prefix.size());
+        if (!std::all_of(digits.begin(), digits.end(), ::isdigit)) continue;  // e.g. set-aside segments
+        files.emplace_back(std::stoull(digits), name);
+    }
+    closedir(handle);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// One applied operation as stored in the operation log
+struct LogRecord {
+    uint64_t revision = 0;
+    OperationType op = OperationType::Unknown;
+    int x = 0;
+    int y = 0;
+    char character = '\0';      // Inserted character (Insert only)
+    std::string text{};         // Inserted text (InsertText only)
+    int end_x = 0;              // End of the deleted range (DeleteRange only)
+    int end_y = 0;
+};
+
+// Struct to describe any operation as one edit: delete [start, end), then
+// insert text at start. Undo entries are kept in this form.
+struct TextEdit {
+    int y = 0, x = 0;           // Start
+    int end_y = 0, end_x = 0;   // End of the deleted range; equal to start if nothing is deleted
+    std::string text;           // Inserted text; '\n' starts a new line
+};
+
+// Struct to hold where an applied edit landed, enough to move a position across it
+struct EditShape {
+    int y = 0, x = 0;           // Deleted range
+    int end_y = 0, end_x = 0;
+    int new_lines = 0;          // Line breaks in the inserted text
+    int last_length = 0;        // Length of the inserted text after its last line break
+};
+
+// When the operation log forces its writes to stable storage
+enum class FsyncPolicy {
+    Never,      // Leave it to the OS page cache
+    Interval,   // At most once every fsync interval
+    Always      // After every group commit
+};
+
+// Append-only binary log of applied operations with group commit.
+//
+// append() only encodes the record into an in-memory batch, so the editing
+// path never touches the disk. A flusher thread writes the batch every flush
+// interval as one frame and syncs it according to the fsync policy.
+//
+// The log is split into segments named "wal-<first revision>". A checkpoint
+// rotates to a new segment, and segments wholly behind a retained checkpoint
+// are deleted.
+//
+// Frame:  u32 magic "NPWL" | u32 payload length | u32 CRC-32 of payload | payload
+// Payload: varint first revision | varint unix time (ms) | varint record count | records
+// Record: u8 type | varint y | varint x | type-specific tail:
+//         Insert: u8 character; InsertText: varint length, bytes;
+//         DeleteRange: varint end y, varint end x
+// Revisions in a frame are consecutive, so a keystroke costs about 4 bytes.
+class OpLog {
+public:
+    static const uint32_t MAGIC = 0x4C57504E;   // "NPWL"
+    static const size_t HEADER_SIZE = 12;
+    static const uint32_t MAX_FRAME = 64 << 20; // Longer frames can only be corruption
+    static const size_t BATCH_BYTES = 64 << 10; // Batch buffers start this big, so editing does not grow them
+
+    OpLog() {
+        pending.reserve(BATCH_BYTES);
+        payload.reserve(BATCH_BYTES);
+        batch_frame.reserve(HEADER_SIZE + BATCH_BYTES);
+    }
+
+    // Replay every record after revision `after` from the segments in log_dir,
+    // then open the newest segment for appending. A torn or corrupt frame ends
+    // the replay: its segment is cut there and later segments are set aside as
+    // "*.orphan". Returns false on I/O errors or when revisions are missing.
+    bool open(const std::string& log_dir, uint64_t after, const std::function<void(const LogRecord&)>& apply) {
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        dir = log_dir;
+        uint64_t last = after;
+        auto segments = list_data_files(dir, "wal-");
+        size_t next = 0;
+        std::string append_name;
+        for (; next < segments.size(); ++next) {
+            const auto& [first, name] = segments[next];
+            // Skip segments that lie entirely behind the starting revision
+            if (next + 1 < segments.size() && segments[next + 1].first <= after + 1) continue;
+            if (first > last + 1) {
+                std::cerr << "Operation log: revisions " << last + 1 << " to " << first - 1
+                          << " are missing; refusing to start." << std::endl;
+                return false;
+            }
+
+            std::string path = dir + "/" + name;
+            size_t valid_bytes = 0, file_bytes = 0;
+            if (!replay_segment(path, last, apply, valid_bytes, file_bytes)) {
+                perror(("Operation log read failed: " + path).c_str());
+                return false;
+            }
+            append_name = name;
+            if (valid_bytes < file_bytes) {
+                std::cerr << "Operation log: discarding " << file_bytes - valid_bytes
+                          << " bytes of torn or corrupt data from " << name << "." << std::endl;
+                if (truncate(path.c_str(), valid_bytes) < 0) perror("Operation log truncate failed");
+                ++next;
+                break;
+            }
+        }
+        for (; next < segments.size(); ++next) {
+            std::string path = dir + "/" + segments[next].second;
+            std::cerr << "Operation log: setting aside " << segments[next].second
+                      << " after the corrupt frame." << std::endl;
+            rename(path.c_str(), (path + ".orphan").c_str());
+        }
+
+        if (append_name.empty()) append_name = data_file_name("wal-", last + 1);
+        if (!open_segment(append_name)) return false;
+        return true;
+    }
+
+    // Record an applied operation; caller holds buffer_mutex so revisions arrive in order
+    void append(const LogRecord& record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending_count == 0) pending_first = record.revision;
+        pending.push_back(static_cast<char>(record.op));
+        put_varint(pending, record.y);
+        put_varint(pending, record.x);
+        if (record.op == OperationType::Insert) pending.push_back(record.character);
+        if (record.op == OperationType::InsertText) {
+            put_varint(pending, record.text.size());
+            pending += record.text;
+        }
+        if (record.op == OperationType::DeleteRange) {
+            put_varint(pending, record.end_y);
+            put_varint(pending, record.end_x);
+        }
+        pending_count++;
+    }
+
+    // Write the pending batch as one frame; sync if the policy asks for it
+    void flush(FsyncPolicy policy, int fsync_ms) {
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        write_pending();
+
+        auto now = std::chrono::steady_clock::now();
+        bool sync = unsynced && fd >= 0 && (policy == FsyncPolicy::Always ||
+                                 (policy == FsyncPolicy::Interval && now - last_sync >= std::chrono::milliseconds(fsync_ms)));
+        if (sync) {
+            fdatasync(fd);
+            last_sync = now;
+            unsynced = false;
+            syncs++;
+        }
+    }
+
+    // Cut the log at a revision boundary: everything appended so far stays in
+    // the current segment and later records go to "wal-<first_revision>". Only
+    // the pending batch is touched here; the next flush does the file work, so
+    // this is cheap enough to call under buffer_mutex.
+    void rotate(uint64_t first_revision) {
+        std::lock_guard<std::mutex> lock(mutex);
+        take_frame(sealed_frame, sealed_count);
+        rotate_to = first_revision;
+    }
+
+    // Delete the segments holding only revisions up to and including `revision`
+    void remove_segments_through(uint64_t revision) {
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        auto segments = list_data_files(dir, "wal-");
+        for (size_t i = 0; i + 1 < segments.size(); ++i) {
+            if (segments[i + 1].first > revision + 1 || segments[i].second == segment_name) break;
+            unlink((dir + "/" + segments[i].second).c_str());
+        }
+        fsync_directory(dir);
+    }
+
+    // Drop the whole log, pending batch included, and start a fresh segment at
+    // first_revision; for a replica whose document was replaced by a snapshot
+    void reset(uint64_t first_revision) {
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.clear();
+            pending_count = 0;
+            sealed_frame.clear();
+            sealed_count = 0;
+            rotate_to = 0;
+        }
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        unsynced = false;
+        for (const auto& [first, name] : list_data_files(dir, "wal-")) unlink((dir + "/" + name).c_str());
+        open_segment(data_file_name("wal-", first_revision));
+    }
+
+    // Read back the records after revision `after` up to `upto` from the
+    // segments on disk, for rebuilding a past revision. Only flushed frames are
+    // seen. Returns false if the log no longer reaches back to `after` or stops
+    // short of `upto`. The caller keeps checkpoint_document() from deleting
+    // segments meanwhile.
+    bool read_range(uint64_t after, uint64_t upto, const std::function<void(const LogRecord&)>& apply) {
+        auto segments = list_data_files(dir, "wal-");
+        uint64_t last = after;
+        for (size_t i = 0; i < segments.size() && last < upto; ++i) {
+            if (i + 1 < segments.size() && segments[i + 1].first <= last + 1) continue;
+            if (segments[i].first > last + 1) return false;
+            size_t valid_bytes = 0, file_bytes = 0;
+            auto upto_only = [&apply, upto](const LogRecord& record) {
+                if (record.revision <= upto) apply(record);
+            };
+            if (!replay_segment(dir + "/" + segments[i].second, last, upto_only, valid_bytes, file_bytes)) return false;
+        }
+        return last >= upto;
+    }
+
+    // Find the newest revision written at or before a Unix time in ms, from
+    // the frame timestamps. Segments are searched newest first, and only the
+    // frame headers are decoded. A time before the first frame of a log that
+    // starts at revision 1 gives revision 0.
+    bool revision_at(uint64_t time_ms, uint64_t& revision) {
+        auto segments = list_data_files(dir, "wal-");
+        for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+            std::string contents;
+            if (!read_file(dir + "/" + it->second, contents)) continue;
+            bool found = false;
+            size_t offset = 0;
+            while (offset + HEADER_SIZE <= contents.size()) {
+                const char* header = contents.data() + offset;
+                uint32_t length = get_u32(header + 4);
+                if (get_u32(header) != MAGIC || length > contents.size() - offset - HEADER_SIZE) break;
+                const char* cursor = header + HEADER_SIZE;
+                uint64_t first, timestamp, count;
+                if (!get_varint(cursor, cursor + length, first) || !get_varint(cursor, cursor + length, timestamp) ||
+                    !get_varint(cursor, cursor + length, count) || timestamp > time_ms) {
+                    break;
+                }
+                revision = first + count - 1;
+                found = true;
+                offset += HEADER_SIZE + length;
+            }
+            if (found) return true;
+        }
+        if (!segments.empty() && segments.front().first == 1) {
+            revision = 0;
+            return true;
+        }
+        return false;
+    }
+
+    // Flush and sync everything, e.g. on shutdown
+    void close_log() {
+        flush(FsyncPolicy::Always, 0);
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    json stats() {
+        return {
+            {"segment", segment_name},
+            {"segment_bytes", segment_bytes.load()},
+            {"frames", frames_written.load()},
+            {"records", records_written.load()},
+            {"syncs", syncs.load()}
+        };
+    }
+
+private:
+    // Replay the intact frames of one segment. valid_bytes ends at the first
+    // frame that is torn, fails its CRC, does not decode, or skips revisions.
+    bool replay_segment(const std::string& path, uint64_t& last, const std::function<void(const LogRecord&)>& apply,
+                        size_t& valid_bytes, size_t& file_bytes) {
+        std::string contents;
+        if (!read_file(path, contents)) return false;
+        file_bytes = contents.size();
+
+        std::vector<LogRecord> records;
+        size_t offset = 0;
+        while (offset + HEADER_SIZE <= contents.size()) {
+            const char* header = contents.data() + offset;
+            uint32_t length = get_u32(header + 4);
+            if (get_u32(header) != MAGIC || length > MAX_FRAME || length > contents.size() - offset - HEADER_SIZE ||
+                crc32(header + HEADER_SIZE, length) != get_u32(header + 8) ||
+                !decode_frame(header + HEADER_SIZE, length, records) ||
+                (!records.empty() && records.front().revision > last + 1)) {
+                break;
+            }
+            for (const LogRecord& record : records) {
+                if (record.revision <= last) continue;  // Already covered by the checkpoint
+                apply(record);
+                last = record.revision;
+            }
+            offset += HEADER_SIZE + length;
+        }
+        valid_bytes = offset;
+        return true;
+    }
+
+    // Decode one frame's payload; nothing is applied unless the whole frame decodes
+    bool decode_frame(const char* data, size_t length, std::vector<LogRecord>& records) {
+        const char* cursor = data;
+        const char* end = data + length;
+        uint64_t first, timestamp, count;
+        records.clear();
+        if (!get_varint(cursor, end, first) || !get_varint(cursor, end, timestamp) ||
+            !get_varint(cursor, end, count) || count > length) {
+            return false;
+        }
+        records.reserve(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            if (cursor >= end) return false;
+            uint8_t type = static_cast<uint8_t>(*cursor++);
+            if (type < static_cast<uint8_t>(OperationType::Insert) || type > static_cast<uint8_t>(OperationType::DeleteRange)) {
+                return false;
+            }
+            LogRecord record{first + i, static_cast<OperationType>(type), 0, 0, '\0'};
+            uint64_t y, x;
+            if (!get_varint(cursor, end, y) || !get_varint(cursor, end, x) || y > INT_MAX || x > INT_MAX) return false;
+            record.y = static_cast<int>(y);
+            record.x = static_cast<int>(x);
+            if (record.op == OperationType::Insert) {
+                if (cursor >= end) return false;
+                record.character = *cursor++;
+            }
+            if (record.op == OperationType::InsertText) {
+                uint64_t text_length;
+                if (!get_varint(cursor, end, text_length) || text_length > static_cast<uint64_t>(end - cursor)) return false;
+                record.text.assign(cursor, text_length);
+                cursor += text_length;
+            }
+            if (record.op == OperationType::DeleteRange) {
+                uint64_t end_y, end_x;
+                if (!get_varint(cursor, end, end_y) || !get_varint(cursor, end, end_x) || end_y > INT_MAX || end_x > INT_MAX) return false;
+                record.end_y = static_cast<int>(end_y);
+                record.end_x = static_cast<int>(end_x);
+            }
+            records.push_back(record);
+        }
+        return cursor == end;
+    }
+
+    // Open a segment for appending (caller holds io_mutex)
+    bool open_segment(const std::string& name) {
+        std::string path = dir + "/" + name;
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(("Operation log open failed: " + path).c_str());
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        segment_name = name;
+        segment_bytes = st.st_size;
+        fsync_directory(dir);
+        return true;
+    }
+
+    // Encode the pending batch as one frame appended to `frame`, and clear it
+    // (caller holds mutex). The buffers keep their capacity from batch to batch.
+    void take_frame(std::string& frame, uint64_t& count) {
+        count = pending_count;
+        if (count == 0) return;
+
+        payload.clear();
+        put_varint(payload, pending_first);
+        put_varint(payload, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()));
+        put_varint(payload, pending_count);
+        payload += pending;
+        pending.clear();
+        pending_count = 0;
+
+        put_u32(frame, MAGIC);
+        put_u32(frame, static_cast<uint32_t>(payload.size()));
+        put_u32(frame, crc32(payload.data(), payload.size()));
+        frame += payload;
+    }
+
+    // Write the pending batch, finishing a requested rotation first (caller holds io_mutex)
+    void write_pending() {
+        std::string sealed;
+        uint64_t sealed_records = 0, count = 0, next_segment = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sealed.swap(sealed_frame);
+            sealed_records = sealed_count;
+            sealed_count = 0;
+            next_segment = rotate_to;
+            rotate_to = 0;
+            take_frame(batch_frame, count);
+        }
+
+        if (next_segment > 0) {
+            write_frame(sealed, sealed_records);
+            if (fd >= 0) {
+                fdatasync(fd);
+                syncs++;
+                ::close(fd);
+                fd = -1;
+                unsynced = false;
+            }
+            open_segment(data_file_name("wal-", next_segment));
+        }
+        write_frame(batch_frame, count);
+        batch_frame.clear();
+    }
+
+    // Append one encoded frame to the current segment (caller holds io_mutex)
+    void write_frame(const std::string& frame, uint64_t count) {
+        if (frame.empty() || fd < 0) return;
+        if (write_fully(fd, frame.data(), frame.size())) {
+            segment_bytes += frame.size();
+            frames_written++;
+            records_written += count;
+            unsynced = true;
+        }
+        else {
+            perror("Operation log write failed");
+        }
+    }
+
+    std::string dir;
+    std::string segment_name;           // Segment currently appended to (guarded by io_mutex)
+    int fd = -1;
+    std::mutex io_mutex;                // Orders batches into segments; taken before mutex
+    std::mutex mutex;                   // Guards the pending batch
+    std::string pending;                // Encoded records not yet written
+    std::string payload;                // Scratch for encoding a frame's payload (guarded by mutex)
+    std::string batch_frame;            // Frame being written (guarded by io_mutex)
+    uint64_t pending_first = 0;         // Revision of the first pending record
+    uint64_t pending_count = 0;
+    std::string sealed_frame;           // Records cut off by rotate(), bound for the old segment
+    uint64_t sealed_count = 0;
+    uint64_t rotate_to = 0;             // First revision of the requested next segment, 0 if none
+    bool unsynced = false;              // Written but not yet synced
+    std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> segment_bytes{0};
+    std::atomic<uint64_t> frames_written{0};
+    std::atomic<uint64_t> records_written{0};
+    std::atomic<uint64_t> syncs{0};
+};
+
+// Join and resync statistics
+std::atomic<uint64_t> streams_built(0);        // Snapshot streams created
+std::atomic<uint64_t> streams_reused(0);       // Joins served by an existing stream
+std::atomic<uint64_t> blocks_encoded(0);       // Blocks converted to JSON (cache misses)
+
+// Function to find the heap bytes behind a string: none while it fits in
+// the string object itself
+size_t string_heap_bytes(const std::string& text) {
+    const char* data = text.data();
+    bool inline_buffer = data >= reinterpret_cast<const char*>(&text) && data < reinterpret_cast<const char*>(&text + 1);
+    return inline_buffer ? 0 : text.capacity() + 1;
+}
+
+// A read-only file mapping, unmapped when the last block using it goes away.
+// The path and modification time let a checkpoint refer back to it.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    std::string path;
+    uint64_t mtime_ns = 0;
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+};
+
+// A run of document lines. Owned blocks hold their lines on the heap; mapped
+// blocks point into a MappedFile and count their lines and find their line
+// starts on first access, so untouched parts of a large file are never read
+// or copied.
+struct DocumentBlock {
+    std::vector<std::string> lines;             // Owned lines
+
+    std::shared_ptr<const MappedFile> file;     // Set for mapped blocks
+    const char* begin = nullptr;                // Mapped bytes, '\n'-terminated lines
+    const char* end = nullptr;
+    mutable size_t mapped_lines = 0;            // Line count, 0 until taken (or known in advance)
+    mutable std::once_flag counted;
+    mutable std::once_flag indexed;             // Readers may race to build the index
+    mutable std::vector<size_t> offsets;        // Start of each mapped line
+    mutable std::shared_ptr<const std::string> encoded;  // Cached JSON of the lines (owned blocks)
+    // line_hash of each line, and their fold (h = h * HASH_BASE + line) over the block
+    struct Hashes {
+        std::vector<uint64_t> lines;
+        uint64_t fold = 0;
+    };
+    mutable std::shared_ptr<const Hashes> hashes;   // Cached; dropped on edit
+
+    DocumentBlock() = default;
+    explicit DocumentBlock(std::vector<std::string> owned) : lines(std::move(owned)) {}
+
+    bool mapped() const {
+        return file != nullptr;
+    }
+
+    size_t size() const {
+        if (!mapped()) return lines.size();
+        std::call_once(counted, [this] {
+            // A final line without a trailing newline still counts
+            if (mapped_lines == 0) mapped_lines = std::count(begin, end, '\n') + (end[-1] != '\n' ? 1 : 0);
+        });
+        return mapped_lines;
+    }
+
+    std::string_view line(size_t i) const {
+        if (!mapped()) return lines[i];
+        std::call_once(indexed, [this] {
+            offsets.reserve(size());
+            for (const char* p = begin; p < end; ++p) {
+                offsets.push_back(p - begin);
+                p = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (!p) break;
+            }
+        });
+        const char* start = begin + offsets[i];
+        const char* stop = static_cast<const char*>(memchr(start, '\n', end - start));
+        return std::string_view(start, (stop ? stop : end) - start);
+    }
+
+    template <typename Visit>
+    void for_each_line(Visit visit) const {
+        if (!mapped()) {
+            for (const std::string& line : lines) visit(std::string_view(line));
+            return;
+        }
+        for (const char* p = begin; p < end;) {
+            const char* stop = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!stop) stop = end;
+            visit(std::string_view(p, stop - p));
+            p = stop + 1;
+        }
+    }
+
+    // The lines as comma-separated JSON strings. Owned blocks keep the result
+    // when cache is set, so an unchanged block is encoded once for every
+    // joiner; mapped blocks are re-encoded rather than copied to the heap.
+    std::shared_ptr<const std::string> encode(bool cache) const {
+        if (cache) {
+            if (auto cached = std::atomic_load(&encoded)) return cached;
+        }
+        blocks_encoded++;
+        auto text = std::make_shared<std::string>();
+        bool first = true;
+        for_each_line([&](std::string_view line) {
+            if (!first) text->push_back(',');
+            first = false;
+            *text += json(std::string(line)).dump(-1, ' ', false, json::error_handler_t::replace);
+        });
+        if (cache && !mapped()) std::atomic_store(&encoded, std::shared_ptr<const std::string>(text));
+        return text;
+    }
+
+    // Line hashes and their fold, computed once per version of the block.
+    // Mapped blocks never change, so theirs are kept too.
+    std::shared_ptr<const Hashes> line_hashes() const {
+        if (auto cached = std::atomic_load(&hashes)) return cached;
+        auto computed = std::make_shared<Hashes>();
+        computed->lines.reserve(size());
+        for_each_line([&computed](std::string_view line) {
+            uint64_t hash = line_hash(line);
+            computed->lines.push_back(hash);
+            computed->fold = computed->fold * HASH_BASE + hash;
+        });
+        std::atomic_store(&hashes, std::shared_ptr<const Hashes>(computed));
+        return computed;
+    }
+
+    // Heap copy of this block, for editing
+    std::shared_ptr<DocumentBlock> owned_copy() const {
+        if (!mapped()) return std::make_shared<DocumentBlock>(lines);
+        auto copy = std::make_shared<DocumentBlock>();
+        copy->lines.reserve(size());
+        for_each_line([&copy](std::string_view line) { copy->lines.emplace_back(line); });
+        return copy;
+    }
+};
+
+// A consistent, read-only view of the document at one revision. Taking one
+// copies the block pointers only; the blocks stay shared with the live
+// document until it next edits them.
+struct DocumentSnapshot {
+    std::vector<std::shared_ptr<const DocumentBlock>> blocks;
+    size_t line_count = 0;
+    uint64_t revision = 0;
+
+    template <typename Visit>
+    void for_each_line(Visit visit) const {
+        for (const auto& block : blocks) block->for_each_line(visit);
+    }
+};
+
+// The shared document: lines kept in blocks of about BLOCK_LINES, each held by
+// shared_ptr. A block still referenced by a snapshot is cloned before its first
+// edit, so a snapshot is a point-in-time view that never holds up the writer.
+// Splitting or joining a line shifts one block instead of the whole document.
+class Document {
+public:
+    using Block = DocumentBlock;
+
+    Document() {
+        assign({""});
+    }
+
+    // Replace the contents; an empty document still has one empty line
+    void assign(std::vector<std::string> lines) {
+        std::vector<std::shared_ptr<Block>> owned;
+        for (size_t i = 0; i < lines.size(); i += BLOCK_LINES) {
+            size_t end = std::min(lines.size(), i + BLOCK_LINES);
+            owned.push_back(std::make_shared<Block>(std::vector<std::string>(
+                std::make_move_iterator(lines.begin() + i), std::make_move_iterator(lines.begin() + end))));
+        }
+        assign(std::move(owned));
+    }
+
+    // Replace the contents with a mapped file, split into MAPPED_BLOCK_BYTES
+    // blocks at line ends. Finding those reads one page per block; readahead
+    // is held off meanwhile, so the rest of the file stays on disk.
+    void assign(std::shared_ptr<const MappedFile> file) {
+        std::vector<std::shared_ptr<Block>> mapped;
+        const char* data = file->data;
+        const char* data_end = data + file->size;
+        madvise(const_cast<char*>(data), file->size, MADV_RANDOM);
+        for (const char* begin = data; begin < data_end;) {
+            const char* end = data_end;
+            if (static_cast<size_t>(data_end - begin) > MAPPED_BLOCK_BYTES) {
+                const char* newline = static_cast<const char*>(memchr(begin + MAPPED_BLOCK_BYTES, '\n', data_end - begin - MAPPED_BLOCK_BYTES));
+                if (newline) end = newline + 1;
+            }
+            auto block = std::make_shared<Block>();
+            block->file = file;
+            block->begin = begin;
+            block->end = end;
+            mapped.push_back(block);
+            begin = end;
+        }
+        madvise(const_cast<char*>(data), file->size, MADV_SEQUENTIAL);
+        assign(std::move(mapped));
+    }
+
+    // Replace the contents with blocks, owned or mapped, in document order.
+    // Line positions are found by count_lines() once one is first needed.
+    void assign(std::vector<std::shared_ptr<Block>> contents) {
+        if (contents.empty()) contents.push_back(std::make_shared<Block>(std::vector<std::string>{""}));
+        blocks = std::move(contents);
+        text_bytes = 0;
+        for (const auto& block : blocks) {
+            if (block->mapped()) {
+                text_bytes += block->end - block->begin;
+                continue;
+            }
+            for (const std::string& line : block->lines) text_bytes += line.size() + 1;
+        }
+        text_bytes--;   // No break after the last line
+        starts.clear();
+        line_count = 0;
+        counted = false;
+    }
+
+    size_t size() const {
+        count_lines();
+        return line_count;
+    }
+
+    // Length of the text, counting each line break as one byte. Editors
+    // report what they add or remove through resized().
+    size_t bytes() const {
+        return text_bytes;
+    }
+    void resized(std::ptrdiff_t delta) {
+        text_bytes += delta;
+    }
+
+    std::string_view line(size_t y) const {
+        auto [b, i] = locate(y);
+        return blocks[b]->line(i);
+    }
+
+    // Line y for modification; copies its block to the heap first if it is
+    // mapped or shared with a snapshot
+    std::string& edit_line(size_t y) {
+        auto [b, i] = writable(y);
+        return blocks[b]->lines[i];
+    }
+
+    // Insert a line before line y (y == size() appends)
+    void insert_line(size_t y, std::string text) {
+        auto [b, i] = writable(std::min(y, size()));
+        std::vector<std::string>& lines = blocks[b]->lines;
+        lines.insert(lines.begin() + i, std::move(text));
+        line_count++;
+        for (size_t k = b + 1; k < starts.size(); ++k) starts[k]++;
+        if (lines.size() >= 2 * BLOCK_LINES) split(b);
+    }
+
+    void erase_line(size_t y) {
+        auto [b, i] = writable(y);
+        std::vector<std::string>& lines = blocks[b]->lines;
+        lines.erase(lines.begin() + i);
+        line_count--;
+        for (size_t k = b + 1; k < starts.size(); ++k) starts[k]--;
+        if (lines.empty() && blocks.size() > 1) {
+            blocks.erase(blocks.begin() + b);
+            starts.erase(starts.begin() + b);
+        }
+    }
+
+    // Point-in-time view; O(blocks) pointer copies. Caller holds buffer_mutex.
+    DocumentSnapshot snapshot(uint64_t revision) const {
+        DocumentSnapshot snap;
+        snap.blocks.assign(blocks.begin(), blocks.end());
+        snap.line_count = size();
+        snap.revision = revision;
+        return snap;
+    }
+
+    template <typename Visit>
+    void for_each_line(Visit visit) const {
+        for (const auto& block : blocks) block->for_each_line(visit);
+    }
+
+    json lines_json() const {
+        json lines = json::array();
+        for_each_line([&lines](std::string_view line) { lines.push_back(std::string(line)); });
+        return lines;
+    }
+
+    // Blocks and bytes copied so far because a snapshot still shared them
+    uint64_t cloned_blocks() const {
+        return blocks_cloned;
+    }
+    uint64_t cloned_bytes() const {
+        return bytes_cloned;
+    }
+
+    // Memory the document holds: owned lines on the heap, mapped bytes, and
+    // the block index with the caches hung off each block. Caller holds
+    // buffer_mutex.
+    json memory() const {
+        size_t heap = 0, mapped = 0, index = blocks.capacity() * sizeof(blocks[0]) + starts.capacity() * sizeof(size_t);
+        for (const auto& block : blocks) {
+            index += sizeof(Block);
+            if (block->mapped()) {
+                mapped += block->end - block->begin;
+                index += block->offsets.capacity() * sizeof(size_t);
+            }
+            else {
+                heap += block->lines.capacity() * sizeof(std::string);
+                for (const std::string& line : block->lines) heap += string_heap_bytes(line);
+            }
+            if (auto encoded = std::atomic_load(&block->encoded)) index += encoded->capacity();
+            if (auto hashes = std::atomic_load(&block->hashes)) index += hashes->lines.capacity() * sizeof(uint64_t);
+        }
+        return {
+            {"text_bytes", text_bytes},
+            {"heap_bytes", heap},
+            {"mapped_bytes", mapped},
+            {"index_bytes", index}
+        };
+    }
+
+    // Block counts and how much of the document still lives in a mapping. Caller holds buffer_mutex.
+    json stats() const {
+        size_t mapped_blocks = 0, mapped_bytes = 0;
+        for (const auto& block : blocks) {
+            if (!block->mapped()) continue;
+            mapped_blocks++;
+            mapped_bytes += block->end - block->begin;
+        }
+        return {
+            {"lines", size()},
+            {"blocks", blocks.size()},
+            {"mapped_blocks", mapped_blocks},
+            {"mapped_bytes", mapped_bytes},
+            {"cloned_blocks", cloned_blocks()},
+            {"cloned_bytes", cloned_bytes()}
+        };
+    }
+
+private:
+    // Find where each block starts, counting the lines of mapped blocks that
+    // have not been counted yet. Done on the first use of a line position, so
+    // loading a document reads none of its mapped bytes.
+    void count_lines() const {
+        if (counted) return;
+        starts.clear();
+        line_count = 0;
+        for (const auto& block : blocks) {
+            starts.push_back(line_count);
+            line_count += block->size();
+        }
+        counted = true;
+    }
+
+    // Block index and offset of line y
+    std::pair<size_t, size_t> locate(size_t y) const {
+        count_lines();
+        size_t b = std::upper_bound(starts.begin(), starts.end(), y) - starts.begin() - 1;
+        return {b, y - starts[b]};
+    }
+
+    // Block index and offset of line y (y == size() is the end of the last
+    // block), once that block may be modified. A mapped block is copied to the
+    // heap and cut into BLOCK_LINES pieces there, so copy-on-write never
+    // clones a block of a whole mapped range.
+    std::pair<size_t, size_t> writable(size_t y) {
+        auto [b, i] = locate(y);
+        if (blocks[b]->mapped()) {
+            blocks[b] = blocks[b]->owned_copy();
+            split(b);
+            std::tie(b, i) = locate(y);
+        }
+        // Snapshots are only taken under buffer_mutex, so the count cannot rise
+        // concurrently; a racing release merely causes one unneeded copy
+        else if (blocks[b].use_count() > 1) {
+            blocks[b] = blocks[b]->owned_copy();
+            blocks_cloned++;
+            for (const std::string& line : blocks[b]->lines) bytes_cloned += sizeof(std::string) + line.capacity();
+        }
+        else {
+            // Edited in place: no snapshot can be reading it, so just drop the caches
+            std::atomic_store(&blocks[b]->encoded, std::shared_ptr<const std::string>());
+            std::atomic_store(&blocks[b]->hashes, std::shared_ptr<const Block::Hashes>());
+        }
+        return {b, i};
+    }
+
+    // Cut an oversized block (already writable) into blocks of BLOCK_LINES lines
+    void split(size_t b) {
+        std::vector<std::string>& lines = blocks[b]->lines;
+        if (lines.size() <= BLOCK_LINES) return;
+        std::vector<std::shared_ptr<Block>> tail;
+        std::vector<size_t> tail_starts;
+        for (size_t i = BLOCK_LINES; i < lines.size(); i += BLOCK_LINES) {
+            size_t end = std::min(lines.size(), i + BLOCK_LINES);
+            tail.push_back(std::make_shared<Block>(std::vector<std::string>(
+                std::make_move_iterator(lines.begin() + i), std::make_move_iterator(lines.begin() + end))));
+            tail_starts.push_back(starts[b] + i);
+        }
+        lines.resize(BLOCK_LINES);
+        lines.shrink_to_fit();
+        blocks.insert(blocks.begin() + b + 1, tail.begin(), tail.end());
+        starts.insert(starts.begin() + b + 1, tail_starts.begin(), tail_starts.end());
+    }
+
+    std::vector<std::shared_ptr<Block>> blocks;
+    mutable std::vector<size_t> starts; // Index of each block's first line, once counted
+    mutable size_t line_count = 0;
+    mutable bool counted = false;       // starts and line_count are up to date
+    size_t text_bytes = 0;
+    std::atomic<uint64_t> blocks_cloned{0};
+    std::atomic<uint64_t> bytes_cloned{0};
+};
+
+// A snapshot being streamed to joiners, shared by every joiner at its revision.
+// Each chunk is one block, sent as head() + *lines() + CHUNK_TAIL, so the
+// encoded lines are shared rather than copied into every joiner's frames.
+struct SnapshotStream {
+    static constexpr const char* CHUNK_TAIL = "]},\"packet_type\":\"snapshot_chunk\"}\n";
+
+    DocumentSnapshot snapshot;
+    std::vector<size_t> starts;                             // First line of each chunk
+    std::vector<std::shared_ptr<const std::string>> encoded; // Encoded lines per chunk, filled lazily
+    std::mutex mutex;                                       // Guards encoded
+    bool cache_blocks;
+
+    SnapshotStream(DocumentSnapshot snap, bool cache) : snapshot(std::move(snap)), cache_blocks(cache) {
+        size_t line = 0;
+        for (const auto& block : snapshot.blocks) {
+            starts.push_back(line);
+            line += block->size();
+        }
+        encoded.resize(snapshot.blocks.size());
+    }
+
+    size_t size() const {
+        return encoded.size();
+    }
+
+    std::string head(size_t index) const {
+        return "{\"data\":{\"final\":" + std::string(index + 1 == encoded.size() ? "true" : "false") +
+               ",\"revision\":" + std::to_string(snapshot.revision) + ",\"start\":" + std::to_string(starts[index]) +
+               ",\"lines\":[";
+    }
+
+    std::shared_ptr<const std::string> lines(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!encoded[index]) encoded[index] = snapshot.blocks[index]->encode(cache_blocks);
+        return encoded[index];
+    }
+};
+
+// Function to describe a snapshot relative to a client's stale copy, rsync
+// style. The client hashes its copy in chunks of chunk_lines lines (the
+// polynomial over line hashes with HASH_BASE); a rolling hash over the
+// snapshot's cached line hashes finds those chunks at any line offset. The
+// result is a JSON array whose elements are either [first, count], copy that
+// many of the client's chunks, or a string, one literal line.
+std::string encode_delta(const DocumentSnapshot& snapshot, size_t chunk_lines,
+                         const std::vector<uint64_t>& chunk_hashes, size_t& copied_lines) {
+    std::unordered_map<uint64_t, size_t> chunks;
+    chunks.reserve(chunk_hashes.size());
+    for (size_t i = 0; i < chunk_hashes.size(); ++i) chunks.emplace(chunk_hashes[i], i);
+
+    std::vector<uint64_t> hashes;
+    hashes.reserve(snapshot.line_count);
+    for (const auto& block : snapshot.blocks) {
+        auto block_hashes = block->line_hashes();
+        hashes.insert(hashes.end(), block_hashes->lines.begin(), block_hashes->lines.end());
+    }
+
+    // Literal lines are visited in order, so one block cursor finds them
+    size_t block_index = 0, block_start = 0;
+    auto line_text = [&](size_t y) {
+        while (y >= block_start + snapshot.blocks[block_index]->size()) {
+            block_start += snapshot.blocks[block_index]->size();
+            block_index++;
+        }
+        return snapshot.blocks[block_index]->line(y - block_start);
+    };
+
+    uint64_t top = 1;   // HASH_BASE^(chunk_lines - 1), to drop the line leaving the window
+    for (size_t i = 1; i < chunk_lines; ++i) top *= HASH_BASE;
+    auto window = [&](size_t y) {
+        uint64_t hash = 0;
+        for (size_t i = y; i < y + chunk_lines; ++i) hash = hash * HASH_BASE + hashes[i];
+        return hash;
+    };
+
+    std::string out = "[";
+    size_t run_first = 0, run_count = 0;     // Pending run of copied chunks
+    auto flush_run = [&] {
+        if (run_count == 0) return;
+        if (out.size() > 1) out.push_back(',');
+        out += "[" + std::to_string(run_first) + "," + std::to_string(run_count) + "]";
+        run_count = 0;
+    };
+
+    size_t n = hashes.size();
+    copied_lines = 0;
+    uint64_t hash = n >= chunk_lines ? window(0) : 0;
+    for (size_t y = 0; y < n;) {
+        if (y + chunk_lines <= n) {
+            auto match = chunks.find(hash);
+            if (match != chunks.end()) {
+                if (run_count > 0 && run_first + run_count == match->second) {
+                    run_count++;
+                }
+                else {
+                    flush_run();
+                    run_first = match->second;
+                    run_count = 1;
+                }
+                copied_lines += chunk_lines;
+                y += chunk_lines;
+                if (y + chunk_lines <= n) hash = window(y);
+                continue;
+            }
+        }
+        flush_run();
+        if (out.size() > 1) out.push_back(',');
+        out += json(std::string(line_text(y))).dump(-1, ' ', false, json::error_handler_t::replace);
+        if (y + chunk_lines < n) hash = (hash - hashes[y] * top) * HASH_BASE + hashes[y + chunk_lines];
+        y++;
+    }
+    flush_run();
+    out.push_back(']');
+    return out;
+}
+
+// A Merkle tree over one snapshot's blocks, for divergence checks. A range of
+// lines hashes to the fold of its line hashes, as in a delta request, so a
+// parent is its children joined (left * HASH_BASE^lines(right) + right) and
+// any node follows from prefix folds over the blocks' cached hashes. Nodes
+// are block ranges [lo, hi) halved down to single blocks; clients check the
+// same line ranges of their own copy.
+struct MerkleTree {
+    DocumentSnapshot snapshot;
+    std::vector<size_t> starts;     // First line of each block, then the line count
+    std::vector<uint64_t> prefix;   // Fold of blocks [0, i)
+
+    explicit MerkleTree(DocumentSnapshot snap) : snapshot(std::move(snap)) {
+        starts.push_back(0);
+        prefix.push_back(0);
+        for (const auto& block : snapshot.blocks) {
+            prefix.push_back(prefix.back() * hash_power(block->size()) + block->line_hashes()->fold);
+            starts.push_back(starts.back() + block->size());
+        }
+    }
+
+    size_t blocks() const {
+        return snapshot.blocks.size();
+    }
+
+    uint64_t hash(size_t lo, size_t hi) const {
+        return prefix[hi] - prefix[lo] * hash_power(starts[hi] - starts[lo]);
+    }
+
+    // Node [lo, hi) with its line range and hash; a single block also carries its lines
+    json node(size_t lo, size_t hi, bool with_lines) const {
+        json entry = {
+            {"lo", lo}, {"hi", hi},
+            {"start", starts[lo]}, {"count", starts[hi] - starts[lo]},
+            {"hash", hash(lo, hi)}
+        };
+        if (with_lines) {
+            json lines = json::array();
+            snapshot.blocks[lo]->for_each_line([&lines](std::string_view line) { lines.push_back(std::string(line)); });
+            entry["lines"] = lines;
+        }
+        return entry;
+    }
+};
+
+// Function to wrap an encoded delta as a "delta" packet for the given revision
+Frame delta_frame(uint64_t revision, const std::string& ops) {
+    return std::make_shared<const std::string>("{\"data\":{\"ops\":" + ops + ",\"revision\":" +
+                                               std::to_string(revision) + "},\"packet_type\":\"delta\"}\n");
+}
+
+// Function to map a file read-only; the file must not change while it is mapped,
+// nor while a checkpoint still refers to it
+std::shared_ptr<const MappedFile> map_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(("Cannot open " + path).c_str());
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(("Cannot stat " + path).c_str());
+        ::close(fd);
+        return nullptr;
+    }
+    auto file = std::make_shared<MappedFile>();
+    char* resolved = realpath(path.c_str(), nullptr);
+    file->path = resolved ? resolved : path;
+    free(resolved);
+    file->mtime_ns = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    if (st.st_size > 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(("Cannot map " + path).c_str());
+            ::close(fd);
+            return nullptr;
+        }
+        file->data = static_cast<const char*>(data);
+        file->size = st.st_size;
+    }
+    ::close(fd);
+    return file;
+}
+
+// Global Variables
+std::map<int, User> users;                     // Map of connection ids to Users
+std::mutex users_mutex;                        // Mutex to protect the users map
+std::vector<std::string> colors = {            // Predefined list of colors
+    "#FF5733", "#33FF57", "#3357FF", "#FF33A8",
+    "#A833FF", "#33FFF6", "#FF8F33", "#8FFF33",
+    "#FF3333", "#33FF8F"
+};
+int color_index = 0;                           // Index to assign colors
+std::mutex color_mutex;                        // Mutex to protect color assignment
+
+Document shared_buffer;                         // Shared document buffer
+FairMutex buffer_mutex;                         // Mutex to protect the shared buffer
+uint64_t buffer_revision = 0;                   // Number of operations applied (guarded by buffer_mutex)
+OpLog oplog;                                    // Durable record of every applied operation
+std::weak_ptr<SnapshotStream> shared_stream;    // Stream joiners at its revision can share (guarded by buffer_mutex)
+bool snapshot_cache = true;                     // Share streams and cache encoded blocks
+std::mutex checkpoint_mutex;                    // Serializes checkpoint writers
+std::atomic<uint64_t> checkpoint_revision(0);   // Revision of the newest checkpoint
+std::atomic<uint64_t> checkpoint_ms(0);         // Time taken to write it
+std::atomic<uint64_t> checkpoint_bytes(0);      // Its size on disk
+std::atomic<uint64_t> snapshot_us(0);           // Time editing was held up to take its snapshot
+std::atomic<uint64_t> snapshot_extra_bytes(0);  // Blocks cloned by edits while it was being written
+
+// Struct to hold the document as it was at a past revision, rebuilt for history reads
+struct PastDocument {
+    uint64_t revision = 0;
+    Document doc;
+};
+std::unique_ptr<PastDocument> past_document;    // Last revision rebuilt, reused by the next read (guarded by history_mutex)
+std::mutex history_mutex;                       // Serializes history reads; taken before checkpoint_mutex
+std::atomic<uint64_t> history_reads(0);         // History reads answered
+std::atomic<uint64_t> history_replayed(0);      // Operations replayed to answer them
+std::atomic<uint64_t> history_read_ms(0);       // Time the last one took
+
+// Lock order: buffer_mutex, then users_mutex, then an Outbox mutex.
+// Operations are stamped and fanned out while buffer_mutex is held, so every
+// outbox receives them in revision order.
+
+int udp_fd = -1;                               // UDP socket for cursor/presence datagrams
+std::map<std::string, int> udp_sessions;       // UDP token -> connection id (guarded by users_mutex)
+std::atomic<int> next_client_id(1);            // Source of connection ids
+std::map<std::string, Session> sessions;       // Session token -> session (guarded by users_mutex)
+std::map<int, Follower> followers;             // Connection id -> follower (guarded by users_mutex)
+
+// Struct to hold an observer: a read-only client that is not a user. It has
+// no threads of its own; observer_loop writes to it and notices it leave.
+struct Observer {
+    std::shared_ptr<class Connection> conn;
+    std::shared_ptr<Outbox> outbox;
+    uint64_t joined_revision;   // Revision of its snapshot; earlier operations are not sent
+    int fd;                     // The connection's socket, non-blocking
+    FrameQueue ready;           // Frames taken from the outbox, to write in order
+    size_t sent = 0;            // Bytes of ready.front() already written
+};
+std::map<int, Observer> observers;             // Connection id -> observer (guarded by observers_mutex)
+std::mutex observers_mutex;                    // Taken after users_mutex
+using ObserverFeed = std::deque<std::pair<uint64_t, Frame>, SlabAllocator<std::pair<uint64_t, Frame>>>;
+ObserverFeed observer_feed;                    // Operations for observers, by revision (guarded by observer_feed_mutex)
+std::mutex observer_feed_mutex;
+int observer_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // Wakes observer_loop from its poll
+std::atomic<uint64_t> observer_frames(0);      // Frames fanned out to observers
+std::atomic<uint64_t> observer_fanout_us(0);   // Time the fan-out thread has spent on them
+
+// Struct to hold a client's ack waiting for followers to apply its operation
+struct HeldAck {
+    uint64_t revision;
+    std::weak_ptr<Outbox> outbox;
+    Frame frame;
+};
+std::deque<HeldAck, SlabAllocator<HeldAck>> held_acks;                 // In revision order (guarded by users_mutex)
+std::atomic<bool> following(false);            // This server is a read-only replica of follow_address
+std::atomic<bool> leader_connected(false);     // The replica currently has a connection to its leader
+std::atomic<bool> replica_stale(false);        // The replica's log may hold edits its leader lacks
+std::atomic<uint64_t> epoch(1);                // Leadership term; a server never follows a lower one
+uint64_t epoch_revision = 0;                   // Revision at which this server's term began (guarded by failover_mutex)
+std::vector<std::string> standbys;             // Addresses that take over, in order, from the leader's heartbeat
+std::string own_address;                       // This replica's address as its leader lists it
+std::string former_leader;                     // Leader this server took over from, fenced while it leads
+std::vector<std::string> known_standbys;       // Every standby that has followed this server; only they may fence it
+std::mutex failover_mutex;                     // Guards the above, follow_address, the epoch and standbys files
+
+// Struct to hold a recently applied operation for clients resuming a session
+struct HistoryEntry {
+    uint64_t revision;          // Revision the operation produced
+    Frame frame;                // The operation as broadcast to other clients
+    std::shared_ptr<const std::string> session; // Session that sent it, shared with its connection
+    uint64_t cseq;              // Its sequence number within that session
+    EditShape shape;            // Where it landed, for moving undo steps across it
+    bool generated;             // Made by the server (undo/redo), so sent to its session too
+    std::chrono::steady_clock::time_point applied{}; // When it was applied, for replication lag
+};
+std::deque<HistoryEntry, SlabAllocator<HistoryEntry>> op_history;           // Recent operations, oldest first (guarded by buffer_mutex)
+
+// Struct to hold one undo (or redo) step: the edit that reverses it, with
+// positions as of `revision`. A run of keystrokes shares one step.
+struct UndoEntry {
+    TextEdit inverse;           // Either deletes a range or inserts text, never both
+    uint64_t revision;          // Revision its positions refer to
+    bool typing;                // A keystroke run the next keystroke may extend
+    std::chrono::steady_clock::time_point updated;
+};
+
+// Struct to hold a session's undo and redo stacks, newest last
+struct UndoHistory {
+    std::deque<UndoEntry, SlabAllocator<UndoEntry>> undo;
+    std::deque<UndoEntry, SlabAllocator<UndoEntry>> redo;
+};
+std::map<std::string, UndoHistory> undo_histories; // Session token -> stacks (guarded by buffer_mutex)
+std::deque<std::shared_ptr<const MerkleTree>> merkle_trees; // Trees of the last root broadcasts, oldest first
+std::mutex merkle_mutex;                       // Guards merkle_trees
+std::atomic<uint64_t> tree_build_us(0);        // Time the last root took under buffer_mutex
+std::atomic<uint64_t> tree_requests(0);        // Nodes asked for by diverged clients
+
+// Signal Handling for Graceful Shutdown
+std::atomic<bool> server_running(true);
+
+int listen_fd = -1;
+int unix_listen_fd = -1;
+void handle_signal(int signal) {
+    if (signal == SIGINT) {
+        std::cout << "\nShutting down server gracefully..." << std::endl;
+        server_running = false;
+        close(listen_fd);
+        if (unix_listen_fd >= 0) close(unix_listen_fd);
+    }
+}
+
+// Server settings, overridable from the command line
+int server_port = PORT;                        // TCP and UDP port
+std::string unix_socket_path;                  // AF_UNIX listening socket ("" disables it)
+double ops_per_sec = OPS_PER_SEC;              // Per-client operation rate limit
+double bytes_per_sec = BYTES_PER_SEC;          // Per-client inbound byte rate limit
+std::string data_dir = "data";                 // Directory holding checkpoints and the operation log
+std::string open_path;                         // File mapped as the initial document ("" for empty)
+FsyncPolicy fsync_policy = FsyncPolicy::Interval;
+int flush_ms = FLUSH_MS;                       // Group commit interval
+int fsync_ms = FSYNC_MS;                       // fsync interval under FsyncPolicy::Interval
+uint64_t checkpoint_ops = CHECKPOINT_OPS;      // Checkpoint after this many operations (0 disables)
+size_t keyframes_kept = HISTORY_KEYFRAMES;     // Checkpoints kept; history reaches back to the oldest
+int checkpoint_secs = CHECKPOINT_SECS;         // ...or after this long with any change (0 disables)
+size_t history_ops = HISTORY_OPS;              // Operations kept in op_history
+int session_ttl_secs = SESSION_TTL_SECS;       // How long a dropped session stays resumable
+int tree_secs = TREE_SECS;                     // Root hash broadcast interval (0 disables)
+std::string follow_address;                    // Leader "host:port" to replicate from ("" for a leader)
+size_t sync_replicas = 0;                      // Followers that must apply an operation before its ack (0: async)
+int failover_ms = FAILOVER_MS;                 // Leader silence before a standby takes over (0: never)
+bool relay = false;                            // Follow without storing the document, for viewers only
+std::string peer_secret;                       // Shared by the servers of a cluster ("": trust this host only)
+std::vector<std::string> ring_nodes;           // Nodes documents are spread over (empty: serve one document here)
+std::string node_address;                      // This node's address on the ring (default 127.0.0.1:<port>)
+size_t ring_vnodes = RING_VNODES;              // Points per node on the ring
+std::string document_name;                     // The one document this process serves ("" accepts any client)
+int ready_fd = -1;                             // Pipe to the routing node, told our port once we listen
+int idle_secs = IDLE_SECS;                     // A document process with no clients this long hibernates (0: never)
+size_t max_resident = 0;                       // Document processes a routing node keeps running (0: no cap)
+size_t max_packet_bytes = MAX_PACKET_BYTES;    // Longest inbound packet; longer ones are discarded
+size_t max_document_bytes = 0;                 // Largest the document text may grow through edits (0: no quota)
+size_t max_outbound_bytes = MAX_OUTBOUND_BYTES; // Bulk lane backlog past which a client's requests are refused
+std::vector<std::string> document_args;        // Options a routing node passes on to its document processes
+bool bench_ring = false;                       // Run the hash ring benchmark instead of serving
+bool bench_alloc = false;                      // Run the allocation counting benchmark instead of serving
+bool bench_recovery = false;                   // Run the recovery benchmark instead of serving
+bool bench_join = false;                       // Run the join throughput benchmark instead of serving
+bool bench_delta = false;                      // Run the delta resync benchmark instead of serving
+int bench_joiners = 200;                       // Clients joining in each join benchmark run
+int bench_mb = 50;                             // Benchmark document size
+uint64_t bench_ops = 864000;                   // Benchmark edits: a day at 10 operations per second
+
+// Struct to hold the process serving one document on a routing node
+struct DocumentProcess {
+    pid_t pid;
+    int port;
+    int status_fd;                              // Read end of its pipe: "idle", "busy", "hibernate" lines
+    bool idle;                                  // No clients, as it last reported
+    std::chrono::steady_clock::time_point last_used; // Last client routed to it, for LRU eviction
+};
+std::unique_ptr<HashRing> ring;                // Built from ring_nodes on a routing node
+std::map<std::string, DocumentProcess> documents; // Document name -> its process (guarded by documents_mutex)
+std::mutex documents_mutex;
+
+// Struct to count how often joins find their document running (guarded by documents_mutex)
+struct ResidencyStats {
+    uint64_t hits = 0;                          // Joins routed to a running process
+    uint64_t loads = 0;                         // Joins that had to start one
+    uint64_t load_us = 0;                       // Total time spent starting them
+    uint64_t max_load_us = 0;
+    uint64_t hibernations = 0;                  // Processes that stopped after idle_secs
+    uint64_t evictions = 0;                     // Idle processes stopped for max_resident
+};
+ResidencyStats residency;
+
+// Function to assign a unique color to a new user
+std::string assign_color() {
+    std::lock_guard<std::mutex> lock(color_mutex);
+    std::string color = colors[color_index];
+    color_index = (color_index + 1) % colors.size();
+    return color;
+}
+
+// Function to send all data reliably
+bool send_all(int sockfd, const std::string& message) {
+    size_t total_sent = 0;
+    size_t to_send = message.length();
+    const char* data = message.c_str();
+    while (total_sent < to_send) {
+        ssize_t sent = send(sockfd, data + total_sent, to_send - total_sent, 0);
+        if (sent < 0) {
+            perror("Send error");
+            return false;
+        }
+        total_sent += sent;
+    }
+    return true;
+}
+
+// Abstract transport for a client connection. TCP and AF_UNIX clients use a
+// socket; co-located clients may upgrade to a shared-memory ring.
+class Connection {
+public:
+    virtual ~Connection() = default;
+    // Read up to length bytes; returns 0 when the peer closed, <0 on error
+    virtual ssize_t receive(char* buffer, size_t length) = 0;
+    // Write the whole message, blocking while the peer is slow
+    virtual bool send_all(const std::string& message) = 0;
+    // Wake blocked readers/writers and stop the connection
+    virtual void shutdown() = 0;
+    // Human-readable endpoint for logs
+    virtual std::string describe() const = 0;
+    // Whether the peer is on this host (may upgrade to shared memory)
+    virtual bool is_local() const { return false; }
+};
+
+// Connection over a stream socket (AF_INET or AF_UNIX)
+class SocketConnection : public Connection {
+public:
+    SocketConnection(int fd, const std::string& peer, bool local)
+        : fd(fd), peer(peer), local(local) {}
+    ~SocketConnection() override { close(fd); }
+
+    ssize_t receive(char* buffer, size_t length) override { return recv(fd, buffer, length, 0); }
+    bool send_all(const std::string& message) override { return ::send_all(fd, message); }
+    void shutdown() override { ::shutdown(fd, SHUT_RDWR); }
+    std::string describe() const override { return peer; }
+    bool is_local() const override { return local; }
+    int socket_fd() const { return fd; }
+
+private:
+    int fd;
+    std::string peer;
+    bool local;
+};
+
+// Single-producer/single-consumer byte ring living in shared memory.
+// head and tail are free-running byte counters; the futex words are bumped
+// on every publish so a sleeping peer can be woken without polling.
+struct ShmRing {
+    std::atomic<uint64_t> head;         // Bytes written by the producer
+    std::atomic<uint64_t> tail;         // Bytes consumed by the consumer
+    std::atomic<uint32_t> data_seq;     // Futex word: data was published
+    std::atomic<uint32_t> space_seq;    // Futex word: space was released
+    std::atomic<uint32_t> waiters;      // Sleepers on either futex word
+    std::atomic<uint32_t> closed;       // Either side hung up
+    char data[SHM_RING_SIZE];
+};
+
+// Shared-memory segment layout: one ring per direction
+struct ShmSegment {
+    ShmRing to_server;
+    ShmRing to_client;
+};
+
+// Function to sleep on a futex word in a shared mapping until it changes
+void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, int timeout_ms) {
+    timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+// Function to wake every sleeper on a futex word in a shared mapping
+void futex_wake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Connection whose frames travel through a shared-memory segment instead of
+// the kernel. The AF_UNIX socket it was negotiated on stays open and is only
+// used to notice the peer going away.
+class ShmConnection : public Connection {
+public:
+    // Create a fresh segment; returns nullptr if shared memory is unavailable
+    static std::shared_ptr<ShmConnection> create(std::shared_ptr<SocketConnection> control) {
+        std::string name = "/np_final_" + std::to_string(getpid()) + "_" + std::to_string(control->socket_fd());
+        int shm_fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (shm_fd < 0) {
+            perror("shm_open failed");
+            return nullptr;
+        }
+        if (ftruncate(shm_fd, sizeof(ShmSegment)) < 0) {
+            perror("ftruncate failed");
+            close(shm_fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        void* addr = mmap(nullptr, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        close(shm_fd);
+        if (addr == MAP_FAILED) {
+            perror("mmap failed");
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        // ftruncate zero-fills the segment, which is the initial state of both rings
+        return std::shared_ptr<ShmConnection>(new ShmConnection(control, name, static_cast<ShmSegment*>(addr)));
+    }
+
+    ~ShmConnection() override {
+        unlink_segment();
+        munmap(segment, sizeof(ShmSegment));
+    }
+
+    ssize_t receive(char* buffer, size_t length) override {
+        ShmRing& ring = segment->to_server;
+        while (true) {
+            uint32_t seq = ring.data_seq.load(std::memory_order_acquire);
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            if (head != tail) {
+                // The peer is attached once it has written; the name is no longer needed
+                unlink_segment();
+                size_t n = std::min<uint64_t>(length, head - tail);
+                for (size_t i = 0; i < n; ++i) buffer[i] = ring.data[(tail + i) % SHM_RING_SIZE];
+                ring.tail.store(tail + n, std::memory_order_release);
+                ring.space_seq.fetch_add(1, std::memory_order_release);
+                if (ring.waiters.load() > 0) futex_wake(ring.space_seq);
+                return n;
+            }
+            if (!alive()) return 0;
+            ring.waiters.fetch_add(1);
+            futex_wait(ring.data_seq, seq, SHM_POLL_MS);
+            ring.waiters.fetch_sub(1);
+        }
+    }
+
+    bool send_all(const std::string& message) override {
+        ShmRing& ring = segment->to_client;
+        size_t sent = 0;
+        while (sent < message.size()) {
+            uint32_t seq = ring.space_seq.load(std::memory_order_acquire);
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            size_t space = SHM_RING_SIZE - (head - tail);
+            if (space > 0) {
+                size_t n = std::min(space, message.size() - sent);
+                for (size_t i = 0; i < n; ++i) ring.data[(head + i) % SHM_RING_SIZE] = message[sent + i];
+                ring.head.store(head + n, std::memory_order_release);
+                ring.data_seq.fetch_add(1, std::memory_order_release);
+                if (ring.waiters.load() > 0) futex_wake(ring.data_seq);
+                sent += n;
+                continue;
+            }
+            if (!alive()) return false;
+            ring.waiters.fetch_add(1);
+            futex_wait(ring.space_seq, seq, SHM_POLL_MS);
+            ring.waiters.fetch_sub(1);
+        }
+        return true;
+    }
+
+    void shutdown() override {
+        for (ShmRing* ring : {&segment->to_server, &segment->to_client}) {
+            ring->closed.store(1);
+            ring->data_seq.fetch_add(1);
+            ring->space_seq.fetch_add(1);
+            futex_wake(ring->data_seq);
+            futex_wake(ring->space_seq);
+        }
+        control->shutdown();
+    }
+
+    std::string describe() const override { return control->describe() + " (shared memory " + name + ")"; }
+    bool is_local() const override { return true; }
+    const std::string& segment_name() const { return name; }
+
+private:
+    ShmConnection(std::shared_ptr<SocketConnection> control, const std::string& name, ShmSegment* segment)
+        : control(control), name(name), segment(segment) {}
+
+    // Whether the peer still holds the control socket and neither side closed the rings
+    bool alive() {
+        if (segment->to_server.closed.load() || segment->to_client.closed.load()) return false;
+        pollfd pfd = {control->socket_fd(), POLLIN, 0};
+        if (poll(&pfd, 1, 0) > 0) {
+            char probe;
+            if (recv(control->socket_fd(), &probe, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) return false;
+        }
+        return true;
+    }
+
+    void unlink_segment() {
+        std::call_once(unlinked, [this] { shm_unlink(name.c_str()); });
+    }
+
+    std::shared_ptr<SocketConnection> control;
+    std::string name;
+    ShmSegment* segment;
+    std::once_flag unlinked;
+};
+
+// Spare frame strings, reused once every holder of a frame has let go of it.
+// Only short strings are kept, so frames held in the history do not pin
+// buffers sized for some earlier large packet. Each string starts out with
+// the largest capacity kept, so no frame up to that size ever grows one.
+class FramePool {
+public:
+    static constexpr size_t MAX_CAPACITY = 256;
+    static constexpr size_t MAX_SPARE = 4096;   // Spares kept, unless keep() asks for more
+
+    static void keep(size_t count) {
+        FramePool& pool = instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.limit = std::max(pool.limit, count);
+        pool.spare.reserve(pool.limit);
+    }
+
+    static std::string* take() {
+        FramePool& pool = instance();
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (!pool.spare.empty()) {
+                std::string* text = pool.spare.back();
+                pool.spare.pop_back();
+                return text;
+            }
+        }
+        return make();
+    }
+
+    static void give(std::string* text) {
+        if (text->capacity() <= MAX_CAPACITY) {
+            text->clear();
+            FramePool& pool = instance();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (pool.spare.size() < pool.limit) {
+                pool.spare.push_back(text);
+                return;
+            }
+        }
+        delete text;
+    }
+
+private:
+    FramePool() { spare.reserve(MAX_SPARE); }
+
+    static std::string* make() {
+        auto* text = new std::string();
+        text->reserve(MAX_CAPACITY);
+        return text;
+    }
+
+    // Never destroyed: detached threads may still release frames while the process exits
+    static FramePool& instance() {
+        static FramePool* pool = new FramePool();
+        return *pool;
+    }
+
+    std::mutex mutex;
+    std::vector<std::string*> spare;
+    size_t limit = MAX_SPARE;   // Most spares kept
+};
+
+// Deleter handing a frame's string back to the pool
+struct FrameRecycler {
+    void operator()(const std::string* text) const { FramePool::give(const_cast<std::string*>(text)); }
+};
+
+// Function to have `count` frames ready before clients connect. Holding that
+// many at once, in a frame queue, makes the pool keep as many strings and
+// cuts slab blocks for their shared counts and for queues that long, so none
+// are allocated until more frames are in use.
+void fill_frame_pool(size_t count) {
+    FramePool::keep(count);
+    FrameQueue frames;
+    while (frames.size() < count) frames.emplace_back(FramePool::take(), FrameRecycler(), SlabAllocator<char>());
+}
+
+// Output adapter appending the serializer's output to the frame being encoded
+struct FrameWriter : nlohmann::detail::output_adapter_protocol<char> {
+    std::string* text = nullptr;
+    void write_character(char c) override { text->push_back(c); }
+    void write_characters(const char* s, std::size_t length) override { text->append(s, length); }
+};
+
+// Function to encode a JSON packet as a newline-terminated frame.
+// Invalid UTF-8 (e.g. half of a multi-byte character) is replaced rather than thrown.
+// The string comes from the frame pool and the shared count from a slab, and
+// each thread keeps one serializer: dump() would build one, with its indent
+// buffer, for every frame.
+Frame make_frame(const json& message) {
+    thread_local auto writer = std::make_shared<FrameWriter>();
+    thread_local nlohmann::detail::serializer<json> serializer(writer, ' ', json::error_handler_t::replace);
+    std::string* text = FramePool::take();
+    writer->text = text;
+    serializer.dump(message, false, false, 0);
+    text->push_back('\n');
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to wrap a packet received already encoded (without its newline)
+// as a frame, for a relay to pass on byte for byte
+Frame raw_frame(std::string_view packet) {
+    std::string* text = FramePool::take();
+    text->append(packet);
+    text->push_back('\n');
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to append an integer to a frame being encoded by hand
+template <typename T>
+void append_integer(std::string& text, T value) {
+    char digits[24];
+    text.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+// Function to append a string to a frame being encoded by hand, escaped as
+// the JSON library escapes it. The string must be valid UTF-8.
+void append_json_string(std::string& text, std::string_view value) {
+    text.push_back('"');
+    for (char c : value) {
+        switch (c) {
+            case '"': text.append("\\\""); break;
+            case '\\': text.append("\\\\"); break;
+            case '\b': text.append("\\b"); break;
+            case '\f': text.append("\\f"); break;
+            case '\n': text.append("\\n"); break;
+            case '\r': text.append("\\r"); break;
+            case '\t': text.append("\\t"); break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04x", c);
+                    text.append(escape, 6);
+                }
+                else {
+                    text.push_back(c);
+                }
+        }
+    }
+    text.push_back('"');
+}
+
+// Function to encode the ack of a client's operation: the revision it was
+// applied at, or rejected if it was not applied (revision 0)
+Frame ack_frame(uint64_t cseq, uint64_t revision) {
+    std::string* text = FramePool::take();
+    text->append("{\"data\":{\"cseq\":");
+    append_integer(*text, cseq);
+    if (revision > 0) {
+        text->append(",\"revision\":");
+        append_integer(*text, revision);
+    }
+    else {
+        text->append(",\"rejected\":true");
+    }
+    text->append("},\"packet_type\":\"ack\"}\n");
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to queue a frame on a user's outbox.
+// A client that cannot keep up has its backlog dropped instead: the writer
+// sends one snapshot at the current revision, which supersedes every frame
+// generated until then.
+void enqueue_frame(Outbox& outbox, const Frame& frame, Lane lane = Lane::Edit) {
+    {
+        std::lock_guard<std::mutex> lock(outbox.mutex);
+        if (outbox.closed || outbox.closing || outbox.resync_pending) return;
+        if (lane == Lane::Bulk) {
+            outbox.bulk.push_back(frame);
+            outbox.bulk_bytes += frame->size();
+        }
+        else if (!outbox.frames.empty() && outbox.queued_bytes + frame->size() > SLOW_CONSUMER_BYTES) {
+            outbox.frames.clear();
+            outbox.queued_bytes = 0;
+            outbox.resync_pending = true;
+            outbox.resyncs++;
+        }
+        else {
+            outbox.frames.push_back(frame);
+            outbox.queued_bytes += frame->size();
+        }
+    }
+    outbox.cv.notify_one();
+}
+
+// Function to queue a batch of (revision, frame) operations on the edit lane
+// under one lock and one wakeup, skipping those at or below after_revision
+void enqueue_frames(Outbox& outbox, const ObserverFeed& batch, uint64_t after_revision) {
+    {
+        std::lock_guard<std::mutex> lock(outbox.mutex);
+        if (outbox.closed || outbox.closing || outbox.resync_pending) return;
+        for (const auto& [revision, frame] : batch) {
+            if (revision <= after_revision) continue;
+            if (!outbox.frames.empty() && outbox.queued_bytes + frame->size() > SLOW_CONSUMER_BYTES) {
+                outbox.frames.clear();
+                outbox.queued_bytes = 0;
+                outbox.resync_pending = true;
+                outbox.resyncs++;
+                break;
+            }
+            outbox.frames.push_back(frame);
+            outbox.queued_bytes += frame->size();
+        }
+    }
+    outbox.cv.notify_one();
+}
+
+// Function to describe every user except exclude_id as a collaborator list.
+// Caller must hold users_mutex.
+json collaborator_list(int exclude_id) {
+    json collaborators = json::array();
+    for (const auto& [id, user] : users) {
+        if (id == exclude_id) continue;
+        collaborators.push_back({
+            {"name", user.uname},
+            {"color", user.ucolor},
+            {"cursor", {
+                {"x", user.cursor_x},
+                {"y", user.cursor_y}
+            }}
+        });
+    }
+    return collaborators;
+}
+
+// Function to build the header of a full-state message (revision, line count
+// and collaborators) as sent in connect_success and resync; the lines follow
+// as snapshot_chunk packets. Caller must hold buffer_mutex and users_mutex.
+json snapshot_message(const std::string& message_type, int client_id) {
+    return {
+        {"packet_type", "message"},
+        {"data", {
+            {"message_type", message_type},
+            {"revision", buffer_revision},
+            {"lines", shared_buffer.size()},
+            {"collaborators", collaborator_list(client_id)}
+        }}
+    };
+}
+
+// Function to queue a full-state header on the bulk lane and stream the
+// document after it, as of the same revision. Joiners at the same revision
+// share one stream, so its chunks are encoded once. Caller must hold
+// buffer_mutex and users_mutex; at most block pointers are copied here.
+void queue_snapshot(Outbox& outbox, const json& header) {
+    auto stream = shared_stream.lock();
+    if (stream && stream->snapshot.revision == buffer_revision && snapshot_cache) {
+        streams_reused++;
+    }
+    else {
+        stream = std::make_shared<SnapshotStream>(shared_buffer.snapshot(buffer_revision), snapshot_cache);
+        shared_stream = stream;
+        streams_built++;
+    }
+
+    Frame header_frame = make_frame(header);
+    {
+        std::lock_guard<std::mutex> lock(outbox.mutex);
+        if (outbox.closed || outbox.closing) return;
+        outbox.bulk.push_back(header_frame);
+        outbox.bulk_bytes += header_frame->size();
+        outbox.stream = stream;
+        outbox.stream_chunk = 0;
+    }
+    outbox.cv.notify_one();
+}
+
+// Function to report every client's transport, limits and throttling state
+json client_stats() {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    json clients = json::array();
+    for (const auto& [id, user] : users) {
+        json entry = user.limiter ? user.limiter->stats() : json::object();
+        entry["id"] = id;
+        entry["name"] = user.uname;
+        entry["transport"] = user.conn->describe();
+        {
+            std::lock_guard<std::mutex> outbox_lock(user.outbox->mutex);
+            entry["queued_bytes"] = user.outbox->queued_bytes;
+            entry["outbound_bytes"] = user.outbox->queued_bytes + user.outbox->bulk_bytes;
+            entry["resyncs"] = user.outbox->resyncs;
+        }
+        clients.push_back(entry);
+    }
+    return clients;
+}
+
+// Function to account for the memory held by the document (text, history,
+// indices) and by its clients' connections (inbound and outbound buffers).
+// Frames are shared by the history and every outbox holding them, so each
+// holder counts them in full.
+json memory_stats() {
+    json memory;
+    size_t history = 0;
+    {
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        memory = shared_buffer.memory();
+        history = op_history.size() * sizeof(HistoryEntry);
+        for (const HistoryEntry& entry : op_history) history += entry.frame->capacity() + string_heap_bytes(*entry.session);
+        for (const auto& [session, stacks] : undo_histories) {
+            for (const auto* stack : {&stacks.undo, &stacks.redo}) {
+                history += stack->size() * sizeof(UndoEntry);
+                for (const UndoEntry& entry : *stack) history += string_heap_bytes(entry.inverse.text);
+            }
+        }
+    }
+    memory["history_bytes"] = history;
+
+    size_t trees = 0;
+    {
+        std::lock_guard<std::mutex> lock(merkle_mutex);
+        for (const auto& tree : merkle_trees) {
+            trees += tree->starts.capacity() * sizeof(size_t) + tree->prefix.capacity() * sizeof(uint64_t) +
+                     tree->snapshot.blocks.capacity() * sizeof(tree->snapshot.blocks[0]);
+        }
+    }
+    memory["index_bytes"] = memory["index_bytes"].get<size_t>() + trees;
+
+    size_t inbound = 0, outbound = 0;
+    std::lock_guard<std::mutex> lock(users_mutex);
+    for (const auto& [id, user] : users) {
+        if (user.limiter) inbound += user.limiter->buffered_bytes;
+        std::lock_guard<std::mutex> outbox_lock(user.outbox->mutex);
+        outbound += user.outbox->queued_bytes + user.outbox->bulk_bytes;
+    }
+    memory["connections"] = {
+        {"count", users.size()},
+        {"inbound_bytes", inbound},
+        {"outbound_bytes", outbound}
+    };
+    memory["slab_bytes"] = SlabPool::reserved_bytes.load();
+    memory["quotas"] = {
+        {"packet_bytes", max_packet_bytes},
+        {"document_bytes", max_document_bytes},
+        {"outbound_bytes", max_outbound_bytes}
+    };
+    return memory;
+}
+
+// Function to tell a client that a request went over one of its quotas
+void send_quota_error(Outbox& outbox, const std::string& text) {
+    json error_msg = {
+        {"packet_type", "message"},
+        {"data", { {"message_type", "error_quota"}, {"message", text} }}
+    };
+    enqueue_frame(outbox, make_frame(error_msg));
+}
+
+// Function to check whether a client's bulk lane is past max_outbound_bytes,
+// so that it may ask for no more until it reads what is queued
+bool over_outbound_quota(Outbox& outbox) {
+    std::lock_guard<std::mutex> lock(outbox.mutex);
+    return outbox.bulk_bytes > max_outbound_bytes;
+}
+
+// Function to replace a slow client's dropped backlog with a snapshot.
+// Runs on the client's writer; the snapshot goes out on the bulk lane.
+void queue_resync(int client_id, Outbox& outbox) {
+    std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+    std::lock_guard<std::mutex> users_lock(users_mutex);
+
+    // Everything queued so far predates the snapshot; later frames follow it
+    {
+        std::lock_guard<std::mutex> lock(outbox.mutex);
+        outbox.frames.clear();
+        outbox.queued_bytes = 0;
+        outbox.resync_pending = false;
+    }
+    queue_snapshot(outbox, snapshot_message("resync", client_id));
+}
+
+// Function to cut the next slice of the bulk lane; caller holds outbox.mutex.
+// Bulk frames larger than BULK_CHUNK_BYTES are carried in "fragment" packets
+// so edit frames can be interleaved with them; the client concatenates the
+// payloads of one id and handles the result as a single packet.
+Frame next_bulk_chunk(Outbox& outbox) {
+    if (outbox.bulk.empty()) return nullptr;
+    const std::string& frame = *outbox.bulk.front();
+    if (outbox.bulk_offset == 0 && frame.size() <= BULK_CHUNK_BYTES) {
+        Frame whole = outbox.bulk.front();
+        outbox.bulk.pop_front();
+        outbox.bulk_bytes -= whole->size();
+        return whole;
+    }
+
+    // Payload excludes the trailing newline; never split a UTF-8 sequence
+    size_t payload_size = frame.size() - 1;
+    size_t end = std::min(payload_size, outbox.bulk_offset + BULK_CHUNK_BYTES);
+    while (end < payload_size && (static_cast<unsigned char>(frame[end]) & 0xC0) == 0x80) end--;
+    bool last = end == payload_size;
+
+    json fragment = {
+        {"packet_type", "fragment"},
+        {"data", {
+            {"id", outbox.next_fragment_id},
+            {"final", last},
+            {"payload", frame.substr(outbox.bulk_offset, end - outbox.bulk_offset)}
+        }}
+    };
+    outbox.bulk_offset = end;
+    if (last) {
+        outbox.bulk_bytes -= frame.size();
+        outbox.bulk.pop_front();
+        outbox.bulk_offset = 0;
+        outbox.next_fragment_id++;
+    }
+    return make_frame(fragment);
+}
+
+// Function to broadcast an encoded frame to all connected clients
+void broadcast_frame(const Frame& frame, int exclude_id = -1) {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    for (const auto& [id, user] : users) {
+        if (id == exclude_id) continue; // Skip sending to the sender
+        enqueue_frame(*user.outbox, frame);
+    }
+}
+
+// Function to wake the observer fan-out thread
+void wake_observers() {
+    uint64_t one = 1;
+    (void)!write(observer_wake_fd, &one, sizeof(one));
+}
+
+// Function to hand an operation to the observer fan-out thread. Editors pay
+// for one push here, however many observers there are. Caller holds
+// buffer_mutex, so the feed stays in revision order.
+void publish_to_observers(const Frame& frame, uint64_t revision) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(observer_feed_mutex);
+        was_empty = observer_feed.empty();
+        observer_feed.emplace_back(revision, frame);
+    }
+    if (was_empty) wake_observers();    // Later pushes join the batch it will take
+}
+
+// Function to broadcast a message to all connected clients
+void broadcast_message(const json& message, int exclude_id = -1) {
+    broadcast_frame(make_frame(message), exclude_id);
+}
+
+// Function to drop sessions whose connection has been gone longer than the TTL,
+// adding their tokens to `dropped`. Caller must hold users_mutex.
+void expire_sessions(std::vector<std::string>& dropped) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        if (it->second.client_id < 0 && now - it->second.detached_at > std::chrono::seconds(session_ttl_secs)) {
+            dropped.push_back(it->first);
+            it = sessions.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+// Function to queue everything a resuming client missed after `revision`:
+// its own operations come back as acks, everyone else's as broadcast.
+// Caller must hold buffer_mutex and users_mutex, and have checked that
+// op_history reaches back to revision + 1.
+void queue_missed_operations(Outbox& outbox, const std::string& session, uint64_t revision) {
+    auto it = std::lower_bound(op_history.begin(), op_history.end(), revision + 1,
+                               [](const HistoryEntry& entry, uint64_t rev) { return entry.revision < rev; });
+    for (; it != op_history.end(); ++it) {
+        if (*it->session == session && !it->generated) {
+            enqueue_frame(outbox, ack_frame(it->cseq, it->revision));
+        }
+        else {
+            enqueue_frame(outbox, it->frame);
+        }
+    }
+}
+
+// Function to stream an applied operation to every follower, in revision order.
+// Relays get `frame`, the operation as clients see it. Other followers get it
+// with the session that made it and that session's sequence number (0 for
+// undo and redo), so one that takes over can resume the session where its
+// client left off. The origin is spliced into the frame as the first field
+// of its data, so nothing is decoded or encoded again. Caller holds buffer_mutex.
+void replicate_operation(const Frame& frame, const std::string& session, uint64_t cseq) {
+    static const std::string_view data_key = "\"data\":{";
+    std::lock_guard<std::mutex> lock(users_mutex);
+    Frame origin_frame;
+    for (const auto& [id, follower] : followers) {
+        if (follower.relay) {
+            enqueue_frame(*follower.outbox, frame);
+            continue;
+        }
+        if (!origin_frame) {
+            auto it = sessions.find(session);
+            size_t data_at = frame->find(data_key);
+            if (it == sessions.end() || data_at == std::string::npos) {
+                origin_frame = frame;
+            }
+            else {
+                json origin = {
+                    {"session", session}, {"name", it->second.uname}, {"color", it->second.ucolor}, {"cseq", cseq}
+                };
+                size_t fields_at = data_at + data_key.size();
+                std::string* text = FramePool::take();
+                text->append(*frame, 0, fields_at);
+                text->append("\"origin\":");
+                text->append(origin.dump());
+                text->push_back(',');
+                text->append(*frame, fields_at, std::string::npos);
+                origin_frame = Frame(text, FrameRecycler(), SlabAllocator<char>());
+            }
+        }
+        enqueue_frame(*follower.outbox, origin_frame);
+    }
+}
+
+// Function to list the followers that can take over, in the order they would.
+// Caller holds users_mutex.
+json standby_list() {
+    json list = json::array();
+    for (const auto& [id, follower] : followers) {
+        if (!follower.address.empty()) list.push_back(follower.address);
+    }
+    return list;
+}
+
+// Function to find the highest revision that sync_replicas followers have all
+// applied. With fewer followers connected, acks are not held: replication
+// degrades to asynchronous rather than stalling every editor. The first
+// standby is always among them, since it is the one that takes over.
+// Caller holds users_mutex.
+uint64_t replicated_revision() {
+    if (sync_replicas == 0) return UINT64_MAX;
+    std::vector<uint64_t> acked;
+    uint64_t successor = UINT64_MAX;
+    for (const auto& [id, follower] : followers) {
+        if (follower.relay) continue;
+        acked.push_back(follower.acked_revision);
+        if (successor == UINT64_MAX && !follower.address.empty()) successor = follower.acked_revision;
+    }
+    if (acked.size() < sync_replicas) return UINT64_MAX;
+    std::nth_element(acked.begin(), acked.begin() + (sync_replicas - 1), acked.end(), std::greater<uint64_t>());
+    return std::min(acked[sync_replicas - 1], successor);
+}
+
+// Function to send the held acks whose operations are now replicated. Caller holds users_mutex.
+void release_acks() {
+    uint64_t replicated = replicated_revision();
+    while (!held_acks.empty() && held_acks.front().revision <= replicated) {
+        if (auto outbox = held_acks.front().outbox.lock()) enqueue_frame(*outbox, held_acks.front().frame);
+        held_acks.pop_front();
+    }
+}
+
+// Function to acknowledge an operation to its sender. With --sync-replicas the
+// ack waits until enough followers have applied the revision, so an acked edit
+// survives the loss of this server. Caller holds buffer_mutex.
+void queue_ack(const std::shared_ptr<Outbox>& outbox, const Frame& frame, uint64_t revision) {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    if (revision > replicated_revision()) held_acks.push_back({revision, outbox, frame});
+    else enqueue_frame(*outbox, frame);
+}
+
+// Function to encode a user's cursor as a presence entry, in a frame of its own
+Frame presence_entry(const User& user) {
+    std::string* text = FramePool::take();
+    text->append("{\"cursor\":{\"x\":");
+    append_integer(*text, user.cursor_x);
+    text->append(",\"y\":");
+    append_integer(*text, user.cursor_y);
+    text->append("},\"name\":");
+    append_json_string(*text, user.uname);
+    text->append("}\n");
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to join presence entries into one presence frame. Each entry was
+// encoded once by presence_loop for all recipients; its newline is left off.
+Frame presence_frame(const PresenceMap& presence) {
+    std::string* text = FramePool::take();
+    text->append("{\"data\":{\"cursors\":[");
+    for (auto it = presence.begin(); it != presence.end(); ++it) {
+        if (it != presence.begin()) text->push_back(',');
+        text->append(*it->second, 0, it->second->size() - 1);
+    }
+    text->append("]},\"packet_type\":\"presence\"}\n");
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to drain a user's outbox onto its connection
+void client_writer(int client_id, std::shared_ptr<Connection> conn, std::shared_ptr<Outbox> outbox) {
+    // Kept across wakeups and swapped with the outbox's, so neither side reallocates them
+    FrameQueue frames;
+    PresenceMap presence;
+    while (true) {
+        Frame bulk_chunk;
+        std::shared_ptr<SnapshotStream> stream;
+        size_t stream_chunk = 0;
+        bool finish = false;
+        bool resync = false;
+        {
+            std::unique_lock<std::mutex> lock(outbox->mutex);
+            outbox->cv.wait(lock, [&] {
+                return outbox->closed || outbox->closing || outbox->resync_pending ||
+                       !outbox->frames.empty() || !outbox->presence.empty() || !outbox->bulk.empty() ||
+                       outbox->stream;
+            });
+            if (outbox->closed) return;
+            resync = outbox->resync_pending && !outbox->closing;
+        }
+
+        if (resync) {
+            std::cout << "Client " << client_id << " fell behind; sending a snapshot instead of its backlog." << std::endl;
+            queue_resync(client_id, *outbox);
+        }
+
+        {
+            // Everything waiting on the edit lane, the latest presence, one bulk
+            // slice; once the bulk lane is empty, one slice of a streamed snapshot
+            std::lock_guard<std::mutex> lock(outbox->mutex);
+            frames.swap(outbox->frames);
+            outbox->queued_bytes = 0;
+            presence.swap(outbox->presence);
+            bulk_chunk = next_bulk_chunk(*outbox);
+            if (!bulk_chunk && outbox->stream) {
+                stream = outbox->stream;
+                stream_chunk = outbox->stream_chunk;
+            }
+            finish = outbox->closing && outbox->frames.empty() && outbox->bulk.empty();
+        }
+
+        // Snapshots are only replaced from this thread, so the chunk can be
+        // fetched without holding the outbox
+        std::string chunk_head;
+        std::shared_ptr<const std::string> chunk_lines;
+        if (stream && !finish) {
+            chunk_head = stream->head(stream_chunk);
+            chunk_lines = stream->lines(stream_chunk);
+            std::lock_guard<std::mutex> lock(outbox->mutex);
+            outbox->stream_chunk = stream_chunk + 1;
+            if (outbox->stream_chunk == stream->size()) outbox->stream.reset();
+        }
+
+        bool success = true;
+        for (const auto& frame : frames) {
+            if (!(success = conn->send_all(*frame))) break;
+        }
+        if (success && !presence.empty()) {
+            success = conn->send_all(*presence_frame(presence));
+        }
+        if (success && bulk_chunk) {
+            success = conn->send_all(*bulk_chunk);
+        }
+        if (success && chunk_lines) {
+            success = conn->send_all(chunk_head) && conn->send_all(*chunk_lines) &&
+                      conn->send_all(SnapshotStream::CHUNK_TAIL);
+        }
+
+        if (!success || finish) {
+            // Wake the reader so the connection is torn down
+            conn->shutdown();
+            return;
+        }
+        frames.clear();
+        presence.clear();
+    }
+}
+
+// Function to generate a random session token for the UDP side channel
+std::string generate_token() {
+    static std::mutex token_mutex;
+    static std::mt19937_64 rng(std::random_device{}());
+    std::lock_guard<std::mutex> lock(token_mutex);
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0') << std::setw(16) << rng() << std::setw(16) << rng();
+    return oss.str();
+}
+
+// Function to send a full presence datagram to every user bound to the UDP channel.
+// Each datagram carries all cursors, so a lost one is repaired by the next.
+void send_udp_presence() {
+    std::vector<std::pair<std::string, std::string>> entries; // name -> encoded entry
+    for (const auto& [id, user] : users) {
+        json entry = {
+            {"name", user.uname},
+            {"cursor", { {"x", user.cursor_x}, {"y", user.cursor_y} }}
+        };
+        entries.push_back({user.uname, entry.dump()});
+    }
+
+    for (auto& [id, user] : users) {
+        if (!user.udp_bound) continue;
+        std::string datagram = "{\"packet_type\":\"presence\",\"data\":{\"seq\":" +
+                               std::to_string(++user.udp_send_seq) + ",\"cursors\":[";
+        bool first = true;
+        for (const auto& [name, entry] : entries) {
+            if (name == user.uname) continue;
+            if (!first) datagram += ",";
+            datagram += entry;
+            first = false;
+        }
+        datagram += "]}}";
+        sendto(udp_fd, datagram.data(), datagram.size(), MSG_DONTWAIT,
+               (struct sockaddr*)&user.udp_addr, sizeof(user.udp_addr));
+    }
+}
+
+// Function to publish changed cursors once per tick as a single presence frame.
+// Each changed cursor is encoded once, and writers join the entries they hold.
+void presence_loop() {
+    auto last_refresh = std::chrono::steady_clock::now();
+    std::vector<std::pair<int, Frame>> changed;     // Kept across ticks with its capacity
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PRESENCE_TICK_MS));
+
+        std::lock_guard<std::mutex> lock(users_mutex);
+        changed.clear();
+        for (auto& [id, user] : users) {
+            if (!user.cursor_dirty) continue;
+            user.cursor_dirty = false;
+            changed.emplace_back(id, presence_entry(user));
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        bool refresh = now - last_refresh >= std::chrono::milliseconds(PRESENCE_REFRESH_MS);
+        if (udp_fd >= 0 && (!changed.empty() || refresh)) {
+            send_udp_presence();
+            last_refresh = now;
+        }
+        if (changed.empty()) continue;
+
+        for (const auto& [id, user] : users) {
+            if (user.udp_bound) continue; // Served by send_udp_presence
+            Outbox& outbox = *user.outbox;
+            bool queued = false;
+            {
+                std::lock_guard<std::mutex> outbox_lock(outbox.mutex);
+                for (const auto& [changed_id, entry] : changed) {
+                    if (changed_id == id) continue;     // Users track their own cursor
+                    outbox.presence[changed_id] = entry; // Supersedes any unsent position
+                    queued = true;
+                }
+            }
+            if (queued) outbox.cv.notify_one();
+        }
+    }
+}
+
+// Function to receive cursor datagrams on the UDP side channel.
+// Datagram format: {"token": "...", "seq": N, "cursor": {"x": X, "y": Y}}; the cursor is
+// optional so a client can bind its address before it moves.
+void udp_loop() {
+    char buffer[UDP_BUFFER_SIZE];
+    while (server_running) {
+        sockaddr_in from{};
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(udp_fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &from_len);
+        if (n <= 0) continue;
+
+        json datagram = json::parse(std::string(buffer, n), nullptr, false);
+        if (!datagram.is_object() || !datagram["token"].is_string() || !datagram["seq"].is_number_unsigned()) continue;
+        if (datagram.contains("cursor") &&
+            !(datagram["cursor"].is_object() && datagram["cursor"]["x"].is_number_integer() &&
+              datagram["cursor"]["y"].is_number_integer())) continue;
+
+        Frame ready_msg;
+        std::shared_ptr<Outbox> outbox;
+        {
+            std::lock_guard<std::mutex> lock(users_mutex);
+            auto session = udp_sessions.find(datagram["token"].get<std::string>());
+            if (session == udp_sessions.end()) continue;
+            User& user = users[session->second];
+
+            // Drop reordered or duplicated datagrams: only the newest cursor matters
+            uint64_t seq = datagram["seq"];
+            if (seq <= user.udp_recv_seq) continue;
+            user.udp_recv_seq = seq;
+            user.udp_addr = from;
+
+            if (!user.udp_bound) {
+                // Tell the client over TCP that datagrams are getting through
+                user.udp_bound = true;
+                json bound_msg = {
+                    {"packet_type", "message"},
+                    {"data", { {"message_type", "udp_ready"} }}
+                };
+                ready_msg = make_frame(bound_msg);
+                outbox = user.outbox;
+            }
+
+            if (datagram.contains("cursor")) {
+                user.cursor_x = datagram["cursor"]["x"];
+                user.cursor_y = datagram["cursor"]["y"];
+                user.cursor_dirty = true;
+            }
+        }
+        if (ready_msg) enqueue_frame(*outbox, ready_msg);
+    }
+}
+
+// An operation or cursor update as a client sends it. Each connection reuses
+// one, so its strings keep their capacity from one packet to the next.
+struct ClientPacket {
+    bool operation = false;     // An operation; otherwise a cursor update
+    std::string type;           // Operation type, as sent
+    std::string character;      // Inserted or deleted character
+    std::string text;           // Inserted text (insert_text only)
+    bool has_character = false, has_text = false, has_position = false, has_end = false, has_cursor = false;
+    int x = 0, y = 0;           // Position of the operation
+    int end_x = 0, end_y = 0;   // End of the deleted range (delete_range only)
+    int cursor_x = 0, cursor_y = 0; // Cursor of an update
+    uint64_t cseq = 0;          // Sender's sequence number, echoed in its ack only
+
+    void clear() {
+        operation = has_character = has_text = has_position = has_end = has_cursor = false;
+        type.clear();
+        character.clear();
+        text.clear();
+        x = y = end_x = end_y = cursor_x = cursor_y = 0;
+        cseq = 0;
+    }
+};
+
+// Reader of the two packets every keystroke sends, an operation and a cursor
+// update, holding the fields the client writes. It decodes straight into a
+// ClientPacket and allocates nothing. Anything else makes it give up: another
+// packet type, an unknown field, a number that is not an integer, a \u escape
+// or a byte outside ASCII. The JSON parser then reads the packet instead.
+class PacketScanner {
+public:
+    explicit PacketScanner(std::string_view line) : p(line.data()), end(line.data() + line.size()) {}
+
+    bool scan(ClientPacket& packet) {
+        packet.clear();
+        std::string_view packet_type;
+        if (!consume('{')) return false;
+        do {
+            std::string_view key;
+            if (!name(key) || !consume(':')) return false;
+            if (key == "packet_type") {
+                if (!name(packet_type)) return false;
+            }
+            else if (key != "data" || !fields(packet)) {
+                return false;
+            }
+        } while (consume(','));
+        if (!consume('}')) return false;
+        skip_space();
+        packet.operation = packet_type == "operation";
+        return p == end && (packet.operation || packet_type == "update");
+    }
+
+private:
+    bool fields(ClientPacket& packet) {
+        if (!consume('{')) return false;
+        if (consume('}')) return true;
+        do {
+            std::string_view key;
+            bool complete;
+            if (!name(key) || !consume(':')) return false;
+            if (key == "type") {
+                if (!string(packet.type)) return false;
+            }
+            else if (key == "character") {
+                if (!(packet.has_character = string(packet.character))) return false;
+            }
+            else if (key == "text") {
+                if (!(packet.has_text = string(packet.text))) return false;
+            }
+            else if (key == "cseq") {
+                if (!integer(packet.cseq)) return false;
+            }
+            else if (key == "position") {
+                if (!(packet.has_position = point(packet.x, packet.y, complete))) return false;
+            }
+            else if (key == "end") {
+                if (!(packet.has_end = point(packet.end_x, packet.end_y, complete))) return false;
+            }
+            else if (key == "cursor") {
+                // Both coordinates are required, as handle_client reads them with at()
+                if (!(packet.has_cursor = point(packet.cursor_x, packet.cursor_y, complete)) || !complete) return false;
+            }
+            else {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+
+    // {"x": X, "y": Y}; a missing coordinate is 0
+    bool point(int& x, int& y, bool& complete) {
+        bool has_x = false, has_y = false;
+        x = y = 0;
+        if (!consume('{')) return false;
+        if (!consume('}')) {
+            do {
+                std::string_view key;
+                if (!name(key) || !consume(':')) return false;
+                if (key == "x" && integer(x)) has_x = true;
+                else if (key == "y" && integer(y)) has_y = true;
+                else return false;
+            } while (consume(','));
+            if (!consume('}')) return false;
+        }
+        complete = has_x && has_y;
+        return true;
+    }
+
+    template <typename T>
+    bool integer(T& value) {
+        skip_space();
+        const char* digits = p < end && *p == '-' ? p + 1 : p;
+        auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc() || (next - digits > 1 && *digits == '0')) return false;
+        p = next;
+        return p == end || (*p != '.' && *p != 'e' && *p != 'E');
+    }
+
+    // A key or short value without escapes, left in the line
+    bool name(std::string_view& value) {
+        if (!consume('"')) return false;
+        const char* start = p;
+        while (p < end && *p != '"') {
+            if (*p == '\\' || static_cast<unsigned char>(*p) < 0x20 || static_cast<unsigned char>(*p) >= 0x80) return false;
+            ++p;
+        }
+        if (p == end) return false;
+        value = std::string_view(start, p++ - start);
+        return true;
+    }
+
+    bool string(std::string& value) {
+        if (!consume('"')) return false;
+        value.clear();
+        while (p < end) {
+            unsigned char c = *p++;
+            if (c == '"') return true;
+            if (c < 0x20 || c >= 0x80) return false;
+            if (c == '\\') {
+                if (p == end) return false;
+                switch (*p++) {
+                    case '"': c = '"'; break;
+                    case '\\': c = '\\'; break;
+                    case '/': c = '/'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    default: return false;
+                }
+            }
+            value.push_back(static_cast<char>(c));
+        }
+        return false;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (p == end || *p != c) return false;
+        ++p;
+        return true;
+    }
+
+    void skip_space() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+    }
+
+    const char* p;
+    const char* end;
+};
+
+// Function to read an operation or cursor update from the data of a packet
+// that PacketScanner left to the JSON parser
+void read_client_packet(const json& data, bool operation, ClientPacket& packet) {
+    packet.clear();
+    packet.operation = operation;
+    if (!operation) {
+        if ((packet.has_cursor = data.contains("cursor"))) {
+            packet.cursor_x = data.at("cursor").at("x");
+            packet.cursor_y = data.at("cursor").at("y");
+        }
+        return;
+    }
+    packet.type = data.value("type", std::string());
+    if ((packet.has_character = data.contains("character"))) packet.character = data.at("character").get<std::string>();
+    if ((packet.has_text = data.contains("text"))) packet.text = data.at("text").get<std::string>();
+    if ((packet.has_position = data.contains("position"))) {
+        packet.x = data.at("position").value("x", 0);
+        packet.y = data.at("position").value("y", 0);
+    }
+    if ((packet.has_end = data.contains("end"))) {
+        packet.end_x = data.at("end").value("x", 0);
+        packet.end_y = data.at("end").value("y", 0);
+    }
+    packet.cseq = data.value("cseq", uint64_t(0));
+}
+
+// Function to turn an operation into a LogRecord (revision not set). Pastes
+// and range deletions carry text or an end position instead of one
+// character; an insert without a character comes back as Unknown.
+LogRecord operation_record(const ClientPacket& packet) {
+    LogRecord record{0, getOperationType(packet.type), packet.x, packet.y, packet.character.empty() ? '\0' : packet.character[0]};
+    if (record.op == OperationType::Insert && packet.character.empty()) record.op = OperationType::Unknown;
+    record.text = packet.text;
+    record.end_x = packet.end_x;
+    record.end_y = packet.end_y;
+    return record;
+}
+
+// Function to read an operation packet's data into a LogRecord (revision not set)
+LogRecord parse_operation(const json& data) {
+    ClientPacket packet;
+    read_client_packet(data, true, packet);
+    return operation_record(packet);
+}
+
+// Function to encode an operation a client sent, stamped with its revision,
+// as it is broadcast. It carries the fields ClientPacket holds, but not the
+// sequence number, with keys in the order the JSON library writes them.
+Frame operation_frame(const ClientPacket& packet, uint64_t revision) {
+    std::string* text = FramePool::take();
+    text->append("{\"data\":{");
+    if (packet.has_character) {
+        text->append("\"character\":");
+        append_json_string(*text, packet.character);
+        text->push_back(',');
+    }
+    if (packet.has_end) {
+        text->append("\"end\":{\"x\":");
+        append_integer(*text, packet.end_x);
+        text->append(",\"y\":");
+        append_integer(*text, packet.end_y);
+        text->append("},");
+    }
+    if (packet.has_position) {
+        text->append("\"position\":{\"x\":");
+        append_integer(*text, packet.x);
+        text->append(",\"y\":");
+        append_integer(*text, packet.y);
+        text->append("},");
+    }
+    text->append("\"revision\":");
+    append_integer(*text, revision);
+    if (packet.has_text) {
+        text->append(",\"text\":");
+        append_json_string(*text, packet.text);
+    }
+    text->append(",\"type\":");
+    append_json_string(*text, packet.type);
+    text->append("},\"packet_type\":\"operation\"}\n");
+    return Frame(text, FrameRecycler(), SlabAllocator<char>());
+}
+
+// Function to apply an operation to the shared buffer (caller holds buffer_mutex)
+bool apply_operation(OperationType op, int x, int y, char character) {
+    int lines = static_cast<int>(shared_buffer.size());
+    switch (op) {
+        case OperationType::Insert:
+            if (y >= 0 && y < lines && x >= 0 && x <= static_cast<int>(shared_buffer.line(y).size())) {
+                shared_buffer.edit_line(y).insert(x, 1, character);
+                shared_buffer.resized(1);
+                return true;
+            }
+            return false;
+        case OperationType::Delete:
+            if (y >= 0 && y < lines && x >= 0 && x < static_cast<int>(shared_buffer.line(y).size())) {
+                shared_buffer.edit_line(y).erase(x, 1);
+                shared_buffer.resized(-1);
+                return true;
+            }
+            return false;
+        case OperationType::InsertNewline:
+            if (y >= 0 && y < lines && x >= 0 && x <= static_cast<int>(shared_buffer.line(y).size())) {
+                std::string& line = shared_buffer.edit_line(y);
+                std::string new_line = line.substr(x);
+                line.resize(x);
+                shared_buffer.insert_line(y + 1, std::move(new_line));
+                shared_buffer.resized(1);
+                return true;
+            }
+            return false;
+        case OperationType::DeleteNewline:
+            if (y > 0 && y < lines) {
+                std::string joined = std::move(shared_buffer.edit_line(y));
+                shared_buffer.erase_line(y);
+                shared_buffer.edit_line(y - 1) += joined;
+                shared_buffer.resized(-1);
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+// Function to express an operation as a TextEdit against a document (the
+// shared buffer, or a past revision being rebuilt). It must fit the document
+// the same way apply_operation requires. Caller holds buffer_mutex for shared_buffer.
+bool to_text_edit(const Document& doc, const LogRecord& record, TextEdit& edit) {
+    int lines = static_cast<int>(doc.size());
+    auto fits = [&doc, lines](int y, int x) {
+        return y >= 0 && y < lines && x >= 0 && x <= static_cast<int>(doc.line(y).size());
+    };
+    edit = TextEdit();
+    edit.y = edit.end_y = record.y;
+    edit.x = edit.end_x = record.x;
+    switch (record.op) {
+        case OperationType::Insert:
+            edit.text.assign(1, record.character);
+            return fits(record.y, record.x);
+        case OperationType::Delete:
+            edit.end_x = record.x + 1;
+            return fits(record.y, record.x) && record.x < static_cast<int>(doc.line(record.y).size());
+        case OperationType::InsertNewline:
+            edit.text = "\n";
+            return fits(record.y, record.x);
+        case OperationType::DeleteNewline:
+            if (record.y <= 0 || record.y >= lines) return false;
+            edit.y = record.y - 1;
+            edit.x = static_cast<int>(doc.line(record.y - 1).size());
+            edit.end_x = 0;
+            return true;
+        case OperationType::InsertText:
+            edit.text = record.text;
+            return fits(record.y, record.x);
+        case OperationType::DeleteRange:
+            edit.end_y = record.end_y;
+            edit.end_x = record.end_x;
+            return fits(record.y, record.x) && fits(record.end_y, record.end_x) &&
+                   std::make_pair(record.y, record.x) <= std::make_pair(record.end_y, record.end_x);
+        default:
+            return false;
+    }
+}
+
+// Function to apply a TextEdit that fits the document, returning the text it deleted.
+// Caller holds buffer_mutex for shared_buffer.
+std::string apply_text_edit(Document& doc, const TextEdit& edit) {
+    std::string deleted;
+    if (edit.y == edit.end_y) {
+        if (edit.end_x > edit.x) {
+            std::string& line = doc.edit_line(edit.y);
+            deleted = line.substr(edit.x, edit.end_x - edit.x);
+            line.erase(edit.x, edit.end_x - edit.x);
+        }
+    }
+    else {
+        deleted = std::string(doc.line(edit.y).substr(edit.x));
+        for (int y = edit.y + 1; y <= edit.end_y; ++y) {
+            std::string_view line = doc.line(y);
+            deleted += '\n';
+            deleted.append(y == edit.end_y ? line.substr(0, edit.end_x) : line);
+        }
+        std::string tail(doc.line(edit.end_y).substr(edit.end_x));
+        for (int y = edit.end_y; y > edit.y; --y) doc.erase_line(y);
+        std::string& first = doc.edit_line(edit.y);
+        first.resize(edit.x);
+        first += tail;
+    }
+    doc.resized(static_cast<std::ptrdiff_t>(edit.text.size()) - static_cast<std::ptrdiff_t>(deleted.size()));
+
+    size_t newline = edit.text.find('\n');
+    if (newline == std::string::npos) {
+        if (!edit.text.empty()) doc.edit_line(edit.y).insert(edit.x, edit.text);
+        return deleted;
+    }
+    // Split the line at the insertion point and put the text's lines in between
+    std::string& line = doc.edit_line(edit.y);
+    std::string tail = line.substr(edit.x);
+    line.resize(edit.x);
+    line.append(edit.text, 0, newline);
+    int y = edit.y;
+    for (size_t start = newline + 1;;) {
+        size_t next = edit.text.find('\n', start);
+        if (next == std::string::npos) {
+            doc.insert_line(++y, edit.text.substr(start) + tail);
+            break;
+        }
+        doc.insert_line(++y, edit.text.substr(start, next - start));
+        start = next + 1;
+    }
+    return deleted;
+}
+
+// Function to apply a logged operation of any type, as recovery and history reads replay it
+bool apply_record(Document& doc, const LogRecord& record) {
+    TextEdit edit;
+    if (!to_text_edit(doc, record, edit)) return false;
+    apply_text_edit(doc, edit);
+    return true;
+}
+
+// Function to describe where an edit landed
+EditShape shape_of(const TextEdit& edit) {
+    EditShape shape;
+    shape.y = edit.y;
+    shape.x = edit.x;
+    shape.end_y = edit.end_y;
+    shape.end_x = edit.end_x;
+    shape.new_lines = static_cast<int>(std::count(edit.text.begin(), edit.text.end(), '\n'));
+    size_t last_break = edit.text.rfind('\n');
+    shape.last_length = static_cast<int>(last_break == std::string::npos ? edit.text.size() : edit.text.size() - last_break - 1);
+    return shape;
+}
+
+// Function to find the position just after an edit's inserted text
+std::pair<int, int> insertion_end(const EditShape& shape) {
+    return shape.new_lines == 0 ? std::make_pair(shape.y, shape.x + shape.last_length)
+                                : std::make_pair(shape.y + shape.new_lines, shape.last_length);
+}
+
+// Function to move a position across an edit made after it was recorded.
+// A position inside the deleted range moves to its start; one at the
+// insertion point stays before the inserted text unless after_insert is set.
+void transform_position(int& y, int& x, const EditShape& edit, bool after_insert) {
+    auto position = std::make_pair(y, x);
+    auto start = std::make_pair(edit.y, edit.x);
+    auto end = std::make_pair(edit.end_y, edit.end_x);
+    if (position < start || (position == start && !after_insert)) return;
+    if (position < end) {
+        if (!after_insert) {
+            y = edit.y;
+            x = edit.x;
+            return;
+        }
+        y = edit.end_y;
+        x = edit.end_x;
+    }
+    // At or past the end of the deleted range: shift by what was removed and inserted
+    if (y == edit.end_y) {
+        auto [insert_y, insert_x] = insertion_end(edit);
+        x = insert_x + (x - edit.end_x);
+        y = insert_y;
+    }
+    else {
+        y += edit.y - edit.end_y + edit.new_lines;
+    }
+}
+
+// Function to keep an applied operation in op_history, dropping the oldest beyond history_ops.
+// Caller holds buffer_mutex.
+void remember_operation(HistoryEntry entry) {
+    entry.applied = std::chrono::steady_clock::now();
+    op_history.push_back(std::move(entry));
+    while (op_history.size() > history_ops) op_history.pop_front();
+}
+
+// Function to move an undo step across every operation applied after it, up
+// to revision `upto`. Fails if the history no longer reaches back that far, or
+// if another session's text landed inside the range the step would delete:
+// undoing it then would delete their work. The session's own later text
+// inside the range widens it instead. Caller holds buffer_mutex.
+bool rebase_undo_entry(UndoEntry& entry, uint64_t upto, const std::string& session) {
+    if (entry.revision >= upto) return true;
+    if (op_history.empty() || op_history.front().revision > entry.revision + 1) return false;
+    auto it = std::lower_bound(op_history.begin(), op_history.end(), entry.revision + 1,
+                               [](const HistoryEntry& history, uint64_t rev) { return history.revision < rev; });
+    TextEdit& inverse = entry.inverse;
+    for (; it != op_history.end() && it->revision <= upto; ++it) {
+        const EditShape& edit = it->shape;
+        auto start = std::make_pair(inverse.y, inverse.x);
+        auto end = std::make_pair(inverse.end_y, inverse.end_x);
+        auto at = std::make_pair(edit.y, edit.x);
+        bool inserts = edit.new_lines > 0 || edit.last_length > 0;
+        if (start < end && inserts && start < at && at < end && *it->session != session) return false;
+        // Text typed right at a range's edges stays outside it. A point keeps
+        // ahead of another session's text at it, but follows the session's own,
+        // which is what redo replays in order.
+        bool own = *it->session == session;
+        transform_position(inverse.y, inverse.x, edit, start < end || own);
+        if (start < end) transform_position(inverse.end_y, inverse.end_x, edit, false);
+        else {
+            inverse.end_y = inverse.y;
+            inverse.end_x = inverse.x;
+        }
+        entry.revision = it->revision;
+    }
+    return true;
+}
+
+// Function to record the inverse of a client's operation on its session's undo
+// stack, so undo never needs per-keystroke entries: a keystroke continuing the
+// previous run of typing (or of backspacing) extends that step instead.
+// Caller holds buffer_mutex.
+void record_undo(const std::string& session, OperationType op, const TextEdit& edit,
+                 const std::string& deleted, uint64_t revision) {
+    UndoHistory& history = undo_histories[session];
+    history.redo.clear();
+    auto now = std::chrono::steady_clock::now();
+    bool keystroke = op == OperationType::Insert || op == OperationType::Delete ||
+                     op == OperationType::InsertNewline || op == OperationType::DeleteNewline;
+
+    UndoEntry entry{TextEdit(), revision, keystroke, now};
+    entry.inverse.y = edit.y;
+    entry.inverse.x = edit.x;
+    std::tie(entry.inverse.end_y, entry.inverse.end_x) = insertion_end(shape_of(edit));
+    entry.inverse.text = deleted;
+
+    if (keystroke && !history.undo.empty()) {
+        UndoEntry& top = history.undo.back();
+        if (top.typing && now - top.updated < std::chrono::milliseconds(UNDO_COALESCE_MS) &&
+            rebase_undo_entry(top, revision - 1, session)) {
+            TextEdit& run = top.inverse;
+            bool typed = deleted.empty() && run.text.empty();
+            bool erased = !deleted.empty() && run.text.size() > 0 && run.y == run.end_y && run.x == run.end_x;
+            if (typed && run.end_y == edit.y && run.end_x == edit.x) {
+                // Typed right after the run
+                run.end_y = entry.inverse.end_y;
+                run.end_x = entry.inverse.end_x;
+            }
+            else if (erased && edit.end_y == run.y && edit.end_x == run.x) {
+                // Backspace just before the run
+                run.y = run.end_y = edit.y;
+                run.x = run.end_x = edit.x;
+                run.text = deleted + run.text;
+            }
+            else if (erased && edit.y == run.y && edit.x == run.x) {
+                // Forward delete at the run
+                run.text += deleted;
+            }
+            else {
+                typed = erased = false;
+            }
+            if (typed || erased) {
+                top.revision = revision;
+                top.updated = now;
+                return;
+            }
+        }
+    }
+    history.undo.push_back(std::move(entry));
+    if (history.undo.size() > UNDO_DEPTH) history.undo.pop_front();
+}
+
+// Function to undo (or redo) a session's latest step. The step is rebased
+// across everything applied since and goes out as one insert_text or
+// delete_range operation to every client, the requester included. Steps that
+// can no longer be applied safely are dropped. Caller holds buffer_mutex.
+bool apply_undo(const std::string& session, bool redo) {
+    UndoHistory& history = undo_histories[session];
+    auto& from = redo ? history.redo : history.undo;
+    auto& to = redo ? history.undo : history.redo;
+    while (!from.empty()) {
+        UndoEntry entry = std::move(from.back());
+        from.pop_back();
+        bool deletes = entry.inverse.text.empty();
+        if (!rebase_undo_entry(entry, buffer_revision, session)) continue;
+        const TextEdit& inverse = entry.inverse;
+        LogRecord record{0, deletes ? OperationType::DeleteRange : OperationType::InsertText,
+                         inverse.x, inverse.y, '\0'};
+        record.text = inverse.text;
+        record.end_x = inverse.end_x;
+        record.end_y = inverse.end_y;
+        TextEdit checked;
+        if (!to_text_edit(shared_buffer, record, checked)) continue;
+        if (deletes && checked.y == checked.end_y && checked.x == checked.end_x) continue;
+        if (!deletes && max_document_bytes > 0 && shared_buffer.bytes() + checked.text.size() > max_document_bytes) {
+            // Bringing the text back would put the document over its quota; keep the step
+            from.push_back(std::move(entry));
+            return false;
+        }
+
+        std::string deleted = apply_text_edit(shared_buffer, checked);
+        record.revision = ++buffer_revision;
+        oplog.append(record);
+
+        json data = {
+            {"type", deletes ? "delete_range" : "insert_text"},
+            {"position", { {"x", record.x}, {"y", record.y} }},
+            {"revision", record.revision}
+        };
+        if (deletes) data["end"] = { {"x", record.end_x}, {"y", record.end_y} };
+        else data["text"] = record.text;
+        json message = { {"packet_type", "operation"}, {"data", data} };
+        Frame frame = make_frame(message);
+        broadcast_frame(frame);
+        publish_to_observers(frame, record.revision);
+        replicate_operation(frame, session, 0);
+        remember_operation({record.revision, frame, std::make_shared<const std::string>(session), 0, shape_of(checked), true});
+
+        // The other stack gets the step that reverses this one
+        UndoEntry back{TextEdit(), record.revision, false, std::chrono::steady_clock::now()};
+        back.inverse.y = checked.y;
+        back.inverse.x = checked.x;
+        std::tie(back.inverse.end_y, back.inverse.end_x) = insertion_end(shape_of(checked));
+        back.inverse.text = deleted;
+        to.push_back(std::move(back));
+        if (to.size() > UNDO_DEPTH) to.pop_front();
+        return true;
+    }
+    return false;
+}
+
+// Function to group-commit the operation log until shutdown
+void oplog_flusher() {
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(flush_ms));
+        oplog.flush(fsync_policy, fsync_ms);
+    }
+}
+
+// Checkpoint file: u32 magic "NPCK" | u32 CRC-32 of the rest | u64 revision |
+// u64 line count | per line: varint length, bytes
+//
+// While part of the document is still mapped from its --open file, the
+// magic is "NPCM" and those parts are not copied: after the line count come
+// varint path length, path, u64 size and u64 modification time (ns) of the
+// file, then per entry either varint (length << 1), bytes for a line, or
+// varint (line count << 1 | 1), varint offset, varint length for a run of
+// the file's lines.
+const uint32_t CHECKPOINT_MAGIC = 0x4B43504E;
+const uint32_t MAPPED_CHECKPOINT_MAGIC = 0x4D43504E;
+const size_t CHECKPOINT_HEADER = 24;
+
+// Function to write a checkpoint atomically: a temporary file, synced, then renamed into place
+bool write_checkpoint(const DocumentSnapshot& snapshot, uint64_t& bytes_written) {
+    std::string tmp_path = data_dir + "/checkpoint.tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Checkpoint open failed");
+        return false;
+    }
+
+    std::shared_ptr<const MappedFile> file;
+    for (const auto& block : snapshot.blocks) {
+        if (block->mapped()) {
+            file = block->file;
+            break;
+        }
+    }
+
+    std::string chunk;
+    put_u32(chunk, file ? MAPPED_CHECKPOINT_MAGIC : CHECKPOINT_MAGIC);
+    put_u32(chunk, 0);                  // CRC, patched in below
+    put_u64(chunk, snapshot.revision);
+    put_u64(chunk, snapshot.line_count);
+    if (file) {
+        put_varint(chunk, file->path.size());
+        chunk += file->path;
+        put_u64(chunk, file->size);
+        put_u64(chunk, file->mtime_ns);
+    }
+    uint32_t crc = crc32(chunk.data() + 8, chunk.size() - 8);
+    bool ok = write_fully(fd, chunk.data(), chunk.size());
+    bytes_written = chunk.size();
+    chunk.clear();
+
+    auto spill = [&] {
+        if (ok && chunk.size() >= (1 << 20)) {
+            crc = crc32(chunk.data(), chunk.size(), crc);
+            ok = write_fully(fd, chunk.data(), chunk.size());
+            bytes_written += chunk.size();
+            chunk.clear();
+        }
+    };
+    for (const auto& block : snapshot.blocks) {
+        if (file && block->file == file) {
+            put_varint(chunk, block->size() << 1 | 1);
+            put_varint(chunk, block->begin - file->data);
+            put_varint(chunk, block->end - block->begin);
+            spill();
+            continue;
+        }
+        block->for_each_line([&](std::string_view line) {
+            put_varint(chunk, file ? line.size() << 1 : line.size());
+            chunk += line;
+            spill();
+        });
+    }
+    crc = crc32(chunk.data(), chunk.size(), crc);
+    ok = ok && write_fully(fd, chunk.data(), chunk.size());
+    bytes_written += chunk.size();
+
+    std::string crc_bytes;
+    put_u32(crc_bytes, crc);
+    ok = ok && pwrite(fd, crc_bytes.data(), 4, 4) == 4 && fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmp_path.c_str(), (data_dir + "/" + data_file_name("checkpoint-", snapshot.revision)).c_str()) < 0) {
+        perror("Checkpoint write failed");
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fsync_directory(data_dir);
+    return true;
+}
+
+// Function to load a checkpoint file into a document; returns false if it is
+// torn or corrupt, or refers to a file that has changed since. Runs of a
+// mapped file come back mapped, with their line counts, so loading them
+// reads nothing from the file.
+bool load_checkpoint(const std::string& path, Document& doc, uint64_t& revision) {
+    std::string contents;
+    if (!read_file(path, contents) || contents.size() < CHECKPOINT_HEADER) return false;
+    uint32_t magic = get_u32(contents.data());
+    if ((magic != CHECKPOINT_MAGIC && magic != MAPPED_CHECKPOINT_MAGIC) ||
+        crc32(contents.data() + 8, contents.size() - 8) != get_u32(contents.data() + 4)) {
+        return false;
+    }
+    revision = get_u64(contents.data() + 8);
+    uint64_t count = get_u64(contents.data() + 16);
+    if (count == 0 || (magic == CHECKPOINT_MAGIC && count > contents.size())) return false;
+
+    const char* cursor = contents.data() + CHECKPOINT_HEADER;
+    const char* end = contents.data() + contents.size();
+    std::shared_ptr<const MappedFile> file;
+    if (magic == MAPPED_CHECKPOINT_MAGIC) {
+        uint64_t length;
+        if (!get_varint(cursor, end, length) || length + 16 > static_cast<uint64_t>(end - cursor)) return false;
+        std::string file_path(cursor, length);
+        uint64_t size = get_u64(cursor + length);
+        uint64_t mtime_ns = get_u64(cursor + length + 8);
+        cursor += length + 16;
+        file = map_file(file_path);
+        if (!file || file->size != size || file->mtime_ns != mtime_ns) {
+            std::cerr << "Checkpoint " << path << " refers to " << file_path << ", which has changed since." << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<std::shared_ptr<DocumentBlock>> blocks;
+    std::vector<std::string> lines;         // Lines of the owned block being filled
+    auto close_block = [&blocks, &lines] {
+        if (lines.empty()) return;
+        blocks.push_back(std::make_shared<DocumentBlock>(std::move(lines)));
+        lines.clear();
+    };
+    uint64_t loaded = 0;
+    while (cursor < end) {
+        uint64_t value;
+        if (!get_varint(cursor, end, value)) return false;
+        if (file && (value & 1)) {
+            uint64_t offset, length;
+            if (!get_varint(cursor, end, offset) || !get_varint(cursor, end, length) || value >> 1 == 0 ||
+                length == 0 || offset > file->size || length > file->size - offset) {
+                return false;
+            }
+            close_block();
+            auto block = std::make_shared<DocumentBlock>();
+            block->file = file;
+            block->begin = file->data + offset;
+            block->end = block->begin + length;
+            block->mapped_lines = value >> 1;
+            blocks.push_back(block);
+            loaded += value >> 1;
+            continue;
+        }
+        uint64_t length = file ? value >> 1 : value;
+        if (length > static_cast<uint64_t>(end - cursor)) return false;
+        lines.emplace_back(cursor, length);
+        cursor += length;
+        loaded++;
+        if (lines.size() == BLOCK_LINES) close_block();
+    }
+    close_block();
+    if (loaded != count) return false;
+    doc.assign(std::move(blocks));
+    return true;
+}
+
+// Function to rebuild the document from the newest intact checkpoint, then
+// the log tail. Without a checkpoint, revision 0 is the --open file (mapped,
+// not read) or an empty document. Runs before any client connects.
+bool recover_document() {
+    auto start = std::chrono::steady_clock::now();
+    shared_buffer.assign({""});
+    buffer_revision = 0;
+    bool restored = false;
+    auto checkpoints = list_data_files(data_dir, "checkpoint-");
+    for (auto it = checkpoints.rbegin(); it != checkpoints.rend() && !restored; ++it) {
+        uint64_t revision;
+        restored = load_checkpoint(data_dir + "/" + it->second, shared_buffer, revision) && revision == it->first;
+        if (restored) {
+            buffer_revision = revision;
+        }
+        else {
+            shared_buffer.assign({""});
+            std::cerr << "Skipping corrupt checkpoint " << it->second << "." << std::endl;
+        }
+    }
+    if (!restored && !open_path.empty()) {
+        auto file = map_file(open_path);
+        if (!file) return false;
+        shared_buffer.assign(file);
+        std::cout << "Mapped " << open_path << " (" << file->size << " bytes)." << std::endl;
+    }
+    checkpoint_revision = buffer_revision;
+    auto loaded = std::chrono::steady_clock::now();
+
+    uint64_t replayed = 0;
+    bool ok = oplog.open(data_dir, buffer_revision, [&replayed](const LogRecord& record) {
+        apply_record(shared_buffer, record);
+        buffer_revision = record.revision;
+        replayed++;
+    });
+    auto done = std::chrono::steady_clock::now();
+
+    auto ms = [](auto from, auto to) { return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count(); };
+    std::cout << "Loaded document at revision " << checkpoint_revision << " (" << shared_buffer.bytes()
+              << " bytes) in " << ms(start, loaded) << " ms; replayed " << replayed << " operations in "
+              << ms(loaded, done) << " ms." << std::endl;
+    return ok;
+}
+
+// Function to checkpoint the document and drop the log behind the retained checkpoints
+bool checkpoint_document() {
+    std::lock_guard<std::mutex> guard(checkpoint_mutex);
+    DocumentSnapshot snapshot;
+    uint64_t cloned_before;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        if (buffer_revision == checkpoint_revision) return true;
+        // Editing continues as soon as the block pointers are copied; later
+        // operations go to a fresh log segment, so the checkpoint covers the rest
+        snapshot = shared_buffer.snapshot(buffer_revision);
+        oplog.rotate(buffer_revision + 1);
+        cloned_before = shared_buffer.cloned_bytes();
+    }
+    auto snapped = std::chrono::steady_clock::now();
+    oplog.flush(fsync_policy, fsync_ms);
+
+    uint64_t bytes = 0;
+    if (!write_checkpoint(snapshot, bytes)) return false;
+    uint64_t revision = snapshot.revision;
+    snapshot = DocumentSnapshot();      // Release the blocks before measuring what was cloned
+    snapshot_us = std::chrono::duration_cast<std::chrono::microseconds>(snapped - start).count();
+    snapshot_extra_bytes = shared_buffer.cloned_bytes() - cloned_before;
+    checkpoint_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - snapped).count();
+    checkpoint_bytes = bytes;
+    checkpoint_revision = revision;
+
+    // Keep the newest checkpoints, and the log back to the oldest of them so a
+    // corrupt newest checkpoint can still be recovered from its predecessor
+    auto checkpoints = list_data_files(data_dir, "checkpoint-");
+    if (checkpoints.size() >= keyframes_kept) {
+        size_t oldest_kept = checkpoints.size() - keyframes_kept;
+        for (size_t i = 0; i < oldest_kept; ++i) {
+            unlink((data_dir + "/" + checkpoints[i].second).c_str());
+        }
+        oplog.remove_segments_through(checkpoints[oldest_kept].first);
+    }
+    return true;
+}
+
+// Function to checkpoint periodically, by operation count or by age
+void checkpoint_loop() {
+    auto last = std::chrono::steady_clock::now();
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t revision;
+        {
+            std::lock_guard<FairMutex> lock(buffer_mutex);
+            revision = buffer_revision;
+        }
+        uint64_t behind = revision - checkpoint_revision;
+        bool due = (checkpoint_ops > 0 && behind >= checkpoint_ops) ||
+                   (checkpoint_secs > 0 && behind > 0 && std::chrono::steady_clock::now() - last >= std::chrono::seconds(checkpoint_secs));
+        if (due) {
+            if (checkpoint_document()) {
+                std::cout << "Checkpoint at revision " << checkpoint_revision << " written in " << checkpoint_ms
+                          << " ms; snapshot took " << snapshot_us << " us and " << snapshot_extra_bytes
+                          << " bytes of copied blocks." << std::endl;
+            }
+            last = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+// Function to read lines [start, start + count) of the document as it was at
+// `revision`. The newest checkpoint at or before it is the keyframe, and the
+// log replays from there. A read therefore costs at most one checkpoint load
+// and one checkpoint interval of operations. The rebuilt revision is kept, so
+// paging through it replays nothing, and a later read replays only the gap.
+bool read_past_lines(uint64_t revision, size_t start, size_t count, json& lines, size_t& line_count, std::string& error) {
+    std::lock_guard<std::mutex> history_lock(history_mutex);
+    auto begin = std::chrono::steady_clock::now();
+    auto page = [&lines, &line_count, start, count](const Document& doc) {
+        line_count = doc.size();
+        for (size_t y = start; y < line_count && y - start < count; ++y) lines.push_back(std::string(doc.line(y)));
+    };
+    {
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        if (revision > buffer_revision) {
+            error = "Revision " + std::to_string(revision) + " has not happened yet.";
+            return false;
+        }
+        if (revision == buffer_revision) {
+            page(shared_buffer);
+            history_reads++;
+            return true;
+        }
+    }
+    if (relay) {
+        error = "A relay keeps no history.";
+        return false;
+    }
+
+    // Everything up to the revision must be on disk before the log is read back,
+    // and the checkpoint lock keeps keyframes and segments from being deleted
+    oplog.flush(FsyncPolicy::Never, 0);
+    std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+    uint64_t base = 0;
+    std::string keyframe;
+    for (const auto& [checkpoint, name] : list_data_files(data_dir, "checkpoint-")) {
+        if (checkpoint > revision) break;
+        base = checkpoint;
+        keyframe = name;
+    }
+    if (!past_document || past_document->revision > revision || past_document->revision < base) {
+        // No checkpoint at or before the revision means starting from revision 0,
+        // which only the log back to its very first segment can build on
+        auto segments = list_data_files(data_dir, "wal-");
+        if (keyframe.empty() && (segments.empty() || segments.front().first != 1)) {
+            error = "History no longer reaches back to revision " + std::to_string(revision) + ".";
+            return false;
+        }
+        auto past = std::make_unique<PastDocument>();
+        past->revision = base;
+        if (!keyframe.empty()) {
+            uint64_t loaded_revision;
+            if (!load_checkpoint(data_dir + "/" + keyframe, past->doc, loaded_revision) || loaded_revision != base) {
+                error = "Keyframe " + keyframe + " is corrupt.";
+                return false;
+            }
+        }
+        else if (!open_path.empty()) {
+            auto file = map_file(open_path);
+            if (!file) {
+                error = "The initial document can no longer be read.";
+                return false;
+            }
+            past->doc.assign(file);
+        }
+        past_document = std::move(past);
+    }
+
+    uint64_t replayed = 0;
+    bool ok = past_document->revision == revision ||
+              oplog.read_range(past_document->revision, revision, [&replayed](const LogRecord& record) {
+                  apply_record(past_document->doc, record);
+                  replayed++;
+              });
+    history_replayed += replayed;
+    if (!ok) {
+        past_document.reset();
+        error = "History no longer reaches back to revision " + std::to_string(revision) + ".";
+        return false;
+    }
+    past_document->revision = revision;
+    page(past_document->doc);
+    history_reads++;
+    history_read_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+    return true;
+}
+
+// Function to load the leadership epoch, and the revision its term began at,
+// from the data directory. A server that never saw one is in the first epoch.
+// The standbys that have followed it are loaded too, so that once restarted
+// it still knows which of them may fence it.
+void load_epoch() {
+    std::string contents;
+    if (read_file(data_dir + "/epoch", contents)) {
+        std::istringstream in(contents);
+        uint64_t stored = 0, revision = 0;
+        if (in >> stored >> revision && stored > 0) {
+            epoch = stored;
+            epoch_revision = revision;
+        }
+    }
+    if (read_file(data_dir + "/standbys", contents)) {
+        std::istringstream lines(contents);
+        std::string address;
+        while (std::getline(lines, address)) {
+            if (!address.empty()) known_standbys.push_back(address);
+        }
+    }
+}
+
+// Function to durably replace a file in the data directory: the new contents
+// are synced under a temporary name and renamed over the old
+bool replace_file(const std::string& name, const std::string& contents) {
+    std::string tmp_path = data_dir + "/" + name + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && write_fully(fd, contents.data(), contents.size()) && fdatasync(fd) == 0;
+    if (fd >= 0) ::close(fd);
+    if (!ok || rename(tmp_path.c_str(), (data_dir + "/" + name).c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fsync_directory(data_dir);
+    return true;
+}
+
+// Function to remember a standby that followed this server, before it can
+// take over and fence it. Caller holds failover_mutex.
+void remember_standby(const std::string& address) {
+    if (std::find(known_standbys.begin(), known_standbys.end(), address) != known_standbys.end()) return;
+    known_standbys.push_back(address);
+    std::string contents;
+    for (const std::string& known : known_standbys) contents += known + "\n";
+    if (!replace_file("standbys", contents)) perror("Standbys write failed");
+}
+
+// Function to durably record a new epoch before acting on it, so a restarted
+// server can never fall back into a term it has left. Caller holds failover_mutex.
+bool store_epoch(uint64_t value, uint64_t revision) {
+    if (!replace_file("epoch", std::to_string(value) + " " + std::to_string(revision) + "\n")) {
+        perror("Epoch write failed");
+        return false;
+    }
+    epoch = value;
+    epoch_revision = revision;
+    return true;
+}
+
+// Function to open a TCP connection to "host:port", returning the socket or -1
+int connect_to(const std::string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(std::atoi(address.c_str() + colon + 1));
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || inet_pton(AF_INET, address.substr(0, colon).c_str(), &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to depose the leader this server took over from, should it come
+// back: every REPLICA_RETRY_MS it is told the new epoch, and it steps down
+// to follow this server. Runs while this server leads.
+void fence_loop() {
+    std::string target;
+    {
+        std::lock_guard<std::mutex> lock(failover_mutex);
+        target = former_leader;
+    }
+    while (server_running && !following) {
+        int fd = connect_to(target);
+        if (fd >= 0) {
+            json fence = { {"fence", { {"epoch", epoch.load()}, {"port", server_port}, {"secret", peer_secret} }} };
+            send_all(fd, fence.dump() + "\n");
+            close(fd);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RETRY_MS));
+    }
+}
+
+// Function to take over as leader after the old one fell silent. The new
+// epoch is on disk before the first edit is accepted, so this server can
+// never be talked back into the old term. Viewers may start editing.
+bool promote_to_leader() {
+    uint64_t revision;
+    {
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        revision = buffer_revision;
+    }
+    {
+        std::lock_guard<std::mutex> lock(failover_mutex);
+        if (!store_epoch(epoch + 1, revision)) return false;
+        former_leader = follow_address;
+        standbys.clear();
+    }
+    following = false;
+    std::cout << "Leader " << former_leader << " is silent; took over in epoch " << epoch
+              << " at revision " << revision << "." << std::endl;
+    json promoted = {
+        {"packet_type", "message"},
+        {"data", { {"message_type", "promoted"}, {"epoch", epoch.load()}, {"read_only", false} }}
+    };
+    broadcast_message(promoted);
+    std::thread fence_thread(fence_loop);
+    fence_thread.detach();
+    return true;
+}
+
+void follower_loop();
+
+// Function to step down after another server took over in a later epoch.
+// This server follows it from a snapshot, since its log may end in edits the
+// new leader never received. Acks still held for those edits are dropped and
+// clients are sent to the new leader, where they resend what was not acked.
+void step_down(const std::string& leader, uint64_t new_epoch) {
+    {
+        std::lock_guard<std::mutex> lock(failover_mutex);
+        if (new_epoch <= epoch || !store_epoch(new_epoch, 0)) return;
+        follow_address = leader;
+        standbys.clear();
+    }
+    replica_stale = true;
+    bool was_following = following.exchange(true);
+    std::cout << "Stepped down: " << leader << " leads in epoch " << new_epoch << "." << std::endl;
+    json redirect = {
+        {"packet_type", "message"},
+        {"data", { {"message_type", "redirect"}, {"address", leader}, {"epoch", new_epoch} }}
+    };
+    broadcast_message(redirect);
+    {
+        std::lock_guard<std::mutex> lock(users_mutex);
+        held_acks.clear();
+    }
+    if (!was_following) {
+        std::thread follower_thread(follower_loop);
+        follower_thread.detach();
+    }
+}
+
+// Function to apply one operation streamed from the leader, exactly as the
+// leader applied it: logged, broadcast to viewers, passed on to followers of
+// this replica. The session that made it is recorded, so its client can
+// resume here if this replica takes over. Returns false if it does not
+// continue this replica's revision or does not fit its document, i.e. the
+// replica has diverged. `packet` is the line it arrived as, which a relay
+// passes on to its viewers and relays unchanged.
+bool apply_replicated(const json& message, std::string_view packet) {
+    const json& data = message["data"];
+    uint64_t revision = data.value("revision", uint64_t(0));
+    LogRecord record = parse_operation(data);
+    std::lock_guard<FairMutex> lock(buffer_mutex);
+    if (revision <= buffer_revision) return true;   // Already applied before a reconnect
+    TextEdit edit;
+    if (revision != buffer_revision + 1 || !to_text_edit(shared_buffer, record, edit)) return false;
+    apply_text_edit(shared_buffer, edit);
+    buffer_revision = revision;
+    record.revision = revision;
+    if (!relay) oplog.append(record);
+
+    std::string session;
+    uint64_t cseq = 0;
+    if (data.contains("origin")) {
+        const json& origin = data.at("origin");
+        session = origin.value("session", "");
+        cseq = origin.value("cseq", uint64_t(0));
+        std::lock_guard<std::mutex> users_lock(users_mutex);
+        Session& entry = sessions[session];
+        if (entry.uname.empty()) {
+            entry = Session{origin.value("name", ""), origin.value("color", "#000000"), -1, 0, {}};
+        }
+        entry.acked_cseq = std::max(entry.acked_cseq, cseq);
+        if (entry.client_id < 0) entry.detached_at = std::chrono::steady_clock::now();
+    }
+    // What clients see: the packet as received, unless the session origin
+    // meant for followers has to come off first
+    Frame frame;
+    if (data.contains("origin")) {
+        json view = message;
+        view["data"].erase("origin");
+        frame = make_frame(view);
+    }
+    else {
+        frame = raw_frame(packet);
+    }
+    broadcast_frame(frame);
+    publish_to_observers(frame, revision);
+    replicate_operation(frame, session, cseq);
+    remember_operation({revision, frame, std::make_shared<const std::string>(session), cseq, shape_of(edit), cseq == 0});
+    return true;
+}
+
+// Function to replace the replica's document with a snapshot from the leader.
+// The snapshot is checkpointed before the old checkpoints and log are
+// dropped, so recovery never has to bridge the old contents and the new.
+// Viewers and followers of this replica are sent the new document.
+void install_replica(std::vector<std::string> lines, uint64_t revision) {
+    std::lock_guard<std::mutex> history_lock(history_mutex);
+    std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+    std::lock_guard<FairMutex> lock(buffer_mutex);
+    shared_buffer.assign(std::move(lines));
+    buffer_revision = revision;
+    op_history.clear();
+    past_document.reset();
+
+    uint64_t bytes = 0;
+    if (!relay && write_checkpoint(shared_buffer.snapshot(revision), bytes)) {
+        for (const auto& [checkpoint, name] : list_data_files(data_dir, "checkpoint-")) {
+            if (checkpoint != revision) unlink((data_dir + "/" + name).c_str());
+        }
+        checkpoint_revision = revision;
+        checkpoint_bytes = bytes;
+    }
+    if (!relay) oplog.reset(revision + 1);
+    replica_stale = false;
+
+    std::lock_guard<std::mutex> users_lock(users_mutex);
+    auto resync = [](int id, Outbox& outbox) {
+        {
+            std::lock_guard<std::mutex> outbox_lock(outbox.mutex);
+            outbox.frames.clear();
+            outbox.queued_bytes = 0;
+        }
+        queue_snapshot(outbox, snapshot_message("resync", id));
+    };
+    for (auto& [id, user] : users) resync(id, *user.outbox);
+    for (auto& [id, follower] : followers) resync(id, *follower.outbox);
+    std::lock_guard<std::mutex> observers_lock(observers_mutex);
+    for (auto& [id, observer] : observers) {
+        resync(id, *observer.outbox);
+        observer.joined_revision = revision;
+    }
+    wake_observers();
+}
+
+// Function to keep this server a hot replica of its leader. It asks for
+// everything after its own revision: the leader replays the operations it
+// still holds, or streams a snapshot first. Each batch applied is
+// acknowledged, so the leader can measure lag and release synchronous acks.
+//
+// The leader sends a heartbeat every HEARTBEAT_MS listing its standbys. After
+// failover_ms without hearing from it, the standbys take over in that order,
+// one failover_ms window each: in its window a standby looks for the one
+// before it leading under a later epoch, and when its own window comes it
+// promotes itself. During the first window the old leader is still tried,
+// since it may only have restarted.
+void follower_loop() {
+    auto last_heard = std::chrono::steady_clock::now();    // Last word from an accepted leader
+    uint64_t leader_epoch = epoch;                          // Epoch of the leader last followed
+    std::chrono::milliseconds timeout(failover_ms > 0 ? failover_ms : FAILOVER_MS);
+    while (server_running && following) {
+        // Whom to try: the old leader in the first window of silence, then each standby in turn
+        std::string leader;
+        bool failing_over = false, my_turn = false;
+        {
+            std::lock_guard<std::mutex> lock(failover_mutex);
+            leader = follow_address;
+            auto silence = std::chrono::steady_clock::now() - last_heard;
+            size_t window = failover_ms > 0 ? silence / std::chrono::milliseconds(failover_ms) : 0;
+            if (window > 0 && !standbys.empty()) {
+                failing_over = true;
+                leader = standbys[(window - 1) % standbys.size()];
+                my_turn = leader == own_address;
+            }
+        }
+        if (my_turn && promote_to_leader()) return;
+
+        int fd = my_turn ? -1 : connect_to(leader);
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(HEARTBEAT_MS));
+            continue;
+        }
+        // Wake up between heartbeats to notice when they stop
+        timeval tv{0, HEARTBEAT_MS * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        auto conn = std::make_shared<SocketConnection>(fd, leader, false);
+        uint64_t acked;
+        {
+            std::lock_guard<FairMutex> lock(buffer_mutex);
+            acked = buffer_revision;
+        }
+        json request = { {"replicate", {
+            {"revision", acked}, {"snapshot", replica_stale.load()}, {"epoch", epoch.load()}, {"relay", relay},
+            {"secret", peer_secret}
+        }} };
+        if (!relay) request["replicate"]["port"] = server_port;     // Relays never take over
+        conn->send_all(request.dump() + "\n");
+
+        char buffer[BUFFER_SIZE];
+        std::string partial_message;
+        bool loading = false;                   // A snapshot is arriving; operations wait for it
+        uint64_t snapshot_revision = 0;
+        std::vector<std::string> snapshot_lines;
+        std::vector<std::pair<json, std::string>> waiting;  // Operations and the packets they came in
+        bool consistent = true, refused = false;
+        auto last_data = std::chrono::steady_clock::now();
+        while (consistent && !refused && server_running && following) {
+            ssize_t n = conn->receive(buffer, sizeof(buffer));
+            auto now = std::chrono::steady_clock::now();
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (now - last_data > timeout) break;   // Heartbeats stopped: gone or cut off
+                continue;
+            }
+            if (n <= 0) break;
+            last_data = now;
+            if (leader_connected) last_heard = now;
+            partial_message.append(buffer, n);
+            size_t pos;
+            while (consistent && !refused && (pos = partial_message.find('\n')) != std::string::npos) {
+                std::string packet = partial_message.substr(0, pos);
+                json message = json::parse(packet, nullptr, false);
+                partial_message.erase(0, pos + 1);
+                if (message.is_discarded() || !message.contains("data") || !message["data"].is_object()) continue;
+                std::string packet_type = message.value("packet_type", "");
+                const json& data = message["data"];
+                uint64_t message_epoch = data.value("epoch", uint64_t(0));
+                if ((packet_type == "heartbeat" || data.value("message_type", "") == "replica_start") &&
+                    (message_epoch < epoch || (failing_over && message_epoch <= leader_epoch))) {
+                    // A deposed leader, or a standby that has not taken over yet
+                    refused = true;
+                    break;
+                }
+                if (packet_type == "heartbeat") {
+                    std::lock_guard<std::mutex> lock(failover_mutex);
+                    standbys = data.value("standbys", std::vector<std::string>());
+                    continue;
+                }
+                if (packet_type == "message" && data.value("message_type", "") == "replica_start") {
+                    std::lock_guard<std::mutex> lock(failover_mutex);
+                    if (message_epoch > epoch && relay) epoch = message_epoch;
+                    else if (message_epoch > epoch) store_epoch(message_epoch, 0);
+                    follow_address = leader;
+                    own_address = data.value("address", "");
+                    leader_epoch = message_epoch;
+                    failing_over = false;
+                    leader_connected = true;
+                    last_heard = now;
+                    std::cout << "Replicating from " << leader << " in epoch " << leader_epoch
+                              << " after revision " << acked << "." << std::endl;
+                }
+                if (packet_type == "message" &&
+                    (data.value("message_type", "") == "replica_start" || data.value("message_type", "") == "resync")) {
+                    // A snapshot follows unless the leader is replaying what was missed
+                    loading = data.value("snapshot", true);
+                    snapshot_revision = data.value("revision", uint64_t(0));
+                    snapshot_lines.clear();
+                    waiting.clear();
+                }
+                else if (packet_type == "snapshot_chunk" && loading) {
+                    for (const auto& line : data.value("lines", json::array())) snapshot_lines.push_back(line.get<std::string>());
+                    if (data.value("final", false)) {
+                        install_replica(std::move(snapshot_lines), snapshot_revision);
+                        std::cout << "Replica loaded a snapshot at revision " << snapshot_revision << "." << std::endl;
+                        loading = false;
+                        snapshot_lines.clear();
+                        for (const auto& [operation, received] : waiting) {
+                            consistent = consistent && apply_replicated(operation, received);
+                        }
+                        waiting.clear();
+                    }
+                }
+                else if (packet_type == "operation") {
+                    if (loading) waiting.emplace_back(std::move(message), std::move(packet));
+                    else consistent = apply_replicated(message, packet);
+                }
+            }
+
+            uint64_t applied;
+            {
+                std::lock_guard<FairMutex> lock(buffer_mutex);
+                applied = buffer_revision;
+            }
+            if (leader_connected && !loading && applied > acked) {
+                json ack = { {"packet_type", "replica_ack"}, {"data", { {"revision", applied} }} };
+                conn->send_all(ack.dump() + "\n");
+                acked = applied;
+            }
+        }
+        if (refused && !failing_over) {
+            std::cerr << "Refusing to follow " << leader << ": its epoch is older than " << epoch << "." << std::endl;
+        }
+        if (!consistent) {
+            std::cerr << "Replica diverged from " << leader << "; asking for a snapshot." << std::endl;
+            replica_stale = true;
+        }
+        leader_connected = false;
+        conn->shutdown();
+        if (server_running && following) std::this_thread::sleep_for(std::chrono::milliseconds(HEARTBEAT_MS));
+    }
+}
+
+// Function to broadcast the document's Merkle root every tree_secs, so clients
+// notice when their copy has silently diverged. Line hashes are filled in on a
+// snapshot first, off the lock; the root then covers only the few blocks edited
+// since, and goes out under buffer_mutex in order with the operations before it.
+void merkle_loop() {
+    auto last = std::chrono::steady_clock::now();
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (tree_secs <= 0 || std::chrono::steady_clock::now() - last < std::chrono::seconds(tree_secs)) continue;
+        last = std::chrono::steady_clock::now();
+        {
+            // Nobody to check against; do not keep old blocks alive for nothing
+            std::lock_guard<std::mutex> lock(users_mutex);
+            if (users.empty()) {
+                std::lock_guard<std::mutex> trees_lock(merkle_mutex);
+                merkle_trees.clear();
+                continue;
+            }
+        }
 
-// Struct to represent a User
-struct User {
-    int fd;                     // File descriptor for the socket
-    std::string uname;          // Username
-    std::string ucolor;         // Assigned color in hex format (e.g., "#FF5733")
-    int cursor_x;               // Cursor X position
-    int cursor_y;               // Cursor Y position
+        DocumentSnapshot warm;
+        {
+            std::lock_guard<FairMutex> lock(buffer_mutex);
+            warm = shared_buffer.snapshot(buffer_revision);
+        }
+        for (const auto& block : warm.blocks) block->line_hashes();
 
-    // Parameterized constructor
-    User(int fd, const std::string& uname, const std::string& ucolor)
-        : fd(fd), uname(uname), ucolor(ucolor), cursor_x(0), cursor_y(0) {}
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        auto start = std::chrono::steady_clock::now();
+        auto tree = std::make_shared<const MerkleTree>(shared_buffer.snapshot(buffer_revision));
+        tree_build_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        json root_msg = {
+            {"packet_type", "tree_root"},
+            {"data", {
+                {"revision", tree->snapshot.revision},
+                {"hash", tree->hash(0, tree->blocks())},
+                {"lines", tree->snapshot.line_count},
+                {"blocks", tree->blocks()}
+            }}
+        };
+        broadcast_frame(make_frame(root_msg));
+        std::lock_guard<std::mutex> trees_lock(merkle_mutex);
+        merkle_trees.push_back(tree);
+        if (merkle_trees.size() > TREES_KEPT) merkle_trees.pop_front();
+    }
+}
 
-    // Default constructor
-    User() : fd(-1), uname(""), ucolor("#000000"), cursor_x(0), cursor_y(0) {}
-};
+// Function to find a recently broadcast tree by revision
+std::shared_ptr<const MerkleTree> find_merkle_tree(uint64_t revision) {
+    std::lock_guard<std::mutex> lock(merkle_mutex);
+    for (const auto& tree : merkle_trees) {
+        if (tree->snapshot.revision == revision) return tree;
+    }
+    return nullptr;
+}
 
-// Define the enumeration for operation types
-enum class OperationType {
-    Insert,
-    Delete,
-    InsertNewline,
-    DeleteNewline,
-    Unknown
-};
+// Function to move an observer's next frames out of its outbox: everything on
+// the edit lane, then one bulk slice or, once the bulk lane is empty, one chunk
+// of its snapshot, in the order client_writer sends them. Returns false if
+// nothing is waiting.
+bool take_observer_frames(Observer& observer) {
+    static const Frame chunk_tail = std::make_shared<const std::string>(SnapshotStream::CHUNK_TAIL);
+    Outbox& outbox = *observer.outbox;
+    std::shared_ptr<SnapshotStream> stream;
+    size_t chunk = 0;
+    {
+        std::lock_guard<std::mutex> lock(outbox.mutex);
+        observer.ready.swap(outbox.frames);
+        outbox.queued_bytes = 0;
+        if (Frame slice = next_bulk_chunk(outbox)) {
+            observer.ready.push_back(slice);
+        }
+        else if (outbox.stream) {
+            stream = outbox.stream;
+            chunk = outbox.stream_chunk++;
+            if (outbox.stream_chunk == stream->size()) outbox.stream.reset();
+        }
+    }
+    if (stream) {
+        observer.ready.push_back(std::make_shared<const std::string>(stream->head(chunk)));
+        observer.ready.push_back(stream->lines(chunk));
+        observer.ready.push_back(chunk_tail);
+    }
+    return !observer.ready.empty();
+}
 
-// Function to map string to OperationType enum
-OperationType getOperationType(const std::string& op_type_str) {
-    static const std::unordered_map<std::string, OperationType> op_map = {
-        {"insert", OperationType::Insert},
-        {"delete", OperationType::Delete},
-        {"insert_newline", OperationType::InsertNewline},
-        {"delete_newline", OperationType::DeleteNewline}
-    };
-    
-    auto it = op_map.find(op_type_str);
-    if (it != op_map.end()) {
-        return it->second;
+// Function to write what an observer has waiting until its socket would
+// block. Returns false if the observer has gone.
+bool write_observer(Observer& observer) {
+    while (!observer.ready.empty() || take_observer_frames(observer)) {
+        const std::string& frame = *observer.ready.front();
+        ssize_t n = send(observer.fd, frame.data() + observer.sent, frame.size() - observer.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        observer.sent += n;
+        if (observer.sent == frame.size()) {
+            observer.ready.pop_front();
+            observer.sent = 0;
+        }
     }
-    return OperationType::Unknown;
+    return true;
 }
 
-// Global Variables
-std::map<int, User> users;                     // Map of file descriptors to Users
-std::mutex users_mutex;                        // Mutex to protect the users map
-std::vector<std::string> colors = {            // Predefined list of colors
-    "#FF5733", "#33FF57", "#3357FF", "#FF33A8",
-    "#A833FF", "#33FFF6", "#FF8F33", "#8FFF33",
-    "#FF3333", "#33FF8F"
-};
-int color_index = 0;                           // Index to assign colors
-std::mutex color_mutex;                        // Mutex to protect color assignment
+// Function to serve every observer from one thread, off the editors' path.
+// Each batch taken from the feed is queued on every observer's outbox, and
+// each observer is written as far as its socket takes without blocking, so a
+// slow one holds up no other; it is resynced like a slow client. The same
+// poll notices observers that leave. An observer may be handed an operation
+// its snapshot already holds, which clients ignore.
+void observer_loop() {
+    ObserverFeed batch;     // Swapped with the feed, so neither side reallocates it
+    std::vector<pollfd> fds;                    // The wakeup eventfd, then one per observer
+    std::vector<int> ids;                       // Observer behind each of fds[1..]
+    std::vector<std::pair<int, std::shared_ptr<Outbox>>> resyncs;
+    char discard[BUFFER_SIZE];
+    while (server_running) {
+        fds.assign(1, pollfd{observer_wake_fd, POLLIN, 0});
+        ids.clear();
+        {
+            std::lock_guard<std::mutex> lock(observers_mutex);
+            for (const auto& [id, observer] : observers) {
+                bool waiting = !observer.ready.empty();
+                if (!waiting) {
+                    std::lock_guard<std::mutex> outbox_lock(observer.outbox->mutex);
+                    waiting = !observer.outbox->frames.empty() || !observer.outbox->bulk.empty() || observer.outbox->stream;
+                }
+                fds.push_back(pollfd{observer.fd, static_cast<short>(POLLIN | (waiting ? POLLOUT : 0)), 0});
+                ids.push_back(id);
+            }
+        }
+        if (poll(fds.data(), fds.size(), 100) < 0) {
+            if (errno != EINTR) perror("Observer poll failed");
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            (void)!read(observer_wake_fd, &count, sizeof(count));
+        }
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> lock(observer_feed_mutex);
+            batch.swap(observer_feed);
+        }
 
-std::vector<std::string> shared_buffer = {""}; // Shared document buffer
-std::mutex buffer_mutex;                        // Mutex to protect the shared buffer
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(observers_mutex);
+            if (!batch.empty()) {
+                for (const auto& [id, observer] : observers) {
+                    enqueue_frames(*observer.outbox, batch, observer.joined_revision);
+                }
+                observer_frames += batch.size() * observers.size();
+            }
+            for (size_t i = 1; i < fds.size(); ++i) {
+                auto it = observers.find(ids[i - 1]);
+                if (it == observers.end()) continue;
+                Observer& observer = it->second;
+                bool gone = false;
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    // Observers have nothing to say; only their leaving matters
+                    ssize_t n = recv(observer.fd, discard, sizeof(discard), MSG_DONTWAIT);
+                    gone = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+                }
+                if (gone || !write_observer(observer)) {
+                    observers.erase(it);
+                    continue;
+                }
+                std::lock_guard<std::mutex> outbox_lock(observer.outbox->mutex);
+                if (observer.outbox->resync_pending) {
+                    // The backlog taken out predates the snapshot too; only a packet
+                    // already begun on the wire, perhaps a snapshot chunk in three
+                    // frames, is finished
+                    size_t keep = 0;
+                    if (observer.sent > 0) {
+                        while (observer.ready[keep]->empty() || observer.ready[keep]->back() != '\n') keep++;
+                        keep++;
+                    }
+                    observer.ready.erase(observer.ready.begin() + keep, observer.ready.end());
+                    resyncs.emplace_back(it->first, observer.outbox);
+                }
+            }
+        }
+        observer_fanout_us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
 
-// Signal Handling for Graceful Shutdown
-std::atomic<bool> server_running(true);
+        // Snapshots are taken under buffer_mutex, which comes before observers_mutex
+        for (const auto& [id, outbox] : resyncs) {
+            std::cout << "Observer " << id << " fell behind; sending a snapshot instead of its backlog." << std::endl;
+            queue_resync(id, *outbox);
+        }
+        resyncs.clear();
+    }
+}
 
-int listen_fd = -1;
-void handle_signal(int signal) {
-    if (signal == SIGINT) {
-        std::cout << "\nShutting down server gracefully..." << std::endl;
-        server_running = false;
-        close(listen_fd);
+// Function to serve an observer: a read-only client that is not a user. It
+// gets a snapshot, then operations from the observer feed, and none of what a
+// user costs: no name or color, no presence, no join or leave broadcast, no
+// slot among MAX_CLIENTS, and no thread. Once it is registered, observer_loop
+// takes the connection over and this thread returns.
+void serve_observer(std::shared_ptr<Connection> conn, int client_id) {
+    // observer_loop polls socket descriptors, so a shared-memory ring cannot be served
+    auto socket_conn = std::dynamic_pointer_cast<SocketConnection>(conn);
+    if (!socket_conn) {
+        json error_msg = {
+            {"packet_type", "message"},
+            {"data", {
+                {"message_type", "error_observer_transport"},
+                {"message", "Observers must connect over TCP or a unix socket, not shared memory."}
+            }}
+        };
+        conn->send_all(error_msg.dump() + "\n");
+        return;
+    }
+    bool full;
+    {
+        std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+        std::lock_guard<std::mutex> users_lock(users_mutex);
+        std::lock_guard<std::mutex> lock(observers_mutex);
+        full = observers.size() >= MAX_OBSERVERS;
+        if (!full) {
+            int fd = socket_conn->socket_fd();
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            auto outbox = std::allocate_shared<Outbox>(SlabAllocator<Outbox>());
+            json success_msg = snapshot_message("connect_success", client_id);
+            success_msg["data"]["read_only"] = true;
+            success_msg["data"]["observer"] = true;
+            success_msg["data"]["epoch"] = epoch.load();
+            success_msg["data"]["servers"] = standby_list();
+            queue_snapshot(*outbox, success_msg);
+            observers.emplace(client_id, Observer{conn, outbox, buffer_revision, fd, {}, 0});
+        }
+    }
+    if (full) {
+        json error_msg = {
+            {"packet_type", "message"},
+            {"data", { {"message_type", "error_observers_full"}, {"message", "Too many observers."} }}
+        };
+        conn->send_all(error_msg.dump() + "\n");
+        return;
     }
+    wake_observers();
 }
 
-// Function to assign a unique color to a new user
-std::string assign_color() {
-    std::lock_guard<std::mutex> lock(color_mutex);
-    std::string color = colors[color_index];
-    color_index = (color_index + 1) % colors.size();
-    return color;
+// Function to tell the routing node whenever this document process becomes
+// idle or busy, and to hibernate once it has had no clients for idle_secs: the
+// process stops, checkpointing on the way down, and the node starts it again
+// on the next join.
+void idle_loop() {
+    bool idle = false;
+    auto idle_since = std::chrono::steady_clock::now();
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        bool empty;
+        {
+            std::lock_guard<std::mutex> users_lock(users_mutex);
+            std::lock_guard<std::mutex> lock(observers_mutex);
+            empty = users.empty() && followers.empty() && observers.empty();
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (empty != idle) {
+            idle = empty;
+            idle_since = now;
+            (void)!write(ready_fd, idle ? "idle\n" : "busy\n", 5);
+        }
+        if (idle && idle_secs > 0 && now - idle_since >= std::chrono::seconds(idle_secs)) {
+            std::cout << "No clients for " << idle_secs << " s; hibernating." << std::endl;
+            (void)!write(ready_fd, "hibernate\n", 10);
+            server_running = false;
+            shutdown(listen_fd, SHUT_RDWR);     // Wakes the accept loop
+            return;
+        }
+    }
 }
 
-// Function to send all data reliably
-bool send_all(int sockfd, const std::string& message) {
-    size_t total_sent = 0;
-    size_t to_send = message.length();
-    const char* data = message.c_str();
-    while (total_sent < to_send) {
-        ssize_t sent = send(sockfd, data + total_sent, to_send - total_sent, 0);
-        if (sent < 0) {
-            perror("Send error");
-            return false;
+// Function to send followers a heartbeat every HEARTBEAT_MS, with the epoch and
+// the standbys in the order they would take over. Followers that stop hearing
+// them start a failover.
+void heartbeat_loop() {
+    while (server_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(HEARTBEAT_MS));
+        std::lock_guard<std::mutex> lock(users_mutex);
+        if (followers.empty()) continue;
+        json heartbeat = {
+            {"packet_type", "heartbeat"},
+            {"data", { {"epoch", epoch.load()}, {"standbys", standby_list()} }}
+        };
+        Frame frame = make_frame(heartbeat);
+        for (const auto& [id, follower] : followers) enqueue_frame(*follower.outbox, frame);
+    }
+}
+
+// Function to check that a request to replicate or fence comes from another
+// server of this cluster: one that knows the peer secret or, with none
+// configured, one on this host. Anyone else could otherwise gate acks, stand
+// in line to lead, or depose the leader.
+bool trusted_peer(const Connection& conn, const json& request) {
+    if (peer_secret.empty()) {
+        return conn.is_local() || conn.describe().compare(0, 4, "127.") == 0;
+    }
+    std::string secret = request.is_object() ? request.value("secret", "") : "";
+    unsigned char difference = secret.size() != peer_secret.size();
+    for (size_t i = 0; i < secret.size() && i < peer_secret.size(); ++i) {
+        difference |= secret[i] ^ peer_secret[i];   // Compared in full, so timing gives nothing away
+    }
+    return difference == 0;
+}
+
+// Function to serve a follower process that asked to replicate the document.
+// It gets the operations it missed from op_history when that reaches back far
+// enough, otherwise a snapshot, and then every operation in revision order.
+// Its replica_ack packets report how far it has applied. A follower that
+// gives its port can take over from this server; one from an earlier epoch
+// may hold edits this server never saw, unless it stopped at or before the
+// revision this server's term began at.
+void serve_follower(std::shared_ptr<Connection> conn, int client_id, const json& request, std::string partial_message) {
+    if (!trusted_peer(*conn, request)) {
+        std::cerr << "Refusing follower " << conn->describe() << " without the peer secret." << std::endl;
+        return;
+    }
+    uint64_t revision = request.value("revision", uint64_t(0));
+    uint64_t request_epoch = request.value("epoch", epoch.load());
+    std::string peer = conn->describe();
+    std::string address = request.contains("port")
+                          ? peer.substr(0, peer.rfind(':')) + ":" + std::to_string(request.value("port", 0)) : "";
+    uint64_t term_start;
+    {
+        std::lock_guard<std::mutex> lock(failover_mutex);
+        term_start = epoch_revision;
+        if (!address.empty() && !request.value("relay", false) && !relay) remember_standby(address);
+    }
+    if (request_epoch > epoch) {
+        std::cerr << "Refusing follower " << peer << " from the later epoch " << request_epoch << "." << std::endl;
+        return;
+    }
+    bool same_history = request_epoch == epoch || (request_epoch + 1 == epoch && revision <= term_start);
+    bool replay;
+    auto outbox = std::allocate_shared<Outbox>(SlabAllocator<Outbox>());
+    json servers;
+    {
+        std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+        std::lock_guard<std::mutex> lock(users_mutex);
+        replay = same_history && !request.value("snapshot", false) && revision <= buffer_revision &&
+                 (revision == buffer_revision || (!op_history.empty() && op_history.front().revision <= revision + 1));
+        followers[client_id] = Follower{conn, outbox, replay ? revision : 0, 0, address, request.value("relay", false)};
+        servers = standby_list();
+        json start = snapshot_message("replica_start", client_id);
+        start["data"]["snapshot"] = !replay;
+        start["data"]["epoch"] = epoch.load();
+        start["data"]["address"] = address;
+        if (replay) {
+            start["data"]["revision"] = revision;
+            enqueue_frame(*outbox, make_frame(start));
+            auto it = std::lower_bound(op_history.begin(), op_history.end(), revision + 1,
+                                       [](const HistoryEntry& entry, uint64_t rev) { return entry.revision < rev; });
+            for (; it != op_history.end(); ++it) enqueue_frame(*outbox, it->frame);
+        }
+        else {
+            queue_snapshot(*outbox, start);
         }
-        total_sent += sent;
     }
-    return true;
+    std::thread writer_thread(client_writer, client_id, conn, outbox);
+    std::cout << "Follower " << conn->describe() << " replicating from revision " << revision
+              << (replay ? "." : " with a snapshot.") << std::endl;
+    // Clients learn where to go should this server fail
+    broadcast_message({ {"packet_type", "message"}, {"data", { {"message_type", "servers"}, {"servers", servers} }} });
+
+    char buffer[BUFFER_SIZE];
+    ssize_t n = 0;
+    do {
+        partial_message.append(buffer, n);
+        size_t pos;
+        while ((pos = partial_message.find('\n')) != std::string::npos) {
+            json message = json::parse(partial_message.substr(0, pos), nullptr, false);
+            partial_message.erase(0, pos + 1);
+            if (!message.is_object() || message.value("packet_type", "") != "replica_ack" || !message["data"].is_object()) continue;
+            uint64_t acked = message["data"].value("revision", uint64_t(0));
+
+            // Lag is the time from applying the revision here to the follower's ack
+            std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+            auto it = std::lower_bound(op_history.begin(), op_history.end(), acked,
+                                       [](const HistoryEntry& entry, uint64_t rev) { return entry.revision < rev; });
+            std::lock_guard<std::mutex> lock(users_mutex);
+            Follower& follower = followers[client_id];
+            follower.acked_revision = std::max(follower.acked_revision, acked);
+            if (it != op_history.end() && it->revision == acked) {
+                follower.lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - it->applied).count();
+            }
+            release_acks();
+        }
+    } while ((n = conn->receive(buffer, sizeof(buffer))) > 0);
+
+    {
+        std::lock_guard<std::mutex> lock(users_mutex);
+        followers.erase(client_id);
+        release_acks();
+        servers = standby_list();
+    }
+    std::cout << "Follower " << conn->describe() << " disconnected." << std::endl;
+    broadcast_message({ {"packet_type", "message"}, {"data", { {"message_type", "servers"}, {"servers", servers} }} });
+    {
+        std::lock_guard<std::mutex> lock(outbox->mutex);
+        outbox->closed = true;
+    }
+    outbox->cv.notify_one();
+    writer_thread.join();
 }
 
-// Function to broadcast a message to all connected clients
-void broadcast_message(const json& message, int exclude_fd = -1) {
+// Function to report the replication role, followers and their lag
+json replication_stats() {
+    uint64_t revision;
+    {
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        revision = buffer_revision;
+    }
+    json stats = { {"role", relay ? "relay" : following ? "follower" : "leader"}, {"epoch", epoch.load()} };
+    if (following) {
+        std::lock_guard<std::mutex> lock(failover_mutex);
+        stats["leader"] = follow_address;
+        stats["connected"] = leader_connected.load();
+        stats["standbys"] = standbys;
+    }
     std::lock_guard<std::mutex> lock(users_mutex);
-    std::string msg_str = message.dump() + "\n";
-    for (const auto& [fd, user] : users) {
-        if (fd == exclude_fd) continue; // Skip sending to the sender
-        bool success = send_all(fd, msg_str);
-        if (!success) {
-            std::cerr << "Failed to send message to user: " << user.uname << std::endl;
-            // Optionally handle disconnection here
+    json list = json::array();
+    for (const auto& [id, follower] : followers) {
+        std::lock_guard<std::mutex> outbox_lock(follower.outbox->mutex);
+        list.push_back({
+            {"id", id},
+            {"address", follower.conn->describe()},
+            {"standby", follower.address},
+            {"relay", follower.relay},
+            {"acked_revision", follower.acked_revision},
+            {"lag_ops", revision - std::min(revision, follower.acked_revision)},
+            {"lag_ms", follower.lag_ms},
+            {"queued_bytes", follower.outbox->queued_bytes}
+        });
+    }
+    stats["followers"] = list;
+    stats["sync_replicas"] = sync_replicas;
+    stats["held_acks"] = held_acks.size();
+    return stats;
+}
+
+// Function to check that a document name is safe to use in a directory name
+bool valid_document_name(const std::string& name) {
+    return !name.empty() && name.size() <= 64 && name[0] != '.' &&
+           std::all_of(name.begin(), name.end(), [](unsigned char c) {
+               return std::isalnum(c) || c == '-' || c == '_' || c == '.';
+           });
+}
+
+// Function to start the process serving a document on this node. It is this
+// binary, run with its own data directory under data_dir and the options
+// given to this node; it listens on a port of its choosing and reports the
+// port through a pipe. Caller holds documents_mutex.
+bool start_document(const std::string& name, DocumentProcess& process) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("Pipe failed");
+        return false;
+    }
+    std::vector<std::string> args = {
+        "np_server", "0", "--no-unix", "--document", name, "--data-dir", data_dir + "/doc-" + name,
+        "--ready-fd", std::to_string(fds[1])
+    };
+    args.insert(args.end(), document_args.begin(), document_args.end());
+    std::vector<char*> argv;
+    for (std::string& arg : args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(fds[1], F_SETFD, 0);      // The write end alone survives exec
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("Fork failed");
+        close(fds[0]);
+        return false;
+    }
+
+    // The port arrives alone; the pipe then stays open for status reports
+    char buffer[32];
+    ssize_t n = 0;
+    pollfd ready = {fds[0], POLLIN, 0};
+    if (poll(&ready, 1, DOCUMENT_START_MS) > 0) n = read(fds[0], buffer, sizeof(buffer) - 1);
+    if (n <= 0) {
+        std::cerr << "Document '" << name << "' failed to start." << std::endl;
+        close(fds[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return false;
+    }
+    buffer[n] = '\0';
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    process = DocumentProcess{pid, std::atoi(buffer), fds[0], false, std::chrono::steady_clock::now()};
+    std::cout << "Started document '" << name << "' on port " << process.port << " (pid " << pid << ")." << std::endl;
+    return true;
+}
+
+// Function to read what a document process has reported since last asked,
+// and whether it is still serving. One that is hibernating is waited for, so
+// its checkpoint is complete before the document is started again. Caller
+// holds documents_mutex.
+bool document_running(DocumentProcess& process) {
+    char buffer[256];
+    ssize_t n;
+    bool hibernating = false;
+    while ((n = read(process.status_fd, buffer, sizeof(buffer))) > 0) {
+        std::string reports(buffer, n);
+        size_t last = reports.rfind("idle\n"), busy = reports.rfind("busy\n");
+        if (last != std::string::npos || busy != std::string::npos) {
+            process.idle = busy == std::string::npos || (last != std::string::npos && last > busy);
+        }
+        if (reports.find("hibernate\n") != std::string::npos) hibernating = true;
+    }
+    if (n == 0) hibernating = true;     // It exited, closing the pipe
+    if (hibernating) {
+        waitpid(process.pid, nullptr, 0);
+        residency.hibernations++;
+    }
+    else if (waitpid(process.pid, nullptr, WNOHANG) == 0) {
+        return true;
+    }
+    close(process.status_fd);
+    return false;
+}
+
+// Function to forget document processes that have hibernated or died.
+// Caller holds documents_mutex.
+void reap_documents() {
+    for (auto it = documents.begin(); it != documents.end();) {
+        if (document_running(it->second)) ++it;
+        else it = documents.erase(it);
+    }
+}
+
+// Function to make room for one more document process under max_resident by
+// stopping the least recently used idle one. It checkpoints on the way down.
+// With every process busy, the cap is exceeded rather than refusing the join.
+// Caller holds documents_mutex.
+void evict_documents() {
+    if (max_resident == 0) return;
+    reap_documents();
+    while (documents.size() >= max_resident) {
+        auto victim = documents.end();
+        for (auto it = documents.begin(); it != documents.end(); ++it) {
+            if (it->second.idle && (victim == documents.end() || it->second.last_used < victim->second.last_used)) victim = it;
+        }
+        if (victim == documents.end()) return;
+        std::cout << "Evicting idle document '" << victim->first << "'." << std::endl;
+        kill(victim->second.pid, SIGINT);
+        waitpid(victim->second.pid, nullptr, 0);
+        close(victim->second.status_fd);
+        documents.erase(victim);
+        residency.evictions++;
+    }
+}
+
+// Function to describe the documents this node runs and how often joins found
+// them running. Caller holds documents_mutex.
+json residency_stats() {
+    reap_documents();
+    json names = json::array();
+    for (const auto& [name, process] : documents) names.push_back(name);
+    uint64_t joins = residency.hits + residency.loads;
+    return {
+        {"resident", names},
+        {"max_resident", max_resident},
+        {"hits", residency.hits},
+        {"loads", residency.loads},
+        {"hit_rate", joins ? double(residency.hits) / joins : 0.0},
+        {"avg_load_us", residency.loads ? residency.load_us / residency.loads : 0},
+        {"max_load_us", residency.max_load_us},
+        {"hibernations", residency.hibernations},
+        {"evictions", residency.evictions}
+    };
+}
+
+// Function to route a client of this node to the process serving its
+// document: another node if the ring places the document there, otherwise
+// this node's process for it, started on first use. Either way the client
+// gets a redirect and connects again.
+void route_client(std::shared_ptr<Connection> conn, const json& hello) {
+    if (hello.value("stats", false)) {
+        std::lock_guard<std::mutex> lock(documents_mutex);
+        json stats_msg = { {"packet_type", "message"}, {"data", { {"message_type", "stats"}, {"documents", residency_stats()} }} };
+        conn->send_all(stats_msg.dump() + "\n");
+        return;
+    }
+    std::string name = hello.value("document", "default");
+    json reply = { {"packet_type", "message"}, {"data", { {"document", name} }} };
+    if (!valid_document_name(name)) {
+        reply["data"]["message_type"] = "error_document_invalid";
+        reply["data"]["message"] = "Document names are letters, digits, '-', '_' and '.'.";
+        conn->send_all(reply.dump() + "\n");
+        return;
+    }
+    std::string address = ring->owner(name);
+    if (address == node_address) {
+        std::lock_guard<std::mutex> lock(documents_mutex);
+        auto it = documents.find(name);
+        if (it != documents.end() && !document_running(it->second)) {
+            documents.erase(it);
+            it = documents.end();
         }
+        if (it == documents.end()) {
+            evict_documents();
+            auto start = std::chrono::steady_clock::now();
+            DocumentProcess process;
+            if (!start_document(name, process)) {
+                reply["data"]["message_type"] = "error_document_unavailable";
+                reply["data"]["message"] = "The document could not be opened.";
+                conn->send_all(reply.dump() + "\n");
+                return;
+            }
+            uint64_t load_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            residency.loads++;
+            residency.load_us += load_us;
+            residency.max_load_us = std::max(residency.max_load_us, load_us);
+            it = documents.insert_or_assign(name, process).first;
+        }
+        else {
+            residency.hits++;
+        }
+        it->second.last_used = std::chrono::steady_clock::now();
+        address = node_address.substr(0, node_address.rfind(':')) + ":" + std::to_string(it->second.port);
     }
+    reply["data"]["message_type"] = "redirect";
+    reply["data"]["address"] = address;
+    conn->send_all(reply.dump() + "\n");
+}
+
+// Function to report the observers and the cost of fanning out to them
+json observer_stats() {
+    std::lock_guard<std::mutex> lock(observers_mutex);
+    return {
+        {"count", observers.size()},
+        {"frames", observer_frames.load()},
+        {"fanout_us", observer_fanout_us.load()}
+    };
 }
 
 // Function to handle individual client connections
-void handle_client(int client_fd) {
+void handle_client(std::shared_ptr<Connection> conn, int client_id) {
     char buffer[BUFFER_SIZE];
     std::string partial_message = "";
 
     // Receive and validate username
-    ssize_t n = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+    ssize_t n = conn->receive(buffer, sizeof(buffer) - 1);
     if (n <= 0) {
-        close(client_fd);
         return;
     }
     buffer[n] = '\0';
@@ -149,14 +4850,76 @@ void handle_client(int client_fd) {
     size_t pos = partial_message.find('\n');
     if (pos == std::string::npos) {
         // Invalid protocol, no newline found
-        close(client_fd);
         return;
     }
     std::string line = partial_message.substr(0, pos);
     partial_message.erase(0, pos + 1);
 
+    std::shared_ptr<Outbox> outbox;     // Set once the user is registered
+    auto limiter = std::allocate_shared<RateLimiter>(SlabAllocator<RateLimiter>(), ops_per_sec, bytes_per_sec);
+    std::thread writer_thread;          // Drains outbox onto conn
+    std::shared_ptr<DocumentSnapshot> delta_base;  // Snapshot a delta_request is answered against
+
     try {
         json username_json = json::parse(line);
+        if (ring) {
+            // A routing node serves no document itself
+            route_client(conn, username_json);
+            return;
+        }
+        if (!document_name.empty() && username_json.value("document", document_name) != document_name) {
+            json error_msg = {
+                {"packet_type", "message"},
+                {"data", {
+                    {"message_type", "error_document_invalid"},
+                    {"message", "This server holds the document '" + document_name + "' only."}
+                }}
+            };
+            conn->send_all(error_msg.dump() + "\n");
+            return;
+        }
+        if (username_json.contains("replicate")) {
+            // Not a user: another server process keeping a replica
+            serve_follower(conn, client_id, username_json["replicate"], partial_message);
+            return;
+        }
+        if (username_json.contains("fence")) {
+            // Another server has taken over from this one in a later epoch. Only
+            // a cluster peer that has been this server's standby may say so.
+            const json& fence = username_json["fence"];
+            std::string peer = conn->describe();
+            std::string leader = peer.substr(0, peer.rfind(':')) + ":" + std::to_string(fence.value("port", 0));
+            bool known;
+            {
+                std::lock_guard<std::mutex> lock(failover_mutex);
+                known = std::find(known_standbys.begin(), known_standbys.end(), leader) != known_standbys.end();
+            }
+            if (!trusted_peer(*conn, fence) || !known) {
+                std::cerr << "Refusing fence from " << leader << ", not a standby of this server." << std::endl;
+                return;
+            }
+            step_down(leader, fence.value("epoch", uint64_t(0)));
+            return;
+        }
+        if (username_json.value("observe", false)) {
+            serve_observer(conn, client_id);
+            return;
+        }
+        if (username_json.value("epoch", uint64_t(0)) > epoch || (following && username_json.value("writer", false))) {
+            // The client has seen a later leader, or wants to edit on a replica:
+            // send it to the leader this server follows, if it knows one
+            std::string leader;
+            if (following && leader_connected) {
+                std::lock_guard<std::mutex> lock(failover_mutex);
+                leader = follow_address;
+            }
+            json redirect_msg = {
+                {"packet_type", "message"},
+                {"data", { {"message_type", "redirect"}, {"address", leader}, {"epoch", epoch.load()} }}
+            };
+            conn->send_all(redirect_msg.dump() + "\n");
+            return;
+        }
         if (!username_json.contains("name")) {
             // Invalid message format
             json error_msg = {
@@ -166,8 +4929,7 @@ void handle_client(int client_fd) {
                     {"message", "Invalid username. Name field missing."}
                 }}
             };
-            send_all(client_fd, error_msg.dump() + "\n");
-            close(client_fd);
+            conn->send_all(error_msg.dump() + "\n");
             return;
         }
         std::string uname = username_json["name"];
@@ -181,15 +4943,54 @@ void handle_client(int client_fd) {
                     {"message", "Username cannot be empty."}
                 }}
             };
-            send_all(client_fd, error_msg.dump() + "\n");
-            close(client_fd);
+            conn->send_all(error_msg.dump() + "\n");
             return;
         }
 
+        // A returning client presents its session token and the last revision it applied
+        // (no revision if its buffer is incomplete, so it needs a snapshot)
+        std::string session_token;
+        uint64_t resume_revision = 0;
+        bool resuming = false, has_revision = false;
+        if (username_json.contains("resume") && username_json["resume"].is_object()) {
+            session_token = username_json["resume"].value("session", "");
+            has_revision = username_json["resume"].contains("revision");
+            resume_revision = username_json["resume"].value("revision", uint64_t(0));
+        }
+
         // Check if username is already taken
+        std::shared_ptr<Connection> stale_conn;
+        std::vector<std::string> dropped_sessions;
         {
             std::lock_guard<std::mutex> lock(users_mutex);
-            for (const auto& [fd, user] : users) {
+            expire_sessions(dropped_sessions);
+            auto session = sessions.find(session_token);
+            resuming = session != sessions.end() && session->second.uname == uname;
+            if (resuming && session->second.client_id >= 0) {
+                // The old connection has not noticed the drop yet; take the session over
+                auto old = users.find(session->second.client_id);
+                if (old != users.end()) {
+                    stale_conn = old->second.conn;
+                    udp_sessions.erase(old->second.udp_token);
+                    users.erase(old);
+                }
+                session->second.client_id = -1;
+                session->second.detached_at = std::chrono::steady_clock::now();
+            }
+            // Only editors take one of the MAX_CLIENTS slots; observers and followers have returned by now
+            if (users.size() >= MAX_CLIENTS) {
+                std::cerr << "Maximum clients reached. Refusing connection from " << conn->describe() << "." << std::endl;
+                json error_msg = {
+                    {"packet_type", "message"},
+                    {"data", {
+                        {"message_type", "error_server_full"},
+                        {"message", "The server has no room for another editor. Try again later."}
+                    }}
+                };
+                conn->send_all(error_msg.dump() + "\n");
+                return;
+            }
+            for (const auto& [id, user] : users) {
                 if (user.uname == uname) {
                     json error_msg = {
                         {"packet_type", "message"},
@@ -198,52 +4999,124 @@ void handle_client(int client_fd) {
                             {"message", "Username already taken. Choose another one."}
                         }}
                     };
-                    send_all(client_fd, error_msg.dump() + "\n");
-                    close(client_fd);
+                    conn->send_all(error_msg.dump() + "\n");
                     return;
                 }
             }
+            if (!resuming) {
+                // A fresh login under this name retires any session left behind by it
+                session_token = generate_token();
+                for (auto it = sessions.begin(); it != sessions.end();) {
+                    if (it->second.uname == uname && it->second.client_id < 0) {
+                        dropped_sessions.push_back(it->first);
+                        it = sessions.erase(it);
+                    }
+                    else ++it;
+                }
+            }
+        }
+        if (stale_conn) stale_conn->shutdown();
+        if (!dropped_sessions.empty()) {
+            // Their undo history can no longer be asked for
+            std::lock_guard<FairMutex> lock(buffer_mutex);
+            for (const auto& token : dropped_sessions) undo_histories.erase(token);
         }
 
-        // Assign a unique color to the user
-        std::string ucolor = assign_color();
+        // Co-located clients may move their frames onto a shared-memory ring.
+        // The segment name is sent over the socket; everything after it uses the ring.
+        if (username_json.value("transport", "") == "shm" && conn->is_local()) {
+            auto socket_conn = std::dynamic_pointer_cast<SocketConnection>(conn);
+            auto shm_conn = socket_conn ? ShmConnection::create(socket_conn) : nullptr;
+            if (shm_conn) {
+                json shm_msg = {
+                    {"packet_type", "message"},
+                    {"data", {
+                        {"message_type", "shm_ready"},
+                        {"segment", shm_conn->segment_name()},
+                        {"ring_size", SHM_RING_SIZE}
+                    }}
+                };
+                conn->send_all(shm_msg.dump() + "\n");
+                conn = shm_conn;
+            }
+        }
 
-        // Add the user to the users map
-        {
+        // Assign a unique color to the user; a resumed session keeps its own
+        std::string ucolor;
+        if (resuming) {
             std::lock_guard<std::mutex> lock(users_mutex);
-            users.emplace(client_fd, User(client_fd, uname, ucolor));
+            auto session = sessions.find(session_token);
+            if (session != sessions.end()) ucolor = session->second.ucolor;
         }
+        if (ucolor.empty()) ucolor = assign_color();
 
-        std::cout << "User '" << uname << "' connected on socket " << client_fd << "." << std::endl;
+        // Clients that ask for it get a token binding a UDP cursor channel to this session
+        bool wants_udp = udp_fd >= 0 && username_json.value("udp", false);
+        bool wants_delta = username_json.value("delta", false);
+        std::string udp_token = wants_udp ? generate_token() : "";
 
-        // Prepare the list of existing collaborators excluding the new user
-        json existing_collaborators = json::array();
+        // Add the user to the users map and queue the current state for it.
+        // Both happen under buffer_mutex so no operation can slip in between
+        // the snapshot and the user's first live frame.
         {
+            std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
             std::lock_guard<std::mutex> lock(users_mutex);
-            for (const auto& [fd, user] : users) {
-                if (fd == client_fd) continue; // Exclude the new user
-                existing_collaborators.push_back({
-                    {"name", user.uname},
-                    {"color", user.ucolor},
-                    {"cursor", {
-                        {"x", user.cursor_x},
-                        {"y", user.cursor_y}
-                    }}
-                });
+            auto it = users.emplace(client_id, User(conn, uname, ucolor)).first;
+            outbox = it->second.outbox;
+            it->second.limiter = limiter;
+            it->second.session = session_token;
+            if (wants_udp) {
+                it->second.udp_token = udp_token;
+                udp_sessions[udp_token] = client_id;
             }
-        }
 
-        // Send a success message with assigned color and current buffer/collaborators
-        json success_msg = {
-            {"packet_type", "message"},
-            {"data", {
-                {"message_type", "connect_success"},
-                {"color", ucolor},
-                {"buffer", shared_buffer},        // Send current shared buffer
-                {"collaborators", existing_collaborators}  // Send current collaborators
-            }}
-        };
-        send_all(client_fd, success_msg.dump() + "\n");
+            Session& session = sessions[session_token];
+            if (!resuming || session.uname.empty()) session = Session{uname, ucolor, client_id, 0, {}};
+            session.client_id = client_id;
+
+            // A resumed client that is not too far behind only gets the operations it
+            // missed; anyone else gets a snapshot. Both carry the highest sequence number
+            // already processed, so the client knows which unacked edits to send again.
+            bool replay = resuming && has_revision && resume_revision <= buffer_revision &&
+                          (resume_revision == buffer_revision ||
+                           (!op_history.empty() && op_history.front().revision <= resume_revision + 1));
+            json success_msg = replay ? snapshot_message("resumed", client_id)
+                                      : snapshot_message("connect_success", client_id);
+            success_msg["data"]["color"] = ucolor;
+            success_msg["data"]["session"] = session_token;
+            success_msg["data"]["acked_cseq"] = session.acked_cseq;
+            success_msg["data"]["read_only"] = following.load();
+            success_msg["data"]["epoch"] = epoch.load();
+            success_msg["data"]["servers"] = standby_list();
+            success_msg["data"]["quotas"] = { {"packet_bytes", max_packet_bytes}, {"document_bytes", max_document_bytes} };
+            if (wants_udp) {
+                success_msg["data"]["udp"] = { {"port", server_port}, {"token", udp_token} };
+            }
+            if (replay) {
+                success_msg["data"].erase("lines");
+                success_msg["data"]["revision"] = resume_revision;
+                enqueue_frame(*outbox, make_frame(success_msg));
+                queue_missed_operations(*outbox, session_token, resume_revision);
+            }
+            else if (wants_delta) {
+                // The client holds a stale copy: it sends chunk hashes next and gets a
+                // delta against this snapshot instead of the whole document
+                success_msg["data"]["delta"] = true;
+                delta_base = std::make_shared<DocumentSnapshot>(shared_buffer.snapshot(buffer_revision));
+                enqueue_frame(*outbox, make_frame(success_msg));
+            }
+            else {
+                queue_snapshot(*outbox, success_msg);
+            }
+            if (resuming) {
+                std::cout << "Session of '" << uname << "' resumed at revision " << resume_revision
+                          << (replay ? " by replaying " + std::to_string(buffer_revision - resume_revision) + " operations."
+                                     : " with a snapshot.") << std::endl;
+            }
+        }
+        writer_thread = std::thread(client_writer, client_id, conn, outbox);
+
+        std::cout << "User '" << uname << "' connected via " << conn->describe() << "." << std::endl;
 
         // Broadcast to other users that a new user has connected
         json user_event = {
@@ -257,116 +5130,317 @@ void handle_client(int client_fd) {
                 }}
             }}
         };
-        broadcast_message(user_event, client_fd);
+        broadcast_message(user_event, client_id);
 
-        // Continuously listen for messages from the client
+        // Continuously listen for messages from the client. Operations and
+        // cursor updates are scanned in place into a packet kept across
+        // packets; anything else is parsed as JSON.
+        bool discarding = false;    // Skipping the rest of a packet over max_packet_bytes
+        auto session_name = std::make_shared<const std::string>(session_token);
+        ClientPacket packet;
+        std::string packet_type;
+        partial_message.reserve(2 * BUFFER_SIZE);  // A receive and the start of a packet it cut off
         while (server_running) { // Corrected from 'while (running)'
-            n = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+            n = conn->receive(buffer, sizeof(buffer) - 1);
             if (n <= 0) {
                 // Client disconnected
                 break;
             }
             buffer[n] = '\0';
-            std::string recv_str(buffer, n);
-            partial_message += recv_str;
+            limiter->charge_bytes(n);
+            const char* received = buffer;
+            if (discarding) {
+                received = static_cast<const char*>(memchr(buffer, '\n', n));
+                if (!received) continue;
+                received++;
+                discarding = false;
+            }
+            partial_message.append(received, buffer + n - received);
 
-            // Process all complete messages
-            while ((pos = partial_message.find('\n')) != std::string::npos) {
-                std::string message_line = partial_message.substr(0, pos);
-                partial_message.erase(0, pos + 1);
+            // Process all complete messages; the handled ones are dropped once per receive
+            size_t consumed = 0;
+            while ((pos = partial_message.find('\n', consumed)) != std::string::npos) {
+                const char* line_begin = partial_message.data() + consumed;
+                const char* line_end = partial_message.data() + pos;
+                consumed = pos + 1;
 
-                if (message_line.empty()) continue;
+                if (line_begin == line_end) continue;
 
                 try {
-                    json message_json = json::parse(message_line);
+                    json message_json;      // Left null for a scanned packet
+                    if (PacketScanner(std::string_view(line_begin, line_end - line_begin)).scan(packet)) {
+                        packet_type = packet.operation ? "operation" : "update";
+                    }
+                    else {
+                        message_json = json::parse(line_begin, line_end);
+                        // Every packet is an object, and so is its data. A missing data
+                        // becomes empty, so the handlers below never index a null.
+                        auto data_field = message_json.is_object() ? message_json.find("data") : message_json.end();
+                        if (!message_json.is_object() || (data_field != message_json.end() && !data_field->is_object())) {
+                            std::cerr << "Malformed packet from user '" << uname << "': not an object." << std::endl;
+                            continue;
+                        }
+                        if (data_field == message_json.end()) data_field = message_json.emplace("data", json::object()).first;
+                        packet_type = message_json.value("packet_type", std::string());
+                        if (packet_type == "operation" || packet_type == "update") {
+                            read_client_packet(*data_field, packet_type == "operation", packet);
+                        }
+                    }
+                    const json& data = message_json.is_object() ? message_json.at("data") : message_json;
+
                     // Handle different packet types
-                    if (message_json["packet_type"] == "operation") {
+                    if (packet_type == "operation") {
                         // Handle operation-based updates
-                        json data = message_json["data"];
-                        std::string op_type = data["type"];
-                        int x = data["position"]["x"];
-                        int y = data["position"]["y"];
-                        std::string character = data["character"];
+                        LogRecord record = operation_record(packet);
+                        int y = record.y;
 
                         bool valid_operation = false;
+                        limiter->charge_op();
 
                         {
-                            OperationType op = getOperationType(op_type);
-                            std::lock_guard<std::mutex> lock(buffer_mutex);
-                            switch (op){
-                                case OperationType::Insert:
-                                    if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
-                                        shared_buffer[y].insert(shared_buffer[y].begin() + x, character[0]);
-                                        valid_operation = true;
-                                    }
-                                    break;
-
-                                case OperationType::Delete:
-                                    if (y < shared_buffer.size() && x < shared_buffer[y].size()) {
-                                        shared_buffer[y].erase(shared_buffer[y].begin() + x);
-                                        valid_operation = true;
-                                    }
-                                    break;
-
-                                case OperationType::InsertNewline:
-                                    if (y < shared_buffer.size() && x <= shared_buffer[y].size()) {
-                                        std::string new_line = shared_buffer[y].substr(x);
-                                        shared_buffer[y] = shared_buffer[y].substr(0, x);
-                                        shared_buffer.insert(shared_buffer.begin() + y + 1, new_line);
-                                        valid_operation = true;
-                                    }
-                                    break;
-                                
-                                case OperationType::DeleteNewline:
-                                    if (y < shared_buffer.size() && y > 0) {
-                                        int prev_y = y - 1;
-                                        users[client_fd].cursor_x = shared_buffer[prev_y].size();
-                                        shared_buffer[prev_y] += shared_buffer[y];
-                                        shared_buffer.erase(shared_buffer.begin() + y);
-                                        valid_operation = true;
-                                    }
-                                    break;
-
-                                default:
-                                    break;
+                            OperationType op = record.op;
+                            std::lock_guard<FairMutex> lock(buffer_mutex);
+                            {
+                                // A resumed connection has taken this session over; ignore what is left
+                                std::lock_guard<std::mutex> users_lock(users_mutex);
+                                auto user = users.find(client_id);
+                                if (user == users.end()) continue;
+                                if (op == OperationType::DeleteNewline && y > 0 && y < static_cast<int>(shared_buffer.size())) {
+                                    user->second.cursor_x = shared_buffer.line(y - 1).size();
+                                }
+                            }
+                            TextEdit edit;
+                            std::string deleted;
+                            // A replica is read-only; its document only changes through its leader
+                            valid_operation = !following && to_text_edit(shared_buffer, record, edit);
+                            bool over_quota = valid_operation && max_document_bytes > 0 && !edit.text.empty() &&
+                                              shared_buffer.bytes() + edit.text.size() > max_document_bytes;
+                            if (over_quota) {
+                                valid_operation = false;
+                                send_quota_error(*outbox, "The document may not grow past " + std::to_string(max_document_bytes) + " bytes.");
+                            }
+                            if (valid_operation) deleted = apply_text_edit(shared_buffer, edit);
+
+                            uint64_t cseq = packet.cseq;
+                            uint64_t revision = 0;
+                            if (valid_operation) {
+                                // Stamp the operation, broadcast it to other clients and acknowledge it to the sender
+                                revision = ++buffer_revision;
+                                record.revision = revision;
+                                oplog.append(record);
+                                Frame frame = operation_frame(packet, revision);
+                                broadcast_frame(frame, client_id);
+                                publish_to_observers(frame, revision);
+                                replicate_operation(frame, session_token, cseq);
+
+                                // Keep it for clients that drop and resume, and for undo to rebase across
+                                remember_operation({revision, frame, session_name, cseq, shape_of(edit), false});
+                                record_undo(session_token, op, edit, deleted, revision);
                             }
+                            queue_ack(outbox, ack_frame(cseq, revision), revision);
+
+                            std::lock_guard<std::mutex> users_lock(users_mutex);
+                            auto session = sessions.find(session_token);
+                            if (session != sessions.end()) session->second.acked_cseq = std::max(session->second.acked_cseq, cseq);
                         }
 
                         if (valid_operation) {
-                            // Broadcast the operation to other clients
-                            broadcast_message(message_json, client_fd);
-                            std::cout << "Broadcasted operation '" << op_type << "' from user '" << users[client_fd].uname << "'." << std::endl;
+                            std::cout << "Broadcasted operation '" << packet.type << "' from user '" << uname << "'." << std::endl;
                         }
                         else {
-                            std::cerr << "Invalid operation received from user '" << users[client_fd].uname << "'." << std::endl;
+                            std::cerr << "Invalid operation received from user '" << uname << "'." << std::endl;
+                        }
+                    }
+                    else if (packet_type == "undo" || packet_type == "redo") {
+                        // Undo and redo come back to every client, the requester included, as ordinary operations
+                        bool redo = packet_type == "redo";
+                        limiter->charge_op();
+                        bool applied;
+                        {
+                            std::lock_guard<FairMutex> lock(buffer_mutex);
+                            {
+                                std::lock_guard<std::mutex> users_lock(users_mutex);
+                                if (users.find(client_id) == users.end()) continue;
+                            }
+                            applied = !following && apply_undo(session_token, redo);
+                            if (!applied) {
+                                json reply = {
+                                    {"packet_type", "undo_unavailable"},
+                                    {"data", { {"redo", redo} }}
+                                };
+                                enqueue_frame(*outbox, make_frame(reply));
+                            }
+                        }
+                        if (applied) {
+                            std::cout << "Applied " << (redo ? "redo" : "undo") << " for user '" << uname << "'." << std::endl;
                         }
                     }
-                    else if (message_json["packet_type"] == "update") {
+                    else if (packet_type == "update") {
                         // Handle cursor position updates
-                        json data = message_json["data"];
-                        if (data.contains("cursor")) {
-                            int new_x = data["cursor"]["x"];
-                            int new_y = data["cursor"]["y"];
+                        if (packet.has_cursor) {
+                            int new_x = packet.cursor_x;
+                            int new_y = packet.cursor_y;
 
-                            // Update the user's cursor position
-                            {
-                                std::lock_guard<std::mutex> lock(users_mutex);
-                                if (users.find(client_fd) != users.end()) {
-                                    users[client_fd].cursor_x = new_x;
-                                    users[client_fd].cursor_y = new_y;
-                                }
+                            // Record the latest cursor; presence_loop publishes it on the next tick
+                            std::lock_guard<std::mutex> lock(users_mutex);
+                            auto user = users.find(client_id);
+                            if (user != users.end()) {
+                                user->second.cursor_x = new_x;
+                                user->second.cursor_y = new_y;
+                                user->second.cursor_dirty = true;
+                            }
+                        }
+                    }
+                    else if (packet_type == "delta_request" && delta_base) {
+                        // Chunk hashes of the client's stale copy; answered off the lock
+                        size_t chunk_lines = data.value("chunk_lines", size_t(0));
+                        std::vector<uint64_t> chunk_hashes;
+                        bool valid = chunk_lines >= 1 && chunk_lines <= MAPPED_BLOCK_BYTES && data.contains("hashes") &&
+                                     data.at("hashes").is_array() && data.at("hashes").size() <= MAX_DELTA_CHUNKS;
+                        if (valid) {
+                            chunk_hashes.reserve(data.at("hashes").size());
+                            for (const auto& hash : data.at("hashes")) {
+                                if (!(valid = hash.is_number_unsigned())) break;
+                                chunk_hashes.push_back(hash.get<uint64_t>());
                             }
+                        }
 
-                            // Broadcast the cursor update to all other clients
-                            json cursor_update = {
-                                {"packet_type", "update"},
-                                {"data", {
-                                    {"name", users[client_fd].uname},
-                                    {"cursor", { {"x", new_x}, {"y", new_y} }}
-                                }}
+                        if (valid) {
+                            size_t copied_lines = 0;
+                            auto start = std::chrono::steady_clock::now();
+                            std::string ops = encode_delta(*delta_base, chunk_lines, chunk_hashes, copied_lines);
+                            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+                            enqueue_frame(*outbox, delta_frame(delta_base->revision, ops), Lane::Bulk);
+                            std::cout << "Sent '" << uname << "' a delta of " << ops.size() << " bytes reusing "
+                                      << copied_lines << " of " << delta_base->line_count << " lines (" << elapsed.count() << " ms)." << std::endl;
+                        }
+                        else {
+                            // Not something we can diff against; send the whole document
+                            std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+                            std::lock_guard<std::mutex> users_lock(users_mutex);
+                            queue_snapshot(*outbox, snapshot_message("resync", client_id));
+                        }
+                        delta_base.reset();
+                    }
+                    else if ((packet_type == "tree_request" || packet_type == "history_read") &&
+                             over_outbound_quota(*outbox)) {
+                        // Replies would pile up behind what the client has not read yet
+                        send_quota_error(*outbox, "Too much is still queued for you; read it before asking for more.");
+                    }
+                    else if (packet_type == "tree_request") {
+                        // A diverged client descends the tree of a root it was sent: each
+                        // inner node is answered with its two halves, each block with its lines
+                        auto tree = find_merkle_tree(data.value("revision", uint64_t(0)));
+                        json nodes = json::array();
+                        bool valid = tree && data.contains("nodes") && data.at("nodes").is_array() &&
+                                     data.at("nodes").size() <= MAX_TREE_NODES;
+                        for (size_t i = 0; valid && i < data.at("nodes").size(); ++i) {
+                            const json& node = data.at("nodes").at(i);
+                            if (!(valid = node.is_array() && node.size() == 2 && node[0].is_number_unsigned() && node[1].is_number_unsigned())) break;
+                            size_t lo = node[0], hi = node[1];
+                            if (!(valid = lo < hi && hi <= tree->blocks())) break;
+                            if (hi - lo == 1) {
+                                nodes.push_back(tree->node(lo, hi, true));
+                            }
+                            else {
+                                size_t mid = lo + (hi - lo) / 2;
+                                nodes.push_back(tree->node(lo, mid, false));
+                                nodes.push_back(tree->node(mid, hi, false));
+                            }
+                        }
+
+                        if (valid) {
+                            tree_requests += data.at("nodes").size();
+                            json reply = {
+                                {"packet_type", "tree_nodes"},
+                                {"data", { {"revision", tree->snapshot.revision}, {"nodes", nodes} }}
                             };
-                            broadcast_message(cursor_update, client_fd);
+                            enqueue_frame(*outbox, make_frame(reply), Lane::Bulk);
+                        }
+                        else {
+                            // The tree has been replaced since; send the whole document
+                            std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+                            std::lock_guard<std::mutex> users_lock(users_mutex);
+                            queue_snapshot(*outbox, snapshot_message("resync", client_id));
+                        }
+                    }
+                    else if (packet_type == "history_read") {
+                        // Lines of a past revision, given directly or as a Unix time in ms.
+                        // Answered on the bulk lane so live edits are not held up behind it.
+                        limiter->charge_op();
+                        uint64_t revision = data.value("revision", uint64_t(0));
+                        size_t start = data.value("start", size_t(0));
+                        size_t count = std::min(data.value("count", MAX_HISTORY_LINES), MAX_HISTORY_LINES);
+                        json lines = json::array();
+                        size_t line_count = 0;
+                        std::string error;
+                        bool found = true;
+                        if (data.contains("time") && !data.at("time").is_number_unsigned()) {
+                            found = false;
+                            error = "The time must be a Unix time in ms.";
+                        }
+                        else if (data.contains("time")) {
+                            oplog.flush(FsyncPolicy::Never, 0);
+                            found = oplog.revision_at(data.at("time").get<uint64_t>(), revision);
+                            if (!found) error = "History no longer reaches back to that time.";
+                        }
+                        json reply_data = { {"revision", revision} };
+                        if (data.contains("time")) reply_data["time"] = data.at("time");
+                        if (found && read_past_lines(revision, start, count, lines, line_count, error)) {
+                            reply_data["start"] = start;
+                            reply_data["line_count"] = line_count;
+                            reply_data["lines"] = std::move(lines);
+                        }
+                        else {
+                            reply_data["error"] = error;
                         }
+                        json reply = {
+                            {"packet_type", reply_data.contains("error") ? "history_unavailable" : "history_lines"},
+                            {"data", reply_data}
+                        };
+                        enqueue_frame(*outbox, make_frame(reply), Lane::Bulk);
+                    }
+                    else if (packet_type == "stats") {
+                        // Report per-client limits, throttling state and storage statistics to the requester
+                        json document_stats;
+                        {
+                            std::lock_guard<FairMutex> lock(buffer_mutex);
+                            document_stats = shared_buffer.stats();
+                        }
+                        json stats_msg = {
+                            {"packet_type", "message"},
+                            {"data", {
+                                {"message_type", "stats"},
+                                {"clients", client_stats()},
+                                {"document", document_stats},
+                                {"join", {
+                                    {"streams_built", streams_built.load()},
+                                    {"streams_reused", streams_reused.load()},
+                                    {"blocks_encoded", blocks_encoded.load()}
+                                }},
+                                {"oplog", oplog.stats()},
+                                {"merkle", {
+                                    {"build_us", tree_build_us.load()},
+                                    {"requests", tree_requests.load()}
+                                }},
+                                {"replication", replication_stats()},
+                                {"observers", observer_stats()},
+                                {"memory", memory_stats()},
+                                {"history", {
+                                    {"reads", history_reads.load()},
+                                    {"replayed", history_replayed.load()},
+                                    {"last_ms", history_read_ms.load()}
+                                }},
+                                {"checkpoint", {
+                                    {"revision", checkpoint_revision.load()},
+                                    {"ms", checkpoint_ms.load()},
+                                    {"bytes", checkpoint_bytes.load()},
+                                    {"snapshot_us", snapshot_us.load()},
+                                    {"snapshot_extra_bytes", snapshot_extra_bytes.load()}
+                                }}
+                            }}
+                        };
+                        enqueue_frame(*outbox, make_frame(stats_msg));
                     }
                     // Handle other packet types as needed
                 }
@@ -374,49 +5448,812 @@ void handle_client(int client_fd) {
                     std::cerr << "JSON parse error: " << e.what() << std::endl;
                     // Optionally send an error message to the client
                 }
+                catch (json::exception& e) {
+                    // A field of the wrong type or shape; drop the packet, not the server
+                    std::cerr << "Malformed packet from user '" << uname << "': " << e.what() << std::endl;
+                }
+            }
+            partial_message.erase(0, consumed);
+
+            // A packet over its quota is dropped as it arrives rather than
+            // buffered whole; the connection carries on after its newline
+            if (partial_message.size() > max_packet_bytes) {
+                std::cerr << "Packet from user '" << uname << "' is over " << max_packet_bytes << " bytes; discarding it." << std::endl;
+                partial_message.clear();
+                discarding = true;
+                send_quota_error(*outbox, "Packet over " + std::to_string(max_packet_bytes) + " bytes discarded.");
+            }
+            // Give back the memory of a large packet once it has been handled
+            if (partial_message.capacity() > 4 * BUFFER_SIZE && partial_message.size() <= BUFFER_SIZE) {
+                partial_message.shrink_to_fit();
             }
+            limiter->buffered_bytes = string_heap_bytes(partial_message);
         }
 
     } catch (json::parse_error& e) {
         std::cerr << "JSON parse error during username handling: " << e.what() << std::endl;
-        close(client_fd);
         return;
+    } catch (json::exception& e) {
+        // A hello field of the wrong type; whatever was set up is released below
+        std::cerr << "Malformed hello from " << conn->describe() << ": " << e.what() << std::endl;
     }
 
     // Client has disconnected
     std::string uname;
+    bool taken_over = true;
     {
         std::lock_guard<std::mutex> lock(users_mutex);
-        if (users.find(client_fd) != users.end()) {
-            uname = users[client_fd].uname;
-            users.erase(client_fd);
+        if (users.find(client_id) != users.end()) {
+            uname = users[client_id].uname;
+            taken_over = false;
+            udp_sessions.erase(users[client_id].udp_token);
+
+            // Keep the session resumable for a while
+            auto session = sessions.find(users[client_id].session);
+            if (session != sessions.end() && session->second.client_id == client_id) {
+                session->second.client_id = -1;
+                session->second.detached_at = std::chrono::steady_clock::now();
+            }
+            users.erase(client_id);
         }
     }
 
-    std::cout << "User '" << uname << "' disconnected." << std::endl;
+    if (!taken_over) {
+        std::cout << "User '" << uname << "' disconnected." << std::endl;
 
-    // Broadcast to other users that a user has disconnected
-    json disconnect_event = {
-        {"packet_type", "user_event"},
-        {"data", {
-            {"event", "user_disconnected"},
-            {"user", {
-                {"name", uname}
+        // Broadcast to other users that a user has disconnected
+        json disconnect_event = {
+            {"packet_type", "user_event"},
+            {"data", {
+                {"event", "user_disconnected"},
+                {"user", {
+                    {"name", uname}
+                }}
             }}
-        }}
+        };
+        broadcast_message(disconnect_event, client_id);
+    }
+
+    // Stop the writer before the connection is released
+    if (outbox) {
+        {
+            std::lock_guard<std::mutex> lock(outbox->mutex);
+            outbox->closed = true;
+        }
+        outbox->cv.notify_one();
+    }
+    if (writer_thread.joinable()) writer_thread.join();
+
+}
+
+// Function to hash the document, for checking recovery results
+size_t document_hash() {
+    size_t hash = shared_buffer.size();
+    shared_buffer.for_each_line([&hash](std::string_view line) { hash = hash * 1000003 ^ std::hash<std::string_view>()(line); });
+    return hash;
+}
+
+// Function to fill the document with mb megabytes of random 63-character lines
+size_t make_bench_document(int mb, std::mt19937_64& rng) {
+    size_t line_count = static_cast<size_t>(mb) * 1024 * 1024 / 64;
+    std::vector<std::string> lines(line_count, std::string(63, ' '));
+    for (std::string& line : lines) {
+        for (char& c : line) c = static_cast<char>('a' + rng() % 26);
+    }
+    shared_buffer.assign(std::move(lines));
+    buffer_revision = 0;
+    return line_count;
+}
+
+// Function to measure join throughput: bench_joiners clients join a document
+// at a given rate while one user types 100 operations per second. Each joiner
+// takes its snapshot as handle_client does and pulls every chunk frame, as its
+// writer would, so the network is left out. Runs with and without the
+// snapshot cache for several document sizes and join rates; without it every
+// joiner encodes the whole document, so those runs are capped at 20 joiners.
+bool run_join_benchmark() {
+    std::mt19937_64 rng(42);
+    std::vector<int> sizes = {std::max(1, bench_mb / 25), std::max(1, bench_mb / 5), bench_mb};
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    std::cout << "size_mb  join_rate  cache  joins  joins_per_s  p50_ms  p99_ms  blocks_encoded" << std::endl;
+    for (int mb : sizes) {
+        for (int rate : {20, 100, 0}) {            // Joins per second; 0 means all at once
+            for (bool cache : {false, true}) {
+                make_bench_document(mb, rng);      // Starts with no encoded blocks
+                snapshot_cache = cache;
+                shared_stream.reset();
+                int joins = cache ? bench_joiners : std::min(bench_joiners, 20);
+                uint64_t encoded_before = blocks_encoded;
+                std::atomic<bool> typing(true);
+                std::thread typist([&typing] {
+                    std::mt19937_64 typist_rng(7);
+                    while (typing) {
+                        {
+                            std::lock_guard<FairMutex> lock(buffer_mutex);
+                            int y = static_cast<int>(typist_rng() % shared_buffer.size());
+                            if (apply_operation(OperationType::Insert, 0, y, 'x')) buffer_revision++;
+                        }
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    }
+                });
+
+                std::vector<double> latencies(joins);
+                std::vector<std::thread> joiners;
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < joins; ++i) {
+                    auto arrival = start + (rate > 0 ? std::chrono::microseconds(1000000LL * i / rate) : std::chrono::microseconds(0));
+                    joiners.emplace_back([&latencies, i, arrival] {
+                        std::this_thread::sleep_until(arrival);
+                        auto joined = std::chrono::steady_clock::now();
+                        Outbox outbox;
+                        {
+                            std::lock_guard<FairMutex> buffer_lock(buffer_mutex);
+                            std::lock_guard<std::mutex> users_lock(users_mutex);
+                            queue_snapshot(outbox, snapshot_message("connect_success", -1));
+                        }
+                        size_t bytes = 0;
+                        for (size_t c = 0; c < outbox.stream->size(); ++c) {
+                            bytes += outbox.stream->head(c).size() + outbox.stream->lines(c)->size();
+                        }
+                        latencies[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - joined).count();
+                    });
+                }
+                for (std::thread& joiner : joiners) joiner.join();
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                typing = false;
+                typist.join();
+
+                std::sort(latencies.begin(), latencies.end());
+                std::cout << std::setw(7) << mb << "  " << std::setw(9) << (rate > 0 ? std::to_string(rate) + "/s" : "burst")
+                          << "  " << std::setw(5) << (cache ? "on" : "off") << "  " << std::setw(5) << joins << "  "
+                          << std::setw(11) << std::fixed << std::setprecision(1) << joins / elapsed << "  " << std::setw(6)
+                          << latencies[latencies.size() / 2] << "  " << std::setw(6) << latencies[latencies.size() * 99 / 100]
+                          << "  " << std::setw(14) << blocks_encoded - encoded_before << std::endl;
+            }
+        }
+    }
+    snapshot_cache = true;
+    return true;
+}
+
+// Function to measure delta resync against a full snapshot. A client copy of
+// a bench_mb document goes stale while a fraction of its lines are edited by
+// typing, line splits and joins (which shift every line below them). The
+// client then hashes its copy in chunks and the server answers with a delta,
+// as handle_client does. Reports bytes each way, CPU time on both sides and
+// whether the rebuilt copy matches the document.
+bool run_delta_benchmark() {
+    std::mt19937_64 rng(42);
+    auto ms_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto edit = [&rng](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            int y = static_cast<int>(rng() % shared_buffer.size());
+            int x = static_cast<int>(rng() % (shared_buffer.line(y).size() + 1));
+            OperationType op = OperationType::Insert;
+            switch (rng() % 4) {
+                case 0: op = OperationType::InsertNewline; break;
+                case 1: op = OperationType::DeleteNewline; break;
+            }
+            if (apply_operation(op, x, y, static_cast<char>('A' + rng() % 26))) buffer_revision++;
+        }
+    };
+
+    std::cout << "chunk_lines  edited  full_bytes  request_bytes  delta_bytes  saved  client_hash_ms  delta_cold_ms  delta_warm_ms  full_encode_ms  rebuild_ms  ok" << std::endl;
+    for (size_t chunk_lines : {16, 64}) {
+        for (double fraction : {0.0001, 0.001, 0.01}) {
+            size_t line_count = make_bench_document(bench_mb, rng);
+            std::vector<std::string> copy;
+            copy.reserve(line_count);
+            shared_buffer.for_each_line([&copy](std::string_view line) { copy.emplace_back(line); });
+            edit(std::max<size_t>(1, line_count * fraction));
+
+            // Client: hash whole chunks of the stale copy
+            auto start = std::chrono::steady_clock::now();
+            std::vector<uint64_t> chunk_hashes;
+            for (size_t first = 0; first + chunk_lines <= copy.size(); first += chunk_lines) {
+                uint64_t hash = 0;
+                for (size_t i = first; i < first + chunk_lines; ++i) hash = hash * HASH_BASE + line_hash(copy[i]);
+                chunk_hashes.push_back(hash);
+            }
+            double client_hash_ms = ms_since(start);
+            json request = {
+                {"packet_type", "delta_request"},
+                {"data", { {"chunk_lines", chunk_lines}, {"hashes", chunk_hashes} }}
+            };
+            size_t request_bytes = request.dump().size() + 1;
+
+            // Server: the first delta hashes every line; a later one only the blocks edited since
+            DocumentSnapshot snapshot = shared_buffer.snapshot(buffer_revision);
+            size_t copied_lines = 0;
+            start = std::chrono::steady_clock::now();
+            Frame delta = delta_frame(snapshot.revision, encode_delta(snapshot, chunk_lines, chunk_hashes, copied_lines));
+            double delta_cold_ms = ms_since(start);
+
+            // Full snapshot for comparison, encoded from scratch
+            start = std::chrono::steady_clock::now();
+            SnapshotStream stream(snapshot, false);
+            size_t full_bytes = 0;
+            for (size_t c = 0; c < stream.size(); ++c) {
+                full_bytes += stream.head(c).size() + stream.lines(c)->size() + strlen(SnapshotStream::CHUNK_TAIL);
+            }
+            double full_encode_ms = ms_since(start);
+
+            // Client: rebuild the document from its copy and the delta
+            start = std::chrono::steady_clock::now();
+            json packet = json::parse(*delta);
+            std::vector<std::string> rebuilt;
+            rebuilt.reserve(snapshot.line_count);
+            for (const auto& element : packet["data"]["ops"]) {
+                if (element.is_string()) {
+                    rebuilt.push_back(element);
+                    continue;
+                }
+                size_t first = element[0].get<size_t>() * chunk_lines;
+                size_t count = element[1].get<size_t>() * chunk_lines;
+                rebuilt.insert(rebuilt.end(), copy.begin() + first, copy.begin() + first + count);
+            }
+            double rebuild_ms = ms_since(start);
+            bool ok = rebuilt.size() == snapshot.line_count;
+            size_t y = 0;
+            snapshot.for_each_line([&](std::string_view line) { ok = ok && y < rebuilt.size() && rebuilt[y++] == line; });
+
+            edit(100);
+            snapshot = shared_buffer.snapshot(buffer_revision);
+            start = std::chrono::steady_clock::now();
+            encode_delta(snapshot, chunk_lines, chunk_hashes, copied_lines);
+            double delta_warm_ms = ms_since(start);
+
+            std::cout << std::setw(11) << chunk_lines << "  " << std::setw(5) << std::fixed << std::setprecision(2)
+                      << fraction * 100 << "%  " << std::setw(10) << full_bytes << "  " << std::setw(13) << request_bytes
+                      << "  " << std::setw(11) << delta->size() << "  " << std::setw(4) << std::setprecision(0)
+                      << 100.0 - 100.0 * (request_bytes + delta->size()) / full_bytes << "%  " << std::setprecision(1)
+                      << std::setw(14) << client_hash_ms << "  " << std::setw(13) << delta_cold_ms << "  " << std::setw(13)
+                      << delta_warm_ms << "  " << std::setw(14) << full_encode_ms << "  " << std::setw(10) << rebuild_ms
+                      << "  " << (ok ? "yes" : "NO") << std::endl;
+            if (!ok) return false;
+        }
+    }
+    return true;
+}
+
+// Function to measure startup recovery: a bench_mb document edited bench_ops
+// times under the configured checkpoint policy, in <data-dir>/bench-recovery.
+// --checkpoint-ops 0 gives the worst case of replaying every edit.
+bool run_recovery_benchmark() {
+    data_dir += "/bench-recovery";
+    mkdir(data_dir.c_str(), 0755);
+    for (const char* prefix : {"checkpoint-", "wal-"}) {
+        for (const auto& file : list_data_files(data_dir, prefix)) unlink((data_dir + "/" + file.second).c_str());
+    }
+    auto ms_since = [](std::chrono::steady_clock::time_point from) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - from).count();
+    };
+
+    // A document of 63-character lines, checkpointed at revision 0
+    std::mt19937_64 rng(42);
+    auto start = std::chrono::steady_clock::now();
+    size_t line_count = make_bench_document(bench_mb, rng);
+    uint64_t bytes = 0;
+    if (!write_checkpoint(shared_buffer.snapshot(0), bytes) || !oplog.open(data_dir, 0, [](const LogRecord&) {})) return false;
+    std::cout << "Generated " << bench_mb << " MB document (" << line_count << " lines) in " << ms_since(start) << " ms." << std::endl;
+
+    // Random edits: mostly typing, with some line splits and joins
+    auto random_edit = [&rng](size_t near_line = SIZE_MAX) {
+        size_t y = near_line == SIZE_MAX ? rng() % shared_buffer.size() : std::min(near_line + rng() % 8, shared_buffer.size() - 1);
+        LogRecord edit{0, OperationType::Insert, 0, static_cast<int>(y), '\0'};
+        int length = static_cast<int>(shared_buffer.line(edit.y).size());
+        int roll = static_cast<int>(rng() % 100);
+        edit.op = roll < 70 ? OperationType::Insert : roll < 98 ? OperationType::Delete
+                : roll == 98 ? OperationType::InsertNewline : OperationType::DeleteNewline;
+        edit.x = static_cast<int>(rng() % (length + 1));
+        if (edit.op == OperationType::Delete && length == 0) edit.op = OperationType::Insert;
+        if (edit.op == OperationType::Delete) edit.x = std::min(edit.x, length - 1);
+        edit.character = static_cast<char>('a' + rng() % 26);
+        return edit;
+    };
+
+    // A day of edits, group-committed every 100 operations
+    start = std::chrono::steady_clock::now();
+    uint64_t checkpoints = 0;
+    for (uint64_t i = 0; i < bench_ops; ++i) {
+        LogRecord edit = random_edit();
+        if (!apply_operation(edit.op, edit.x, edit.y, edit.character)) continue;
+        edit.revision = ++buffer_revision;
+        oplog.append(edit);
+        if (i % 100 == 99) oplog.flush(FsyncPolicy::Never, 0);
+        if (checkpoint_ops > 0 && buffer_revision - checkpoint_revision >= checkpoint_ops) {
+            oplog.flush(FsyncPolicy::Never, 0);
+            checkpoint_document();
+            checkpoints++;
+        }
+    }
+    oplog.close_log();
+    uint64_t final_revision = buffer_revision;
+    size_t expected = document_hash();
+    std::cout << "Applied " << final_revision << " operations with " << checkpoints << " checkpoints in "
+              << ms_since(start) << " ms." << std::endl;
+
+    // Recovery as at startup: newest checkpoint plus the tail
+    start = std::chrono::steady_clock::now();
+    bool ok = recover_document() && buffer_revision == final_revision && document_hash() == expected;
+    oplog.close_log();
+    std::cout << "Recovery from checkpoint + tail: " << ms_since(start) << " ms" << (ok ? "" : " (MISMATCH)") << "." << std::endl;
+
+    // Recovery after a crash mid-write: a torn frame at the end of the tail
+    std::string tail = data_dir + "/" + list_data_files(data_dir, "wal-").back().second;
+    int fd = ::open(tail.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    std::string torn;
+    put_u32(torn, OpLog::MAGIC);
+    put_u32(torn, 4096);
+    torn += "partial frame";
+    ok = fd >= 0 && write_fully(fd, torn.data(), torn.size()) && ok;
+    if (fd >= 0) ::close(fd);
+    start = std::chrono::steady_clock::now();
+    ok = recover_document() && buffer_revision == final_revision && document_hash() == expected && ok;
+    oplog.close_log();
+    std::cout << "Recovery with a torn tail: " << ms_since(start) << " ms" << (ok ? "" : " (MISMATCH)") << "." << std::endl;
+
+    // A checkpoint's snapshot, and what 20 people typing cost while one is held
+    std::vector<size_t> typists(20);
+    for (size_t& line : typists) line = rng() % shared_buffer.size();
+    auto snap_start = std::chrono::steady_clock::now();
+    DocumentSnapshot held = shared_buffer.snapshot(buffer_revision);
+    auto snap_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - snap_start).count();
+    uint64_t cloned_before = shared_buffer.cloned_bytes();
+    for (int i = 0; i < 10000; ++i) {
+        LogRecord edit = random_edit(typists[i % typists.size()]);
+        apply_operation(edit.op, edit.x, edit.y, edit.character);
+    }
+    std::cout << "Snapshot of " << held.blocks.size() << " blocks: " << snap_us << " us; 10000 edits by "
+              << typists.size() << " typists while it was held copied " << (shared_buffer.cloned_bytes() - cloned_before) / 1024
+              << " KB of blocks." << std::endl;
+
+    return ok;
+}
+
+// Function to measure how evenly the hash ring spreads documents over nodes,
+// and what fraction of them move when a node joins or leaves. Ideally each of
+// N nodes holds 1/N of the documents and a change moves 1/N of them.
+bool run_ring_benchmark() {
+    const size_t document_count = 100000;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < document_count; ++i) names.push_back("doc-" + std::to_string(i));
+    auto nodes_of = [](size_t count) {
+        std::vector<std::string> nodes;
+        for (size_t i = 0; i < count; ++i) nodes.push_back("127.0.0.1:" + std::to_string(9000 + i));
+        return nodes;
     };
-    broadcast_message(disconnect_event, client_fd);
 
-    close(client_fd);
+    std::cout << "Hash ring, " << document_count << " documents, " << ring_vnodes << " points per node\n"
+              << "change   nodes  min share  max share  moved  ideal  lookup ns" << std::endl;
+    for (size_t count : {3, 5, 10}) {
+        HashRing before(nodes_of(count), ring_vnodes);
+        for (int change : {+1, -1}) {
+            HashRing after(nodes_of(count + change), ring_vnodes);
+            std::map<std::string, size_t> load;
+            size_t moved = 0;
+            for (const std::string& name : names) {
+                const std::string& owner = after.owner(name);
+                load[owner]++;
+                if (owner != before.owner(name)) moved++;
+            }
+            size_t checksum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (const std::string& name : names) checksum += after.owner(name).size();
+            double lookup_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+                               / document_count;
+            if (checksum == 0) return false;
+            auto [least, most] = std::minmax_element(load.begin(), load.end(),
+                                                     [](const auto& a, const auto& b) { return a.second < b.second; });
+            double fair = double(document_count) / (count + change);
+            std::cout << (change > 0 ? "join " : "leave") << "  " << std::setw(3) << count << "->" << std::setw(2)
+                      << count + change << "  " << std::fixed << std::setprecision(2) << std::setw(9)
+                      << least->second / fair << "  " << std::setw(9) << most->second / fair << "  " << std::setprecision(1)
+                      << std::setw(4) << 100.0 * moved / document_count << "%  " << std::setw(4)
+                      << 100.0 / (change > 0 ? count + 1 : count) << "%  " << std::setw(9) << lookup_ns << std::endl;
+        }
+    }
+    return true;
+}
+
+// Function to count heap allocations while clients type steadily. Each typist
+// is served by handle_client over a socket pair, as a real client would be,
+// with the log flusher, presence ticks and observer fan-out running;
+// checkpoints and root broadcasts are left out. The first phase fills the
+// operation history and every pool; the second is the steady state, which
+// must not allocate at all.
+bool run_alloc_benchmark() {
+#ifndef BENCH_ALLOC
+    std::cerr << "This build does not count allocations; build it with make bench (-DBENCH_ALLOC)." << std::endl;
+    return false;
+#endif
+    data_dir += "/bench-alloc";
+    mkdir(data_dir.c_str(), 0755);
+    for (const char* prefix : {"checkpoint-", "wal-"}) {
+        for (const auto& file : list_data_files(data_dir, prefix)) unlink((data_dir + "/" + file.second).c_str());
+    }
+    if (!recover_document()) return false;
+    const int typists = 4;
+    shared_buffer.assign(std::vector<std::string>(typists));     // A line for each typist
+    ops_per_sec = bytes_per_sec = 1e9;
+    checkpoint_ops = 0;
+    std::thread flusher_thread(oplog_flusher);
+    flusher_thread.detach();
+    std::thread presence_thread(presence_loop);
+    presence_thread.detach();
+    std::thread observer_thread(observer_loop);
+    observer_thread.detach();
+
+    // Typists read with a fixed buffer and count acks; nothing on their side allocates
+    const uint64_t ops = std::max<uint64_t>(history_ops, 5000);
+    const uint64_t window = 32;         // Keystrokes a typist sends ahead of its acks
+    std::vector<int> fds(typists);
+    std::vector<std::atomic<uint64_t>> acks(typists);
+    std::vector<std::thread> readers;
+    std::streambuf* output = std::cout.rdbuf(nullptr);     // handle_client logs every operation
+    for (int i = 0; i < typists; ++i) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) return false;
+        fds[i] = pair[1];
+        std::thread(handle_client, std::allocate_shared<SocketConnection>(SlabAllocator<SocketConnection>(), pair[0], "bench", false), i).detach();
+        std::string hello = "{\"name\":\"typist" + std::to_string(i) + "\",\"udp\":false}\n";
+        write_fully(fds[i], hello.data(), hello.size());
+        readers.emplace_back([fd = fds[i], &count = acks[i]] {
+            static const char pattern[] = "\"packet_type\":\"ack\"";
+            const size_t length = sizeof(pattern) - 1;
+            char buffer[65536];
+            size_t kept = 0;
+            ssize_t n;
+            while ((n = read(fd, buffer + kept, sizeof(buffer) - kept)) > 0) {
+                size_t end = kept + n;
+                for (const char* p = buffer; (p = static_cast<const char*>(memmem(p, buffer + end - p, pattern, length))); p += length) count++;
+                kept = std::min(end, length - 1);
+                memmove(buffer, buffer + end - kept, kept);
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::cerr << "phase    ops_per_typist  typists  allocations  per_op  ops_per_s" << std::endl;
+    uint64_t sent = 0;
+    uint64_t allocations = 0;
+    for (const char* phase : {"warm-up", "steady"}) {
+        heap_allocations = 0;
+        count_allocations = true;
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t k = 0; k < ops; ++k) {
+            sent++;
+            for (int i = 0; i < typists; ++i) {
+                // Typists stay a few keystrokes ahead of their acks, so the
+                // server is measured keeping up rather than queueing a backlog
+                while (sent - acks[i] > window) std::this_thread::sleep_for(std::chrono::microseconds(100));
+                // Each keystroke is an operation and the cursor update that follows it, as
+                // the client writes them. Typists insert a character and then delete it,
+                // so the document stays the same size.
+                char op[256];
+                int length = snprintf(op, sizeof(op), "{\"data\":{\"character\":\"%c\",\"cseq\":%llu,\"position\":{\"x\":0,\"y\":%d},"
+                                      "\"type\":\"%s\"},\"packet_type\":\"operation\"}\n"
+                                      "{\"data\":{\"cursor\":{\"x\":%d,\"y\":%d}},\"packet_type\":\"update\"}\n",
+                                      'a' + i, static_cast<unsigned long long>(sent), i, sent % 2 ? "insert" : "delete",
+                                      sent % 2 ? 1 : 0, i);
+                write_fully(fds[i], op, length);
+            }
+        }
+        for (int i = 0; i < typists; ++i) {
+            while (acks[i] < sent) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        count_allocations = false;
+        allocations = heap_allocations;
+        std::cerr << std::left << std::setw(9) << phase << std::right << std::setw(14) << ops << "  " << std::setw(7) << typists
+                  << "  " << std::setw(11) << allocations << "  " << std::setw(6) << std::fixed << std::setprecision(2)
+                  << double(allocations) / (ops * typists) << "  " << std::setw(9) << std::setprecision(0)
+                  << ops * typists / elapsed << std::endl;
+    }
+
+    for (int fd : fds) shutdown(fd, SHUT_RDWR);
+    for (std::thread& reader : readers) reader.join();
+    std::cout.rdbuf(output);
+    std::cout.clear();
+    if (allocations > 0) {
+        std::cerr << "The steady state made " << allocations << " heap allocations; it should make none." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Function to print command line usage
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [port] [options]\n"
+              << "  --unix PATH         AF_UNIX socket path (default /tmp/np_server_<port>.sock)\n"
+              << "  --no-unix           Do not listen on an AF_UNIX socket\n"
+              << "  --ops-per-sec N     Per-client operation rate limit (default " << OPS_PER_SEC << ")\n"
+              << "  --bytes-per-sec N   Per-client inbound byte rate limit (default " << BYTES_PER_SEC << ")\n"
+              << "  --open FILE         Initial document contents, mapped rather than read\n"
+              << "  --data-dir DIR      Directory for checkpoints and the operation log (default data)\n"
+              << "  --fsync POLICY      never, interval or always (default interval)\n"
+              << "  --flush-ms N        Group commit interval in ms (default " << FLUSH_MS << ")\n"
+              << "  --fsync-ms N        fsync interval in ms for --fsync interval (default " << FSYNC_MS << ")\n"
+              << "  --checkpoint-ops N  Operations between checkpoints, 0 to disable (default " << CHECKPOINT_OPS << ")\n"
+              << "  --checkpoint-secs N Seconds between checkpoints, 0 to disable (default " << CHECKPOINT_SECS << ")\n"
+              << "  --history-ops N     Recent operations kept for resuming clients (default " << HISTORY_OPS << ")\n"
+              << "  --keyframes N       Checkpoints kept for history reads, at least " << CHECKPOINTS_KEPT << " (default " << HISTORY_KEYFRAMES << ")\n"
+              << "  --session-ttl N     Seconds a dropped session can be resumed (default " << SESSION_TTL_SECS << ")\n"
+              << "  --tree-secs N       Seconds between Merkle root broadcasts, 0 to disable (default " << TREE_SECS << ")\n"
+              << "  --follow HOST:PORT  Run as a read-only replica of the server at HOST:PORT\n"
+              << "  --sync-replicas N   Followers that must apply an edit before it is acked (default 0, asynchronous)\n"
+              << "  --failover-ms N     Leader silence before a follower takes over, 0 to never (default " << FAILOVER_MS << ")\n"
+              << "  --relay HOST:PORT   Fan the document at HOST:PORT out to viewers, storing nothing\n"
+              << "  --peer-secret-file FILE  Secret the servers of a cluster share (default: trust this host only)\n"
+              << "  --ring HOST:PORT,...  Route documents over these nodes; each runs in a process of its own\n"
+              << "  --node HOST:PORT    This node's address on the ring (default 127.0.0.1:<port>)\n"
+              << "  --vnodes N          Points per node on the ring (default " << RING_VNODES << ")\n"
+              << "  --document NAME     Serve only the named document (set by a routing node)\n"
+              << "  --bench-ring        Measure how the ring spreads documents and how many move, then exit\n"
+              << "  --bench-alloc       Count heap allocations while clients type steadily, then exit (make bench)\n"
+              << "  --bench-recovery    Measure startup recovery time and exit (--bench-mb, --bench-ops)\n"
+              << "  --bench-join        Measure join throughput and exit (--bench-mb, --bench-joiners)\n"
+              << "  --bench-delta       Compare delta resync with a full snapshot and exit (--bench-mb)\n";
+}
+
+// Function to parse command line arguments into the server settings
+bool parse_arguments(int argc, char* argv[]) {
+    bool unix_enabled = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        int first = i;
+        if (arg == "--unix" && i + 1 < argc) {
+            unix_socket_path = argv[++i];
+        }
+        else if (arg == "--no-unix") {
+            unix_enabled = false;
+        }
+        else if (arg == "--ops-per-sec" && i + 1 < argc) {
+            ops_per_sec = std::stod(argv[++i]);
+        }
+        else if (arg == "--bytes-per-sec" && i + 1 < argc) {
+            bytes_per_sec = std::stod(argv[++i]);
+        }
+        else if (arg == "--open" && i + 1 < argc) {
+            open_path = argv[++i];
+        }
+        else if (arg == "--data-dir" && i + 1 < argc) {
+            data_dir = argv[++i];
+        }
+        else if (arg == "--fsync" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "never") fsync_policy = FsyncPolicy::Never;
+            else if (policy == "interval") fsync_policy = FsyncPolicy::Interval;
+            else if (policy == "always") fsync_policy = FsyncPolicy::Always;
+            else return false;
+        }
+        else if (arg == "--flush-ms" && i + 1 < argc) {
+            flush_ms = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--fsync-ms" && i + 1 < argc) {
+            fsync_ms = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--checkpoint-ops" && i + 1 < argc) {
+            checkpoint_ops = std::stoull(argv[++i]);
+        }
+        else if (arg == "--checkpoint-secs" && i + 1 < argc) {
+            checkpoint_secs = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--history-ops" && i + 1 < argc) {
+            history_ops = std::stoull(argv[++i]);
+        }
+        else if (arg == "--keyframes" && i + 1 < argc) {
+            keyframes_kept = std::max<size_t>(CHECKPOINTS_KEPT, std::stoull(argv[++i]));
+        }
+        else if (arg == "--session-ttl" && i + 1 < argc) {
+            session_ttl_secs = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--tree-secs" && i + 1 < argc) {
+            tree_secs = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--follow" && i + 1 < argc) {
+            follow_address = argv[++i];
+            if (follow_address.find(':') == std::string::npos) return false;
+            following = true;
+        }
+        else if (arg == "--sync-replicas" && i + 1 < argc) {
+            sync_replicas = std::stoull(argv[++i]);
+        }
+        else if (arg == "--relay" && i + 1 < argc) {
+            follow_address = argv[++i];
+            if (follow_address.find(':') == std::string::npos) return false;
+            following = true;
+            relay = true;
+        }
+        else if (arg == "--peer-secret-file" && i + 1 < argc) {
+            if (!read_file(argv[++i], peer_secret)) return false;
+            peer_secret.erase(peer_secret.find_last_not_of(" \t\r\n") + 1);
+            if (peer_secret.empty()) return false;
+        }
+        else if (arg == "--failover-ms" && i + 1 < argc) {
+            failover_ms = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--ring" && i + 1 < argc) {
+            std::istringstream nodes(argv[++i]);
+            std::string node;
+            while (std::getline(nodes, node, ',')) {
+                if (node.find(':') == std::string::npos) return false;
+                ring_nodes.push_back(node);
+            }
+        }
+        else if (arg == "--node" && i + 1 < argc) {
+            node_address = argv[++i];
+        }
+        else if (arg == "--vnodes" && i + 1 < argc) {
+            ring_vnodes = std::max<size_t>(1, std::stoull(argv[++i]));
+        }
+        else if (arg == "--document" && i + 1 < argc) {
+            document_name = argv[++i];
+        }
+        else if (arg == "--ready-fd" && i + 1 < argc) {
+            ready_fd = std::stoi(argv[++i]);
+        }
+        else if (arg == "--idle-secs" && i + 1 < argc) {
+            idle_secs = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--max-resident" && i + 1 < argc) {
+            max_resident = std::stoull(argv[++i]);
+        }
+        else if (arg == "--max-packet-bytes" && i + 1 < argc) {
+            max_packet_bytes = std::max<size_t>(BUFFER_SIZE, std::stoull(argv[++i]));
+        }
+        else if (arg == "--max-document-bytes" && i + 1 < argc) {
+            max_document_bytes = std::stoull(argv[++i]);
+        }
+        else if (arg == "--max-outbound-bytes" && i + 1 < argc) {
+            max_outbound_bytes = std::stoull(argv[++i]);
+        }
+        else if (arg == "--bench-ring") {
+            bench_ring = true;
+        }
+        else if (arg == "--bench-alloc") {
+            bench_alloc = true;
+        }
+        else if (arg == "--bench-recovery") {
+            bench_recovery = true;
+        }
+        else if (arg == "--bench-join") {
+            bench_join = true;
+        }
+        else if (arg == "--bench-delta") {
+            bench_delta = true;
+        }
+        else if (arg == "--bench-joiners" && i + 1 < argc) {
+            bench_joiners = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--bench-mb" && i + 1 < argc) {
+            bench_mb = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--bench-ops" && i + 1 < argc) {
+            bench_ops = std::stoull(argv[++i]);
+        }
+        else if (!arg.empty() && arg[0] != '-' && std::all_of(arg.begin(), arg.end(), ::isdigit)) {
+            server_port = std::stoi(arg);
+        }
+        else {
+            return false;
+        }
+        // A routing node passes its options on to its document processes, all
+        // but where it listens and what it routes
+        static const std::vector<std::string> node_only = {
+            "--unix", "--no-unix", "--data-dir", "--ring", "--node", "--vnodes", "--document", "--ready-fd", "--max-resident"
+        };
+        if (arg[0] == '-' && std::find(node_only.begin(), node_only.end(), arg) == node_only.end()) {
+            document_args.insert(document_args.end(), argv + first, argv + i + 1);
+        }
+    }
+    if (!unix_enabled) unix_socket_path.clear();
+    else if (unix_socket_path.empty()) unix_socket_path = "/tmp/np_server_" + std::to_string(server_port) + ".sock";
+    return true;
+}
+
+// Function to open the AF_UNIX listening socket for co-located clients
+int open_unix_listener(const std::string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Unix socket path too long: " << path << std::endl;
+        return -1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Unix socket creation failed");
+        return -1;
+    }
+    unlink(path.c_str()); // Remove a stale socket left by a previous run
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+        perror("Unix socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 // Function to start the server and listen for incoming connections
-int main() {
+int main(int argc, char* argv[]) {
+    if (!parse_arguments(argc, argv)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Rebuild the document from the newest checkpoint and the log before accepting clients
+    if (mkdir(data_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("Data directory unavailable");
+        exit(EXIT_FAILURE);
+    }
+    if (bench_recovery) {
+        return run_recovery_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (bench_join) {
+        return run_join_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (bench_delta) {
+        return run_delta_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (bench_ring) {
+        return run_ring_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // Frames for a full operation history and as many again in flight, made
+    // before any client connects
+    if (ring_nodes.empty()) fill_frame_pool(history_ops + FramePool::MAX_SPARE);
+    if (bench_alloc) {
+        return run_alloc_benchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (!ring_nodes.empty()) {
+        // A routing node holds no document; each one the ring gives it runs in a
+        // process of its own, started with the options given here
+        if (node_address.empty()) node_address = "127.0.0.1:" + std::to_string(server_port);
+        ring = std::make_unique<HashRing>(ring_nodes, ring_vnodes);
+        std::cout << "Routing documents as " << node_address << " on a ring of " << ring_nodes.size() << " nodes." << std::endl;
+    }
+    else if (relay) {
+        // A relay starts empty and takes the document from upstream; it writes nothing to disk
+        std::thread merkle_thread(merkle_loop);
+        merkle_thread.detach();
+        std::thread heartbeat_thread(heartbeat_loop);
+        heartbeat_thread.detach();
+        std::thread follower_thread(follower_loop);
+        follower_thread.detach();
+    }
+    else {
+        std::string single_file_log = data_dir + "/oplog";
+        if (access(single_file_log.c_str(), F_OK) == 0 && list_data_files(data_dir, "wal-").empty()) {
+            rename(single_file_log.c_str(), (data_dir + "/" + data_file_name("wal-", 1)).c_str());
+        }
+        if (!recover_document()) {
+            exit(EXIT_FAILURE);
+        }
+        load_epoch();
+        std::thread flusher_thread(oplog_flusher);
+        flusher_thread.detach();
+        std::thread checkpoint_thread(checkpoint_loop);
+        checkpoint_thread.detach();
+        std::thread merkle_thread(merkle_loop);
+        merkle_thread.detach();
+        std::thread heartbeat_thread(heartbeat_loop);
+        heartbeat_thread.detach();
+        if (following) {
+            std::thread follower_thread(follower_loop);
+            follower_thread.detach();
+        }
+    }
+
     // Register signal handler for graceful shutdown
     signal(SIGINT, handle_signal);
 
-    // Create a TCP socket
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Create a TCP socket. Every descriptor the server opens is close-on-exec,
+    // so document processes started on a routing node inherit none of them.
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (listen_fd < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
@@ -436,7 +6273,7 @@ int main() {
 
     servaddr.sin_family = AF_INET;             // IPv4
     servaddr.sin_addr.s_addr = INADDR_ANY;     // Listen on all interfaces
-    servaddr.sin_port = htons(PORT);           // Server port
+    servaddr.sin_port = htons(server_port);    // Server port
 
     // Bind the socket to the address and port
     if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
@@ -452,41 +6289,99 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    std::cout << "Server started on port " << PORT << "." << std::endl;
+    // Port 0 lets the system pick one, as document processes on a routing node do
+    if (server_port == 0) {
+        socklen_t length = sizeof(servaddr);
+        getsockname(listen_fd, (struct sockaddr*)&servaddr, &length);
+        server_port = ntohs(servaddr.sin_port);
+    }
+
+    std::cout << "Server started on port " << server_port << "." << std::endl;
+
+    // Also accept co-located clients on an AF_UNIX socket
+    if (!unix_socket_path.empty()) {
+        unix_listen_fd = open_unix_listener(unix_socket_path);
+        if (unix_listen_fd >= 0) {
+            std::cout << "Listening on unix socket " << unix_socket_path << "." << std::endl;
+        }
+    }
+
+    // Open the UDP side channel for cursor/presence datagrams on the same port
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (udp_fd < 0 || bind(udp_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+        perror("UDP side channel unavailable");
+        if (udp_fd >= 0) close(udp_fd);
+        udp_fd = -1;
+    }
+    else {
+        std::thread udp_thread(udp_loop);
+        udp_thread.detach();
+    }
+
+    // Publish coalesced cursor positions at a fixed tick
+    std::thread presence_thread(presence_loop);
+    presence_thread.detach();
+
+    // Fan operations out to observers
+    std::thread observer_thread(observer_loop);
+    observer_thread.detach();
 
     // Start a thread to receive messages (optional, depending on design)
     // For this implementation, we'll handle clients in separate threads.
 
+    // The routing node that started this process waits for its port, then
+    // hears whether it is idle. Reports never block: a full pipe drops them.
+    if (ready_fd >= 0) {
+        std::string port = std::to_string(server_port) + "\n";
+        write_fully(ready_fd, port.data(), port.size());
+        fcntl(ready_fd, F_SETFL, O_NONBLOCK);
+        std::thread idle_thread(idle_loop);
+        idle_thread.detach();
+    }
+
     // Main loop to accept incoming connections
     while (server_running) { // Use the atomic flag for loop control
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (server_running) { // Only report errors if the server is still running
-                perror("Accept failed");
-            }
-            continue; // Continue accepting other connections
+        pollfd listeners[2] = {
+            {listen_fd, POLLIN, 0},
+            {unix_listen_fd, POLLIN, 0}          // Ignored by poll when -1
+        };
+        if (poll(listeners, 2, -1) < 0) {
+            if (server_running && errno != EINTR) perror("Poll failed");
+            continue;
         }
 
-        // Check if maximum clients reached
-        {
-            std::lock_guard<std::mutex> lock(users_mutex);
-            if (users.size() >= MAX_CLIENTS) {
-                std::cerr << "Maximum clients reached. Refusing connection from "
-                          << inet_ntoa(client_addr.sin_addr) << ":" << ntohs(client_addr.sin_port) << "." << std::endl;
-                close(client_fd);
-                continue;
+        for (const pollfd& listener : listeners) {
+            if (!(listener.revents & POLLIN)) continue;
+
+            struct sockaddr_storage client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            int client_fd = accept4(listener.fd, (struct sockaddr*)&client_addr, &client_len, SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                if (server_running) { // Only report errors if the server is still running
+                    perror("Accept failed");
+                }
+                continue; // Continue accepting other connections
+            }
+
+            std::string peer = "unix socket";
+            if (client_addr.ss_family == AF_INET) {
+                auto* in_addr = (struct sockaddr_in*)&client_addr;
+                peer = std::string(inet_ntoa(in_addr->sin_addr)) + ":" + std::to_string(ntohs(in_addr->sin_port));
             }
-        }
 
-        // Start a new thread to handle the client
-        std::thread client_thread(handle_client, client_fd);
-        client_thread.detach(); // Detach the thread to allow independent execution
+            // Start a new thread to handle the client
+            auto conn = std::allocate_shared<SocketConnection>(SlabAllocator<SocketConnection>(), client_fd, peer, client_addr.ss_family == AF_UNIX);
+            std::thread client_thread(handle_client, conn, next_client_id++);
+            client_thread.detach(); // Detach the thread to allow independent execution
+        }
     }
 
-    // Close the listening socket
+    // Close the listening sockets
     close(listen_fd);
+    if (unix_listen_fd >= 0) {
+        close(unix_listen_fd);
+        unlink(unix_socket_path.c_str());
+    }
 
     // Optionally, notify all clients about server shutdown
     json shutdown_msg = {
@@ -498,14 +6393,42 @@ int main() {
     };
     broadcast_message(shutdown_msg);
 
-    // Close all client connections
+    // Let each writer flush the shutdown notice and close its connection
     {
         std::lock_guard<std::mutex> lock(users_mutex);
-        for (const auto& [fd, user] : users) {
-            send_all(fd, shutdown_msg.dump() + "\n");
-            close(fd);
+        for (const auto& [id, user] : users) {
+            {
+                std::lock_guard<std::mutex> outbox_lock(user.outbox->mutex);
+                user.outbox->closing = true;
+            }
+            user.outbox->cv.notify_one();
+        }
+    }
+
+    // Wait briefly for client threads to finish their cleanup
+    for (int i = 0; i < 100; ++i) {
+        {
+            std::lock_guard<std::mutex> lock(users_mutex);
+            if (users.empty()) break;
         }
-        users.clear();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (ring) {
+        // Each document process checkpoints on its own way down
+        std::lock_guard<std::mutex> lock(documents_mutex);
+        for (const auto& [name, process] : documents) kill(process.pid, SIGINT);
+        for (const auto& [name, process] : documents) {
+            waitpid(process.pid, nullptr, 0);
+            close(process.status_fd);
+        }
+    }
+    else if (!relay) {
+        // Checkpoint so the next start has no log to replay, then make any
+        // operation applied since durable before exiting
+        checkpoint_document();
+        std::lock_guard<FairMutex> lock(buffer_mutex);
+        oplog.close_log();
     }
 
     std::cout << "Server shutdown complete." << std::endl;
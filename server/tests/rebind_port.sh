@@ -0,0 +1,66 @@
+#!/bin/bash
+# server/tests/rebind_port.sh
+#
+# A routing node starts a document process and is then killed. Document
+# processes must not inherit the node's sockets, so a new server has to be
+# able to bind the node's port (TCP and UDP) while the document still runs.
+#
+# Usage: tests/rebind_port.sh [SERVER] (default build/server); PORT overrides 8671.
+
+SERVER=${1:-build/server}
+PORT=${PORT:-8671}
+DIR=$(mktemp -d)
+NODE=
+DOCUMENT=
+REBOUND=
+
+cleanup() {
+    for pid in $NODE $DOCUMENT $REBOUND; do kill -9 "$pid" 2>/dev/null; done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    for log in "$DIR"/*.log; do echo "--- $log"; cat "$log"; done
+    exit 1
+}
+
+# Wait up to 5 s for a line matching $2 in log $1
+wait_for() {
+    for _ in $(seq 50); do
+        grep -q "$2" "$1" 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+"$SERVER" "$PORT" --no-unix --ring "127.0.0.1:$PORT" --data-dir "$DIR/node" > "$DIR/node.log" 2>&1 &
+NODE=$!
+disown
+wait_for "$DIR/node.log" "Server started on port $PORT" || fail "the routing node did not start"
+
+# Naming a document makes the node start its process; a second client stays
+# connected, so the node holds an accepted socket when it forks
+exec 3<>"/dev/tcp/127.0.0.1/$PORT" || fail "cannot connect to the routing node"
+exec 4<>"/dev/tcp/127.0.0.1/$PORT" || fail "cannot connect to the routing node"
+printf '{"name":"probe","document":"rebind"}\n' >&4
+read -r -t 5 reply <&4
+exec 4<&-
+[[ $reply == *redirect* ]] || fail "no redirect for the document: $reply"
+DOCUMENT=$(sed -n "s/^Started document 'rebind' on port [0-9]* (pid \([0-9]*\)).*/\1/p" "$DIR/node.log")
+[ -n "$DOCUMENT" ] || fail "the node did not report starting the document"
+
+kill -9 "$NODE"
+while kill -0 "$NODE" 2>/dev/null; do sleep 0.1; done
+NODE=
+exec 3<&-
+kill -0 "$DOCUMENT" 2>/dev/null || fail "the document process exited with the node"
+
+"$SERVER" "$PORT" --no-unix --data-dir "$DIR/rebound" > "$DIR/rebound.log" 2>&1 &
+REBOUND=$!
+disown
+wait_for "$DIR/rebound.log" "Server started on port $PORT\|Bind failed" || fail "the new server did not start"
+grep -q "Bind failed" "$DIR/rebound.log" && fail "the document process still holds TCP port $PORT"
+grep -q "UDP side channel unavailable" "$DIR/rebound.log" && fail "the document process still holds UDP port $PORT"
+echo "PASS: port $PORT rebound while document process $DOCUMENT kept running"